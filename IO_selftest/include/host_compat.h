@@ -0,0 +1,34 @@
+/**
+ * @file    host_compat.h
+ * @author  Daniel Lockhead
+ * @date    2024
+ *
+ * @brief   SDK detection for the modules also built on the host
+ *
+ * @details The firmware build includes pico.h and defines SELFTEST_SDK. The host build, used by the
+ *          tests in test/, has no SDK: the RAM placement macros are then empty.
+ *
+ * @copyright Copyright (c) 2024, D.Lockhead. All rights reserved.
+ *
+ * This software is licensed under the BSD 3-Clause License.
+ * See the LICENSE file for more details.
+ */
+
+#ifndef _HOST_COMPAT_H_
+#    define _HOST_COMPAT_H_
+
+#    if defined(__has_include)
+#        if __has_include("pico.h")
+#            include "pico.h"
+#            define SELFTEST_SDK 1 ///< Firmware build.
+#        endif
+#    endif
+
+#    ifndef __not_in_flash_func
+#        define __not_in_flash_func(func) func ///< Host build, no RAM placement.
+#    endif
+#    ifndef __not_in_flash
+#        define __not_in_flash(group) ///< Host build, no RAM placement.
+#    endif
+
+#endif // _HOST_COMPAT_H_
@@ -0,0 +1,200 @@
+/**
+ * @file    log_queue.h
+ * @author  Daniel Lockhead
+ * @date    2024
+ *
+ * @brief   Lock-free event rings between the interrupt handlers and the main loop
+ *
+ * @details One single-producer/single-consumer ring exists per event source. The producer is
+ *          selected from the active exception number and the core, so every ring has exactly one
+ *          writer: the thread mode of one core or one family of interrupt handlers running at the
+ *          same priority. The core1 service loop is the only consumer.
+ *
+ *          Core1 copies each event to one more ring, read by the I2C master through the log
+ *          stream command. For this ring core1 is the producer and the I2C interrupt on core0 is
+ *          the consumer.
+ *
+ *          Producers reserve a slot, write a binary event record directly into it and commit it.
+ *          Consumers peek the oldest slot, use it in place and release it. No record is copied and
+ *          the text formatting is done only by the main loop with log_format().
+ *
+ * @copyright Copyright (c) 2024, D.Lockhead. All rights reserved.
+ *
+ * This software is licensed under the BSD 3-Clause License.
+ * See the LICENSE file for more details.
+ */
+
+#include "hardware/irq.h"
+#include "hardware/sync.h"
+#include "hardware/timer.h"
+#include "log_ring.h"
+#include "selftest.h"
+#include "userconfig.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifndef _LOG_QUEUE_H_
+#    define _LOG_QUEUE_H_
+
+#    ifdef __cplusplus
+extern "C"
+{
+#    endif
+
+    /**
+     * @brief Event identifiers stored in EVENT.event
+     */
+    typedef enum
+    {
+        EV_BOOT,        ///< Firmware boot, gpio = I2C address, value = version major << 8 | minor.
+        EV_WATCHDOG,    ///< Reboot caused by the watchdog.
+        EV_HEARTBEAT,   ///< Periodic heartbeat, gpio = I2C address, value = version major << 8 | minor.
+        EV_CMD_WRITE,   ///< Write command executed, gpio = data byte, value = extra parameter.
+        EV_CMD_READ,    ///< Get command executed, gpio = parameter, value = value read.
+        EV_READ_REPLY,  ///< Register returned to the master, value = register content.
+        EV_UART_IRQ,    ///< UART receive interrupt entered.
+        EV_UART_RX,     ///< Character received and echoed by the UART, value = character.
+        EV_SPI_RX8,     ///< 8 bits SPI frame, gpio = position, value = read data | write data << 16.
+        EV_SPI_RX16,    ///< 16 bits SPI frame, gpio = position, value = read data | write data << 16.
+        EV_SPI_ENABLE,  ///< SPI slave enabled, gpio = engine byte (116), value = frames per DMA buffer | pattern << 16.
+        EV_SPI_DISABLE, ///< SPI slave disabled.
+        EV_SPI_FORMAT,  ///< SPI format programmed, value = SPI configuration byte.
+        EV_CMD_ERROR,   ///< Command rejected, gpio = data byte, value = multi-byte data.
+        EV_SCRIPT_END,  ///< Script ended, gpio = pc of the last opcode, value = script state.
+        EV_SPI_FRAME,   ///< SPI DMA buffer completed, gpio = SPI_END_CS or SPI_END_FULL, value = frames | lost << 16.
+        EV_SPI_RX32,    ///< SPI frame over 16 bits (PIO engine), gpio = position, value = read data.
+    } event_id_t;
+
+    /**
+     * @brief Subsystems with their own log level
+     */
+    typedef enum
+    {
+        LOG_SYS,       ///< Boot, heartbeat, status and version.
+        LOG_I2C,       ///< I2C slave protocol.
+        LOG_GPIO,      ///< GPIO commands.
+        LOG_SPI,       ///< SPI slave.
+        LOG_UART,      ///< UART.
+        LOG_PWM,       ///< PWM frequency output.
+        LOG_SUB_COUNT, ///< Number of subsystems.
+    } log_subsystem_t;
+
+/**
+ * @brief Log levels, an event is recorded when its level is lower or equal to the level of its subsystem.
+ */
+#    define LOG_OFF 0     ///< No event recorded.
+#    define LOG_ERROR 1   ///< Errors only.
+#    define LOG_WARNING 2 ///< Errors and warnings.
+#    define LOG_INFO 3    ///< Commands executed.
+#    define LOG_DEBUG 4   ///< Every byte and character.
+
+#    define LOG_SUB_ALL 0x0f   ///< Subsystem value selecting all subsystems in log_set_level().
+#    define LOG_BUS_EMPTY 0xff ///< Byte returned by the log stream command when no event is pending.
+
+    /**
+     * @brief Source of an event, one ring per source.
+     */
+    typedef enum
+    {
+        LOG_SRC_MAIN,  ///< Main loop (thread mode of core0).
+        LOG_SRC_CORE1, ///< Service loop (thread mode of core1).
+        LOG_SRC_I2C,   ///< I2C slave interrupt.
+        LOG_SRC_SPI,   ///< SPI slave interrupt.
+        LOG_SRC_UART,  ///< UART receive interrupt.
+        LOG_SRC_IRQ,   ///< Any other interrupt.
+        LOG_SRC_COUNT, ///< Number of sources.
+    } log_source_t;
+
+    extern log_ring_t log_rings[LOG_SRC_COUNT];
+    extern log_ring_t log_bus;
+    extern volatile uint8_t log_level[LOG_SUB_COUNT];
+
+    /**
+     * @brief Return the source owning the ring for the code currently executing.
+     *
+     * @return log_source_t  Ring to use by the caller
+     */
+    static inline log_source_t log_source(void)
+    {
+        uint exception = __get_current_exception();
+
+        if (exception == 0)
+        {
+            return get_core_num() == 0 ? LOG_SRC_MAIN : LOG_SRC_CORE1;
+        }
+
+        switch (exception - VTABLE_FIRST_IRQ)
+        {
+        case I2C0_IRQ:
+        case I2C1_IRQ:
+            return LOG_SRC_I2C;
+        case SPI0_IRQ:
+        case DMA_IRQ_0:    // SPI slave DMA
+        case IO_IRQ_BANK0: // SPI slave CS rising edge, same frame end as the DMA
+            return LOG_SRC_SPI;
+        case UART0_IRQ:
+            return LOG_SRC_UART;
+        default:
+            return LOG_SRC_IRQ;
+        }
+    }
+
+    /**
+     * @brief Record an event in the ring of the caller. Only the binary record is written,
+     *        so this is safe to call from the interrupt handlers.
+     *
+     * @param event  Event identifier
+     * @param cmd    Command byte
+     * @param gpio   GPIO number or data byte
+     * @param value  Value read or applied
+     * @return true if the event was queued, false if the ring is full.
+     */
+    static inline bool log_event(event_id_t event, uint8_t cmd, uint8_t gpio, uint32_t value)
+    {
+        log_ring_t* ring = &log_rings[log_source()];
+        EVENT* ev = log_reserve(ring);
+
+        if (ev == NULL)
+        {
+            return false;
+        }
+        ev->time = time_us_32();
+        ev->event = event;
+        ev->cmd = cmd;
+        ev->gpio = gpio;
+        ev->value = value;
+        log_commit(ring);
+        return true;
+    }
+
+/**
+ * @brief Record an event if its level is enabled for the subsystem.
+ *
+ * Levels above LOG_LEVEL_BUILD (set by CMake) are removed by the compiler, the others cost one
+ * compare with the runtime level of the subsystem when disabled.
+ */
+#    define LOG_EVENT(sub, level, event, cmd, gpio, value)                                                                                      \
+        do                                                                                                                                     \
+        {                                                                                                                                      \
+            if ((level) <= LOG_LEVEL_BUILD && (level) <= log_level[(sub)])                                                                     \
+            {                                                                                                                                  \
+                log_event((event), (cmd), (gpio), (value));                                                                                    \
+            }                                                                                                                                  \
+        } while (0)
+
+    void log_init(void);
+    bool log_set_level(uint8_t config);
+    EVENT* log_oldest(log_ring_t** ring);
+    uint32_t log_dropped(void);
+    void log_format(const EVENT* ev, char* str, size_t len);
+    uint32_t log_drain(uint8_t address);
+    uint8_t log_bus_pending(void);
+    uint8_t log_bus_dropped(void);
+    void log_bus_clear_drop(void);
+    uint8_t log_bus_read_byte(void);
+
+#    ifdef __cplusplus
+}
+#    endif
+
+#endif // _LOG_QUEUE_H_
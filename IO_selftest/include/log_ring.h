@@ -0,0 +1,152 @@
+/**
+ * @file    log_ring.h
+ * @author  Daniel Lockhead
+ * @date    2024
+ *
+ * @brief   Single-producer/single-consumer ring of event records
+ *
+ * @details Index arithmetic and memory barriers of the event rings, without any dependency on the
+ *          SDK so the ring can be built and tested on the host. The host tests build it with a
+ *          smaller QUEUE_SIZE.
+ *
+ *          On the RP2040 the barriers are __dmb(), on the host they are full compiler and CPU fences.
+ *
+ * @copyright Copyright (c) 2024, D.Lockhead. All rights reserved.
+ *
+ * This software is licensed under the BSD 3-Clause License.
+ * See the LICENSE file for more details.
+ */
+
+#ifndef _LOG_RING_H_
+#    define _LOG_RING_H_
+
+#    include "host_compat.h"
+#    include <assert.h>
+#    include <stddef.h>
+#    include <stdint.h>
+#    ifdef SELFTEST_SDK
+#        include "hardware/sync.h"
+#    endif
+
+#    ifdef __cplusplus
+extern "C"
+{
+#    endif
+
+#    ifndef QUEUE_SIZE
+#        define QUEUE_SIZE 64 ///< Queue size per message source, must be a power of two.
+#    endif
+
+#    ifdef SELFTEST_SDK
+#        define LOG_RING_BARRIER() __dmb() ///< Data memory barrier between the two cores.
+#    else
+#        define LOG_RING_BARRIER() __atomic_thread_fence(__ATOMIC_SEQ_CST) ///< Host build, full fence.
+#    endif
+
+    /**
+     * @brief Binary event record, formatted to text only by the main loop.
+     */
+    typedef struct
+    {
+        uint32_t time;  ///< Timestamp in us (time_us_32()).
+        uint8_t event;  ///< Event identifier (EV_xxx).
+        uint8_t cmd;    ///< Command byte related to the event.
+        uint8_t gpio;   ///< GPIO number or data byte of the command.
+        uint8_t spare;  ///< Spare, keeps the record 32 bit aligned.
+        uint32_t value; ///< Value read or applied.
+    } EVENT;
+
+    static_assert((QUEUE_SIZE & (QUEUE_SIZE - 1)) == 0, "QUEUE_SIZE must be a power of two");
+    static_assert(sizeof(EVENT) == 12, "EVENT is read by the I2C master as a 12 bytes record");
+
+#    define QUEUE_MASK (QUEUE_SIZE - 1) ///< Mask used to convert a free running index to a slot index.
+
+    /**
+     * @brief Single-producer/single-consumer ring of events.
+     *
+     * The head and tail indexes are free running, the slot is selected with QUEUE_MASK.
+     * Only the producer writes head and drop, only the consumer writes tail.
+     */
+    typedef struct
+    {
+        EVENT slot[QUEUE_SIZE]; ///< Event storage.
+        volatile uint32_t head; ///< Number of events committed by the producer.
+        volatile uint32_t tail; ///< Number of events released by the consumer.
+        volatile uint32_t drop; ///< Number of events lost because the ring was full.
+    } log_ring_t;
+
+    /**
+     * @brief Reserve the next free slot of a ring. The slot is not visible to the consumer
+     *        before log_commit() is called.
+     *
+     * @param ring  Ring to use, must be the ring owned by the caller
+     * @return EVENT*  Slot to fill, NULL if the ring is full
+     */
+    static inline EVENT* log_reserve(log_ring_t* ring)
+    {
+        uint32_t head = ring->head;
+
+        if (head - ring->tail >= QUEUE_SIZE)
+        {
+            ring->drop++;
+            return NULL;
+        }
+        return &ring->slot[head & QUEUE_MASK];
+    }
+
+    /**
+     * @brief Publish the slot returned by the last log_reserve() on this ring.
+     *
+     * @param ring  Ring to use
+     */
+    static inline void log_commit(log_ring_t* ring)
+    {
+        LOG_RING_BARRIER(); // slot content must be visible before the new head
+        ring->head = ring->head + 1;
+    }
+
+    /**
+     * @brief Return the oldest committed slot of a ring without removing it.
+     *
+     * @param ring  Ring to read
+     * @return EVENT*  Oldest event, NULL if the ring is empty
+     */
+    static inline EVENT* log_peek(log_ring_t* ring)
+    {
+        uint32_t tail = ring->tail;
+
+        if (ring->head == tail)
+        {
+            return NULL;
+        }
+        LOG_RING_BARRIER(); // head must be read before the slot content
+        return &ring->slot[tail & QUEUE_MASK];
+    }
+
+    /**
+     * @brief Give back to the producer the slot returned by the last log_peek() on this ring.
+     *
+     * @param ring  Ring to use
+     */
+    static inline void log_release(log_ring_t* ring)
+    {
+        LOG_RING_BARRIER(); // slot content must be consumed before the new tail
+        ring->tail = ring->tail + 1;
+    }
+
+    /**
+     * @brief Return the number of events waiting in a ring.
+     *
+     * @param ring  Ring to use
+     * @return uint32_t  Number of events committed and not yet released
+     */
+    static inline uint32_t log_count(const log_ring_t* ring)
+    {
+        return ring->head - ring->tail;
+    }
+
+#    ifdef __cplusplus
+}
+#    endif
+
+#endif // _LOG_RING_H_
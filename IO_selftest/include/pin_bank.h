@@ -0,0 +1,52 @@
+/**
+ * @file    pin_bank.h
+ * @author  Daniel Lockhead
+ * @date    2024
+ *
+ * @brief   Shadow pin configuration applied by a single commit
+ *
+ * @details The master fills a shadow copy of the configuration of all GPIO with burst writes, nothing
+ *          changes on the pins. The commit then applies the whole bank in a few microseconds: output
+ *          levels and directions with one masked SIO write each, pads and functions in a tight loop.
+ *          The configuration found on the pins before the commit is saved, a restore puts it back.
+ *
+ *          Each pin takes 3 bytes in the shadow stream:
+ *
+ *          | Byte | Content                                                                  |
+ *          |------|--------------------------------------------------------------------------|
+ *          | 0    | Pad register (as command 60): OD, IE, drive, pull-up, pull-down, Schmitt |
+ *          | 1    | Function select (as command 75)                                          |
+ *          | 2    | Bit 0 output level, bit 1 direction output                               |
+ *
+ * @copyright Copyright (c) 2024, D.Lockhead. All rights reserved.
+ *
+ * This software is licensed under the BSD 3-Clause License.
+ * See the LICENSE file for more details.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifndef _PIN_BANK_H_
+#    define _PIN_BANK_H_
+
+#    ifdef __cplusplus
+extern "C"
+{
+#    endif
+
+#    define PIN_BANK_BYTES 3 ///< Shadow stream bytes per pin.
+
+    void pin_bank_init(void);
+    void pin_bank_select(uint8_t pin);
+    bool pin_bank_write(uint8_t value);
+    uint8_t pin_bank_read(void);
+    void pin_bank_load(void);
+    void pin_bank_commit(uint32_t mask);
+    void pin_bank_restore(uint32_t mask);
+
+#    ifdef __cplusplus
+}
+#    endif
+
+#endif // _PIN_BANK_H_
@@ -0,0 +1,107 @@
+/**
+ * @file    script.h
+ * @author  Daniel Lockhead
+ * @date    2024
+ *
+ * @brief   Bytecode script engine, runs a selftest sequence on the Pico without the I2C master
+ *
+ * @details The master uploads a script with the script commands, starts it and reads back the
+ *          state and the result buffer. The interpreter executes the existing commands through
+ *          script_io_t, so it does not depend on the SDK and can be built on the host.
+ *
+ *          | Opcode | Name       | Operands          | Action                                              |
+ *          |--------|------------|-------------------|-----------------------------------------------------|
+ *          | 0x00   | END        |                   | Stop, state PASS                                    |
+ *          | 0x01   | SET        | gpio              | Command 11, set gpio                                |
+ *          | 0x02   | CLR        | gpio              | Command 10, clear gpio                              |
+ *          | 0x03   | DIR        | gpio, out         | Command 20 (out = 1) or 21 (out = 0)                |
+ *          | 0x04   | READ       | gpio              | Command 15, level added to the result buffer        |
+ *          | 0x05   | EXPECT     | gpio, level       | Command 15, state FAIL if the level is different    |
+ *          | 0x06   | WAIT_US    | us (2 bytes LE)   | Wait, the main loop keeps running                   |
+ *          | 0x07   | WAIT_MS    | ms (2 bytes LE)   | Wait, the main loop keeps running                   |
+ *          | 0x08   | LOOP       | count             | Repeat up to the matching NEXT, count 0 = 256       |
+ *          | 0x09   | NEXT       |                   | End of the LOOP body                                |
+ *          | 0x0A   | CMD        | cmd, data         | Write command                                       |
+ *          | 0x0B   | GET        | cmd, param        | Read command, value added to the result buffer      |
+ *          | 0x0C   | EXPECT_GET | cmd, param, value | Read command, state FAIL if the value is different  |
+ *
+ * @copyright Copyright (c) 2024, D.Lockhead. All rights reserved.
+ *
+ * This software is licensed under the BSD 3-Clause License.
+ * See the LICENSE file for more details.
+ */
+
+#ifndef _SCRIPT_H_
+#    define _SCRIPT_H_
+
+#    include "host_compat.h"
+#    include <stdbool.h>
+#    include <stdint.h>
+
+#    ifdef __cplusplus
+extern "C"
+{
+#    endif
+
+#    define SCRIPT_SIZE 256       ///< Largest script, in bytes.
+#    define SCRIPT_RESULT_SIZE 64 ///< Size of the result buffer.
+#    define SCRIPT_LOOP_DEPTH 4   ///< Maximum number of nested loops.
+#    define SCRIPT_STEPS 64       ///< Opcodes executed by each call of script_task().
+
+    /**
+     * @brief Script opcodes
+     */
+    typedef enum
+    {
+        OP_END,
+        OP_SET,
+        OP_CLR,
+        OP_DIR,
+        OP_READ,
+        OP_EXPECT,
+        OP_WAIT_US,
+        OP_WAIT_MS,
+        OP_LOOP,
+        OP_NEXT,
+        OP_CMD,
+        OP_GET,
+        OP_EXPECT_GET,
+    } script_op_t;
+
+    /**
+     * @brief Script state, read by the master
+     */
+    typedef enum
+    {
+        SCRIPT_IDLE,  ///< No script started since the last upload.
+        SCRIPT_BUSY,  ///< Script running.
+        SCRIPT_PASS,  ///< Script reached END without failed check.
+        SCRIPT_FAIL,  ///< An EXPECT or EXPECT_GET check failed, the pc points to it.
+        SCRIPT_ERROR, ///< Invalid opcode, operand or command, the pc points to it.
+    } script_state_t;
+
+    /**
+     * @brief Access to the commands, provided by the caller of script_task()
+     */
+    typedef struct
+    {
+        bool (*write)(uint8_t cmd, uint8_t data);                 ///< Execute a write command, false if refused.
+        bool (*read)(uint8_t cmd, uint8_t param, uint8_t* value); ///< Execute a read command, false if refused.
+        uint32_t (*time_us)(void);                                ///< Free running time in us.
+    } script_io_t;
+
+    void script_reset(void);
+    bool script_load(uint8_t byte);
+    bool script_start(void);
+    bool script_task(const script_io_t* io);
+    uint8_t script_state(void);
+    uint8_t script_pc(void);
+    uint8_t script_result_count(void);
+    uint8_t script_result_byte(void);
+    void script_result_rewind(void);
+
+#    ifdef __cplusplus
+}
+#    endif
+
+#endif // _SCRIPT_H_
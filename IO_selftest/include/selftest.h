@@ -12,6 +12,7 @@
  * See the LICENSE file for more details.
  */
 
+#include "userconfig.h"
 #include <stdbool.h>
 #include <stdint.h>
 
@@ -47,20 +48,33 @@ extern "C"
 #        define I2C_SLAVE_SCL_PIN 7 /**< SCL pin for I2C slave in normal operation. */
 #    endif
 
-#    define MESSAGE_SIZE 120          ///< Size of each message.
-#    define QUEUE_SIZE 255            ///< Queue size, set high for development.
+/**
+ * @brief Second I2C slave port on i2c0, enabled with the SELFTEST_I2C0_SLAVE CMake option.
+ */
+#    if SELFTEST_I2C0_SLAVE
+#        ifdef DEBUG_CODE
+#            error "SELFTEST_I2C0_SLAVE uses i2c0, already used by the DEBUG_CODE loopback master"
+#        endif
+#        define I2C_AUX_SDA_PIN 20       /**< SDA pin of the second slave port. */
+#        define I2C_AUX_SCL_PIN 21       /**< SCL pin of the second slave port. */
+#        define I2C_AUX_ADDRESS_OFFSET 4 /**< Address of the second port = main address + 4. */
+
+#        define I2C_AUX_PINS_MASK ((1ul << I2C_AUX_SDA_PIN) | (1ul << I2C_AUX_SCL_PIN)) /**< Pins removed from the user GPIO. */
+#    else
+#        define I2C_AUX_PINS_MASK 0ul /**< No second port, all user GPIO are available. */
+#    endif
+
+#    define CMD_QUEUE_SIZE 16         ///< Slow commands waiting for the main loop, must be a power of two.
 #    define WATCHDOG_TIMEOUT_MS 10000 ///< Watchdog timeout (10 seconds).
+#    define LED_SLOW_MS 4000          ///< Led toggle period in normal operation.
+#    define LED_FAST_MS 500           ///< Led toggle period after a watchdog reboot.
+#    define LED_ACTIVITY_MS 50        ///< Led OFF time when messages are sent to the console.
+#    define HEARTBEAT_MS 15000        ///< Period of the heartbeat message.
+#    define LOG_BATCH_SIZE 512        ///< Maximum number of characters sent to the console in one write.
+#    define TLM_EVENTS_MAX 64         ///< Maximum number of events sent in one telemetry frame.
+#    define TLM_COUNTERS_MS 1000      ///< Period of the performance counters telemetry frame.
 #    define GPIOF 10                  ///< GPIO pin used to generate frequency output.
 
-    /**
-     * @brief Structure representing a message.
-     */
-    typedef struct
-    {
-        char data[MESSAGE_SIZE]; ///< Data contained in the message.
-    } MESSAGE;
-
-    bool enque(MESSAGE* message);
     void set_pwm_frequency(bool setpwm, uint8_t sfreq);
 
 #    ifdef __cplusplus
@@ -79,8 +79,9 @@ extern "C"
     void enable_uart(uint8_t rts_cts);
     void disable_uart(uint8_t mode);
     void set_default_serial(void);
-    void set_uart_protocol(uint8_t cfg_uart, char* resultstr);
-    uint8_t get_uart_protocol(char* resultstr);
+    void set_uart_protocol(uint8_t cfg_uart);
+    uint8_t get_uart_protocol(void);
+    void uart_string_protocol(uint8_t config, char* protocol_string);
 
 #    ifdef DEBUG_CODE
     void test_serial_command(void);
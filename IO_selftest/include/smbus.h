@@ -0,0 +1,38 @@
+/**
+ * @file    smbus.h
+ * @author  Daniel Lockhead
+ * @date    2024
+ *
+ * @brief   SMBus Packet Error Code (CRC-8) used by the block commands
+ *
+ * @details The PEC is a CRC-8 with polynomial x^8 + x^2 + x + 1 (0x07), initial value 0, computed
+ *          over every byte of the transaction including the address bytes. The table version costs
+ *          one lookup per byte, so it can run inside the I2C interrupt.
+ *
+ * @copyright Copyright (c) 2024, D.Lockhead. All rights reserved.
+ *
+ * This software is licensed under the BSD 3-Clause License.
+ * See the LICENSE file for more details.
+ */
+
+#ifndef _SMBUS_H_
+#    define _SMBUS_H_
+
+#    include "host_compat.h"
+#    include <stddef.h>
+#    include <stdint.h>
+
+#    ifdef __cplusplus
+extern "C"
+{
+#    endif
+
+#    define SMBUS_BLOCK_MAX 32 ///< Largest block, in data bytes (SMBus 2.0).
+
+    uint8_t smbus_crc8(uint8_t crc, const uint8_t* data, size_t len);
+
+#    ifdef __cplusplus
+}
+#    endif
+
+#endif // _SMBUS_H_
@@ -0,0 +1,81 @@
+/**
+ * @file    spi_pattern.h
+ * @author  Daniel Lockhead
+ * @date    2024
+ *
+ * @brief   SPI test patterns, generated and checked on chip for the link qualification
+ *
+ * @details In a pattern mode the SPI slave returns a continuous pattern instead of the inverted
+ *          received words, and checks the words of the master against the same pattern. Nothing is
+ *          logged per word, only counters are kept, so long transfers can run at full speed.
+ *
+ *          | Pattern | Sequence                                                              |
+ *          |---------|-----------------------------------------------------------------------|
+ *          | PRBS7   | x^7 + x^6 + 1, seed all ones                                          |
+ *          | PRBS15  | x^15 + x^14 + 1, seed all ones                                        |
+ *          | PRBS31  | x^31 + x^28 + 1, seed all ones                                        |
+ *          | Walk    | One bit set, moving from bit 0 to the MSB of the word, then bit 0     |
+ *          | Counter | 0, 1, 2... wrapping at the word size                                  |
+ *
+ *          The PRBS bits fill each word MSB first, the sequences are not inverted. The checker is
+ *          self-synchronizing: each received word is compared with the value predicted from the
+ *          previous received words, the master can start anywhere in the sequence. A single wrong
+ *          bit is counted 3 times by the PRBS checkers (the bit and the two bits it predicts), a wrong
+ *          walk or counter word is also counted in the next word.
+ *
+ * @copyright Copyright (c) 2024, D.Lockhead. All rights reserved.
+ *
+ * This software is licensed under the BSD 3-Clause License.
+ * See the LICENSE file for more details.
+ */
+
+#ifndef _SPI_PATTERN_H_
+#    define _SPI_PATTERN_H_
+
+#    include "host_compat.h"
+#    include <stdbool.h>
+#    include <stdint.h>
+
+#    ifdef __cplusplus
+extern "C"
+{
+#    endif
+
+    /**
+     * @brief Patterns selected by command 117
+     */
+    typedef enum
+    {
+        SPI_PATTERN_ECHO,    ///< No pattern, each reply is the inverted received word.
+        SPI_PATTERN_PRBS7,   ///< PRBS7.
+        SPI_PATTERN_PRBS15,  ///< PRBS15.
+        SPI_PATTERN_PRBS31,  ///< PRBS31.
+        SPI_PATTERN_WALK,    ///< Walking ones.
+        SPI_PATTERN_COUNTER, ///< Counter.
+        SPI_PATTERN_COUNT,   ///< Number of patterns.
+    } spi_pattern_t;
+
+    /**
+     * @brief Counters of the checker, read by command 118, all little endian uint32.
+     */
+    typedef struct
+    {
+        uint32_t errors;   ///< Bits different from the expected pattern.
+        uint32_t words;    ///< Words received and checked.
+        uint32_t frames;   ///< Frames ended by CS or by a full buffer.
+        uint32_t overruns; ///< Frames who lost received words (FIFO overrun or words beyond the buffer).
+    } spi_pattern_stats_t;
+
+    bool spi_pattern_select(uint8_t pattern);
+    uint8_t spi_pattern_selected(void);
+    uint8_t spi_pattern_start(uint8_t bits);
+    void spi_pattern_fill(uint32_t* buf, uint32_t count, uint8_t shift);
+    void spi_pattern_check(const uint32_t* buf, uint32_t count, uint8_t shift, bool overrun);
+    void spi_pattern_latch(bool clear);
+    uint8_t spi_pattern_read(void);
+
+#    ifdef __cplusplus
+}
+#    endif
+
+#endif // _SPI_PATTERN_H_
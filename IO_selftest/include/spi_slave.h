@@ -14,6 +14,7 @@
  * This software is licensed under the BSD 3-Clause License.
  * See the LICENSE file for more details.
  */
+#include <stdbool.h>
 #include <stdint.h>
 
 #ifndef _SPI_SLAVE_H_
@@ -42,17 +43,32 @@ extern "C"
 #define DEF_BAUDRATE 10   ///< Default baud rate (1 MHz).
 
 /**
- * @brief SPI read/write length.
+ * @brief SPI DMA frames.
  */
-#define SPI_RW_LEN 16 ///< Length for SPI read/write operations.
+#define SPI_RW_LEN 1      ///< Default frames per DMA buffer, each word is answered and logged at once in every mode.
+#define SPI_FRAME_MAX 256 ///< Largest DMA buffer, in frames.
+#define SPI_END_CS 0      ///< Frame ended by the CS rising edge.
+#define SPI_END_FULL 1    ///< Frame ended because the DMA buffer is full.
+
+/**
+ * @brief SPI engine byte (116).
+ */
+#define SPI_PIO pio0         ///< PIO block used by the PIO engine.
+#define SPI_ENGINE_PIO 0x80  ///< Bit 7: PIO engine, 0 = SPI peripheral (PL022).
+#define SPI_ENGINE_LSB 0x20  ///< Bit 5: LSB first, PIO engine only.
+#define SPI_ENGINE_BITS 0x1f ///< Bits 4-0: word size - 1, 3 to 31 (4 to 32 bits), PIO engine only.
 
     void set_default_spi(void);
     void set_spi_com_format(void);
     void enable_spi(void);
     void disable_spi(uint8_t mode);
-    void set_spi_protocol(uint8_t cfg_spi, char* resultstr);
-    uint8_t get_spi_protocol(char* resultstr);
-    void spi_string_protocol(char* protocol_string);
+    void set_spi_frame_len(uint8_t len);
+    bool set_spi_engine(uint8_t config);
+    uint8_t get_spi_engine(void);
+    void set_spi_protocol(uint8_t cfg_spi);
+    uint8_t get_spi_protocol(void);
+    void spi_string_protocol(uint8_t config, char* protocol_string);
+    void spi_string_format(uint8_t config, char* format_string);
 
 #ifdef DEBUG_CODE
     void test_spi_command(void);
@@ -0,0 +1,120 @@
+/**
+ * @file    telemetry.h
+ * @author  Daniel Lockhead
+ * @date    2024
+ *
+ * @brief   USB composite device with a text console and a binary telemetry port
+ *
+ * @details The board enumerates with two CDC interfaces. The first one carries stdio, for humans.
+ *          The second one carries binary frames for the host tools, no text formatting is done:
+ *
+ *          | Byte  | Content                                                  |
+ *          |-------|----------------------------------------------------------|
+ *          | 0     | TLM_SYNC (0xA5)                                          |
+ *          | 1     | Frame type (tlm_type_t)                                  |
+ *          | 2-3   | Payload length, little endian                            |
+ *          | 4-n   | Payload                                                  |
+ *          | n+1   | Checksum, XOR of the type, length and payload bytes      |
+ *
+ * @copyright Copyright (c) 2024, D.Lockhead. All rights reserved.
+ *
+ * This software is licensed under the BSD 3-Clause License.
+ * See the LICENSE file for more details.
+ */
+
+#include "hardware/structs/systick.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef _TELEMETRY_H_
+#    define _TELEMETRY_H_
+
+#    ifdef __cplusplus
+extern "C"
+{
+#    endif
+
+#    define CDC_ITF_TEXT 0       ///< CDC interface used by stdio.
+#    define CDC_ITF_TLM 1        ///< CDC interface used by the binary telemetry.
+#    define TLM_SYNC 0xA5        ///< First byte of each telemetry frame.
+#    define TLM_HEADER_SIZE 4    ///< Sync, type and length bytes.
+#    define TLM_FRAME_OVERHEAD 5 ///< Header and checksum bytes added to the payload.
+#    define TLM_PAYLOAD_MAX 1000 ///< Largest payload, a frame must fit in the CDC transmit buffer.
+
+    /**
+     * @brief Telemetry frame types
+     */
+    typedef enum
+    {
+        TLM_EVENTS = 1,   ///< Payload is an array of EVENT records, 12 bytes each.
+        TLM_COUNTERS = 2, ///< Payload is a perf_counters_t.
+    } tlm_type_t;
+
+    /**
+     * @brief Performance counters sent in the TLM_COUNTERS frame, all little endian uint32.
+     *
+     * Each counter is incremented by a single context, so no lock is needed.
+     */
+    typedef struct
+    {
+        uint32_t uptime_us;    ///< Time of the snapshot (time_us_32()), filled when sent.
+        uint32_t loops;        ///< Core1 service loop iterations.
+        uint32_t i2c_rx;       ///< I2C bytes received from the master.
+        uint32_t i2c_tx;       ///< I2C bytes returned to the master.
+        uint32_t spi_frames;   ///< SPI frames received by the slave.
+        uint32_t uart_chars;   ///< Characters received by the UART.
+        uint32_t events;       ///< Events removed from the log rings.
+        uint32_t drops;        ///< Events lost because a log ring was full, filled when sent.
+        uint32_t text_bytes;   ///< Bytes sent on the text console.
+        uint32_t tlm_bytes;    ///< Bytes sent on the telemetry port.
+        uint32_t isr_i2c_max;  ///< Longest I2C slave handler, in CPU cycles.
+        uint32_t isr_spi_max;  ///< Longest SPI slave interrupt, in CPU cycles.
+        uint32_t isr_uart_max; ///< Longest UART receive interrupt, in CPU cycles.
+        uint32_t i2c_req_max;  ///< Longest I2C read request service (clock stretch of the master), in CPU cycles.
+    } perf_counters_t;
+
+    extern volatile perf_counters_t perf;
+
+#    define PERF_SYSTICK_MASK 0x00ffffff ///< SysTick is a 24 bits down counter.
+
+    /**
+     * @brief Return the current value of the cycle counter, used to time the interrupts.
+     *
+     * @return uint32_t  SysTick value, counting down at the CPU clock
+     */
+    static inline uint32_t perf_cycles(void)
+    {
+        return systick_hw->cvr;
+    }
+
+    /**
+     * @brief Keep the longest duration of an interrupt.
+     *
+     * @param max    counter holding the longest duration
+     * @param start  value of perf_cycles() at the interrupt entry
+     */
+    static inline void perf_isr_end(volatile uint32_t* max, uint32_t start)
+    {
+        uint32_t cycles = (start - systick_hw->cvr) & PERF_SYSTICK_MASK;
+
+        if (cycles > *max)
+        {
+            *max = cycles;
+        }
+    }
+
+    void telemetry_init(void);
+    void telemetry_usb_init(void);
+    void telemetry_task(void);
+    size_t telemetry_text_room(void);
+    bool telemetry_connected(void);
+    size_t telemetry_room(void);
+    bool telemetry_send(uint8_t type, const void* payload, uint16_t len);
+    bool telemetry_send_counters(void);
+
+#    ifdef __cplusplus
+}
+#    endif
+
+#endif // _TELEMETRY_H_
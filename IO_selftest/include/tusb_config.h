@@ -0,0 +1,34 @@
+/**
+ * @file    tusb_config.h
+ * @author  Daniel Lockhead
+ * @date    2024
+ *
+ * @brief   TinyUSB configuration of the composite device: text console and binary telemetry
+ *
+ * @copyright Copyright (c) 2024, D.Lockhead. All rights reserved.
+ *
+ * This software is licensed under the BSD 3-Clause License.
+ * See the LICENSE file for more details.
+ */
+
+#ifndef _TUSB_CONFIG_H_
+#    define _TUSB_CONFIG_H_
+
+#    ifdef __cplusplus
+extern "C"
+{
+#    endif
+
+#    define CFG_TUSB_RHPORT0_MODE (OPT_MODE_DEVICE) ///< Pico USB port used as device.
+#    define CFG_TUD_ENDPOINT0_SIZE 64               ///< Control endpoint size.
+
+#    define CFG_TUD_CDC 2               ///< Text console and binary telemetry.
+#    define CFG_TUD_CDC_RX_BUFSIZE 256  ///< Receive FIFO of each CDC interface.
+#    define CFG_TUD_CDC_TX_BUFSIZE 1024 ///< Transmit FIFO of each CDC interface, holds a full telemetry frame.
+#    define CFG_TUD_CDC_EP_BUFSIZE 64   ///< Bulk endpoint size (full speed).
+
+#    ifdef __cplusplus
+}
+#    endif
+
+#endif // _TUSB_CONFIG_H_
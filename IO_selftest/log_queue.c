@@ -0,0 +1,572 @@
+/**
+ * @file    log_queue.c
+ * @author  Daniel Lockhead
+ * @date    2024
+ *
+ * @brief   Event rings used to send debug events from the interrupts to the main loop
+ *
+ * @details The interrupts record only binary events. The text sent on the debug console
+ *          is built here, from the main loop. The same events are kept in binary form for the
+ *          I2C master, who reads them with the log stream command.
+ *
+ * @copyright Copyright (c) 2024, D.Lockhead. All rights reserved.
+ *
+ * This software is licensed under the BSD 3-Clause License.
+ * See the LICENSE file for more details.
+ */
+
+#include "include/log_queue.h"
+#include "include/serial.h"
+#include "include/spi_slave.h"
+#include "include/telemetry.h"
+#include "tusb.h"
+#include <stdio.h>
+#include <string.h>
+
+log_ring_t log_rings[LOG_SRC_COUNT];       ///< One ring per event source
+log_ring_t log_bus;                        ///< Events waiting to be read by the I2C master
+volatile uint8_t log_level[LOG_SUB_COUNT]; ///< Runtime log level of each subsystem
+
+static char batch[LOG_BATCH_SIZE];       ///< Console text sent in a single write
+static EVENT tlm_events[TLM_EVENTS_MAX]; ///< Events sent in a single telemetry frame
+static uint32_t drop_reported;           ///< Number of lost events already reported on the console
+static uint32_t bus_drop_base;           ///< Number of lost events when the I2C master cleared the drop counter
+static uint8_t bus_offset;               ///< Bytes of the oldest bus event already sent to the I2C master
+
+/**
+ * @brief Initialize all rings to empty.
+ */
+void log_init(void)
+{
+    memset(log_rings, 0, sizeof(log_rings));
+    memset(&log_bus, 0, sizeof(log_bus));
+    bus_drop_base = 0;
+    bus_offset = 0;
+
+    for (int i = 0; i < LOG_SUB_COUNT; i++)
+    {
+        log_level[i] = LOG_LEVEL_BUILD; // everything compiled in is enabled
+    }
+}
+
+/**
+ * @brief Set the runtime log level of one or all subsystems.
+ *
+ * @param config  Bits 7-4: subsystem (LOG_SUB_ALL for all), Bits 3-0: level (LOG_OFF to LOG_DEBUG)
+ * @return true if the level was set, false if the subsystem or the level is invalid.
+ */
+bool __not_in_flash_func(log_set_level)(uint8_t config)
+{
+    uint8_t sub = config >> 4;
+    uint8_t level = config & 0x0f;
+
+    if (level > LOG_DEBUG || (sub >= LOG_SUB_COUNT && sub != LOG_SUB_ALL))
+    {
+        return false;
+    }
+
+    for (int i = 0; i < LOG_SUB_COUNT; i++)
+    {
+        if (sub == LOG_SUB_ALL || sub == i)
+        {
+            log_level[i] = level;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Return the oldest event of all rings, so the events are printed in time order.
+ *
+ * @param ring  return the ring owning the event, to be used with log_release()
+ * @return EVENT*  Oldest event, NULL if all rings are empty
+ */
+EVENT* log_oldest(log_ring_t** ring)
+{
+    EVENT* oldest = NULL;
+    EVENT* ev;
+
+    for (log_source_t s = 0; s < LOG_SRC_COUNT; s++)
+    {
+        ev = log_peek(&log_rings[s]);
+        if (ev != NULL && (oldest == NULL || (int32_t) (ev->time - oldest->time) < 0))
+        {
+            oldest = ev;
+            *ring = &log_rings[s];
+        }
+    }
+    return oldest;
+}
+
+/**
+ * @brief Return the number of events lost because a source ring was full.
+ *
+ * @return uint32_t  Events lost since boot, all sources
+ */
+uint32_t __not_in_flash_func(log_dropped)(void)
+{
+    uint32_t drop = 0;
+
+    for (log_source_t s = 0; s < LOG_SRC_COUNT; s++)
+    {
+        drop += log_rings[s].drop;
+    }
+    return drop;
+}
+
+/**
+ * @brief Build the debug string of a write command
+ *
+ * @param ev   event to format
+ * @param str  string to return to the caller
+ * @param len  size of the string
+ */
+static void format_write(const EVENT* ev, char* str, size_t len)
+{
+    const char* text;
+
+    switch (ev->cmd)
+    {
+    case 10:
+        text = "Clear Gpio:";
+        break;
+    case 11:
+        text = "Set Gpio:";
+        break;
+    case 20:
+        text = "Set Dir Out Gpio:";
+        break;
+    case 21:
+        text = "Set dir In Gpio:";
+        break;
+    case 30:
+        text = "2mA Gpio:";
+        break;
+    case 31:
+        text = "4mA Gpio:";
+        break;
+    case 32:
+        text = "8mA Gpio:";
+        break;
+    case 33:
+        text = "12mA Gpio:";
+        break;
+    case 41:
+        text = "Pull-up Gpio:";
+        break;
+    case 50:
+        text = "Clear pull-up, pull-down Gpio:";
+        break;
+    case 51:
+        text = "Pull-down Gpio:";
+        break;
+    case 60:
+        text = "Pad State:";
+        break;
+    case 61:
+        snprintf(str, len, "Cmd %02d, Set Pad State to Gpio: %02d ,State: 0x%01lx ", ev->cmd, ev->gpio, (unsigned long) ev->value);
+        return;
+    case 80:
+        text = "PWM State:";
+        break;
+    case 81:
+        text = "PWM Frequency:";
+        break;
+    case 93:
+        snprintf(str, len, "Cmd %d, Clear log drop counter", ev->cmd);
+        return;
+    case 94:
+        snprintf(str, len, "Cmd %d, I2C speed: %lu Hz", ev->cmd, (unsigned long) ev->value);
+        return;
+    case 101:
+        text = "Enable UART, handshake RTS/CTS(1):";
+        break;
+    case 102:
+        text = "Disable UART, Set GPIO Input(0) Output(1):";
+        break;
+    case 103:
+        uart_string_protocol(ev->gpio, str);
+        return;
+    case 111:
+        snprintf(str, len, "Cmd %d, Enable SPI", ev->cmd);
+        return;
+    case 112:
+        text = "Disable SPI, Set GPIO Input(0) Output(1):";
+        break;
+    case 113:
+        spi_string_protocol(ev->gpio, str);
+        return;
+    case 120:
+        snprintf(str, len, "Cmd %d, Log level, subsystem: %d, level: %d", ev->cmd, ev->gpio >> 4, ev->gpio & 0x0f);
+        return;
+    case 133:
+        snprintf(str, len, "Cmd %d, Set outputs mask: 0x%08lx", ev->cmd, (unsigned long) ev->value);
+        return;
+    case 137:
+        snprintf(str, len, "Cmd %d, Clear outputs mask: 0x%08lx", ev->cmd, (unsigned long) ev->value);
+        return;
+    case 141:
+        snprintf(str, len, "Cmd %d, Set Dir Out mask: 0x%08lx", ev->cmd, (unsigned long) ev->value);
+        return;
+    case 145:
+        snprintf(str, len, "Cmd %d, Set Dir In mask: 0x%08lx", ev->cmd, (unsigned long) ev->value);
+        return;
+    case 150:
+        snprintf(str, len, "Cmd %d, Clear script", ev->cmd);
+        return;
+    case 152:
+        snprintf(str, len, "Cmd %d, Run script", ev->cmd);
+        return;
+    case 160:
+        snprintf(str, len, "Cmd %d, Block write from register %d, %lu values", ev->cmd, ev->gpio, (unsigned long) ev->value);
+        return;
+    case 170:
+        text = "Shadow stream from gpio:";
+        break;
+    case 172:
+        snprintf(str, len, "Cmd %d, Shadow pins committed in %lu cycles", ev->cmd, (unsigned long) ev->value);
+        return;
+    case 173:
+        snprintf(str, len, "Cmd %d, Pins restored in %lu cycles", ev->cmd, (unsigned long) ev->value);
+        return;
+    case 174:
+        text = "Shadow loaded from the pins:";
+        break;
+    case 180:
+        snprintf(str, len, "Cmd %d, Snapshot latched, status: 0x%02lx", ev->cmd, (unsigned long) ev->value);
+        return;
+    case 191:
+        snprintf(str, len, "Cmd %d, Injected delay: %lu us", ev->cmd, (unsigned long) ev->value);
+        return;
+    case 192:
+        text = "Injected jitter us:";
+        break;
+    case 193:
+        text = "Injection target command:";
+        break;
+    case 194:
+        text = "Injection mode (1 delay, 2 NACK, 4 drop):";
+        break;
+    default:
+        text = "Write:";
+        break;
+    }
+    snprintf(str, len, "Cmd %02d, %s %02d ", ev->cmd, text, ev->gpio);
+}
+
+/**
+ * @brief Build the debug string of a get command
+ *
+ * @param ev   event to format
+ * @param str  string to return to the caller
+ * @param len  size of the string
+ */
+static void format_read(const EVENT* ev, char* str, size_t len)
+{
+    unsigned long value = ev->value;
+
+    switch (ev->cmd)
+    {
+    case 1:
+        snprintf(str, len, "Cmd %02d, MAJ Version: %02lu ", ev->cmd, value);
+        break;
+    case 2:
+        snprintf(str, len, "Cmd %02d, MIN Version: %02lu ", ev->cmd, value);
+        break;
+    case 15:
+        snprintf(str, len, "Cmd %02d, read True Gpio: %02d ,State: %01lu ", ev->cmd, ev->gpio, value);
+        break;
+    case 25:
+        snprintf(str, len, "Cmd %02d, Red Dir Gpio: %02d ,State: %01lu ", ev->cmd, ev->gpio, value);
+        break;
+    case 35:
+        snprintf(str, len, "Cmd %02d, Read strength Gpio: %02d ,State: %01lu ", ev->cmd, ev->gpio, value);
+        break;
+    case 45:
+        snprintf(str, len, "Cmd %02d, read pull-up Gpio: %02d ,State: %01lu ", ev->cmd, ev->gpio, value);
+        break;
+    case 55:
+        snprintf(str, len, "Cmd %02d, Read pull-down Gpio: %02d ,State: %01lu ", ev->cmd, ev->gpio, value);
+        break;
+    case 65:
+        snprintf(str, len, "Cmd %02d, Gpio: %02d ,Read PAD State: 0x%01lx ", ev->cmd, ev->gpio, value);
+        break;
+    case 75:
+        snprintf(str, len, "Cmd %02d, Read function Gpio: %02d , funct: 0x%02lx ", ev->cmd, ev->gpio, value);
+        break;
+    case 90:
+        snprintf(str, len, "Cmd %d, Log events pending: %lu ", ev->cmd, value);
+        break;
+    case 91:
+        snprintf(str, len, "Cmd %d, Log events lost: %lu ", ev->cmd, value);
+        break;
+    case 100:
+        snprintf(str, len, "Cmd %02d,Status register: 0x%01lx ", ev->cmd, value);
+        break;
+    case 105:
+        uart_string_protocol(value, str);
+        break;
+    case 115:
+        spi_string_protocol(value, str);
+        break;
+    case 125:
+        snprintf(str, len, "Cmd %d, Log level, subsystem: %d, level: %lu", ev->cmd, ev->gpio, value);
+        break;
+    case 146:
+        snprintf(str, len, "Cmd %d, Read all Gpio: 0x%08lx ", ev->cmd, value);
+        break;
+    case 161:
+        snprintf(str, len, "Cmd %d, Block read from register %d, %lu values", ev->cmd, ev->gpio, value);
+        break;
+    default:
+        snprintf(str, len, "Cmd %02d, Read: %02lu ", ev->cmd, value);
+        break;
+    }
+}
+
+/**
+ * @brief Build the debug string of an event. Called only by core1.
+ *
+ * @param ev   event to format
+ * @param str  string to return to the caller, should hold at least 120 characters
+ * @param len  size of the string
+ */
+void log_format(const EVENT* ev, char* str, size_t len)
+{
+    uint16_t rd = ev->value & 0xffff;
+    uint16_t wr = ev->value >> 16;
+
+    switch (ev->event)
+    {
+    case EV_BOOT:
+        snprintf(str, len, "Pico Selftest boot for I2C address 0x%02x, version: %d.%d", ev->gpio, (int) (ev->value >> 8), (int) (ev->value & 0xff));
+        break;
+    case EV_WATCHDOG:
+        snprintf(str, len, "----------->   Watchdog cause reboot  <---------");
+        break;
+    case EV_HEARTBEAT:
+        snprintf(str, len, "Heartbeat I2C Selftest add: 0x%02x  version: %d.%d", ev->gpio, (int) (ev->value >> 8), (int) (ev->value & 0xff));
+        break;
+    case EV_CMD_WRITE:
+        format_write(ev, str, len);
+        break;
+    case EV_CMD_READ:
+        format_read(ev, str, len);
+        break;
+    case EV_READ_REPLY:
+        snprintf(str, len, "Read Cmd : %02d , Value: %02lu ", ev->cmd, (unsigned long) ev->value);
+        break;
+    case EV_UART_IRQ:
+        snprintf(str, len, "Serial Interrupt Received: ");
+        break;
+    case EV_UART_RX:
+        snprintf(str, len, "receive: %c ", (char) ev->value);
+        break;
+    case EV_SPI_RX8:
+        snprintf(str, len, "SPI INT Rd:0x%02X Wr:0x%02X", rd, wr);
+        break;
+    case EV_SPI_RX16:
+        snprintf(str, len, "SPI INT Rd:0x%04X Wr:0x%04X", rd, wr);
+        break;
+    case EV_SPI_ENABLE:
+        snprintf(str, len, "Selftest SPI is Enabled, %s engine, %lu frames per buffer, pattern %lu",
+                 (ev->gpio & SPI_ENGINE_PIO) ? "PIO" : "SPI", (unsigned long) (ev->value & 0xffff), (unsigned long) (ev->value >> 16));
+        break;
+    case EV_SPI_DISABLE:
+        snprintf(str, len, "Selftest SPI is disabled");
+        break;
+    case EV_SPI_FORMAT:
+        spi_string_format(ev->value, str);
+        break;
+    case EV_CMD_ERROR:
+        snprintf(str, len, "Cmd %d, Invalid data: 0x%02x, 0x%08lx", ev->cmd, ev->gpio, (unsigned long) ev->value);
+        break;
+    case EV_SCRIPT_END:
+        snprintf(str, len, "Script end, state: %lu (2 pass, 3 fail, 4 error), pc: %d", (unsigned long) ev->value, ev->gpio);
+        break;
+    case EV_SPI_FRAME:
+        snprintf(str, len, "SPI frame end (%s): %lu frames, %lu lost", ev->gpio == SPI_END_CS ? "CS" : "full",
+                 (unsigned long) (ev->value & 0xffff), (unsigned long) (ev->value >> 16));
+        break;
+    case EV_SPI_RX32:
+        snprintf(str, len, "SPI Rd:0x%08lX", (unsigned long) ev->value);
+        break;
+    default:
+        snprintf(str, len, "Event %d, Cmd %02d, Gpio: %02d, Value: 0x%08lx", ev->event, ev->cmd, ev->gpio, (unsigned long) ev->value);
+        break;
+    }
+}
+
+/**
+ * @brief Copy an event to the ring read by the I2C master.
+ *
+ * @param ev  event to copy
+ */
+static void bus_push(const EVENT* ev)
+{
+    EVENT* slot = log_reserve(&log_bus);
+
+    if (slot != NULL)
+    {
+        *slot = *ev;
+        log_commit(&log_bus);
+    }
+}
+
+/**
+ * @brief Send the pending events to the USB console, the telemetry port and the I2C readout ring.
+ *
+ * @details The events are formatted in a single buffer and sent with one write, limited to the
+ *          space available in the console fifo so the call never blocks. The same events
+ *          are sent in binary in a single telemetry frame. Events who do not fit stay in their
+ *          ring for the next call. A port without host is skipped, the events always go to the
+ *          I2C readout ring. Called by core1, who owns the USB device.
+ *
+ * @param address  I2C address of the board, used as prefix of each line
+ * @return uint32_t  Number of events removed from the rings
+ */
+uint32_t log_drain(uint8_t address)
+{
+    char line[128]; // debug string built from an event
+    EVENT* ev;
+    log_ring_t* ring;
+    bool text = tud_cdc_n_connected(CDC_ITF_TEXT);
+    bool tlm = telemetry_connected();
+    uint32_t count = 0;
+    uint32_t drop;
+    size_t used = 0;  // characters in batch
+    size_t lines = 0; // each line can grow by one character with the CR/LF translation of stdio
+    size_t room = 0;
+    size_t tlm_room = 0;
+    size_t tlm_used = 0; // events in tlm_events
+    int n;
+
+    if (text)
+    {
+        room = telemetry_text_room();
+        if (room > LOG_BATCH_SIZE)
+        {
+            room = LOG_BATCH_SIZE;
+        }
+
+        drop = log_dropped();
+        if (drop != drop_reported)
+        {
+            n = snprintf(batch, room, "Pico %02x: %lu events lost\n", address, (unsigned long) (drop - drop_reported));
+            if (n > 0 && (size_t) n + 1 < room)
+            {
+                used = n;
+                lines = 1;
+                drop_reported = drop;
+            }
+        }
+    }
+
+    if (tlm)
+    {
+        tlm_room = telemetry_room() / sizeof(EVENT);
+        if (tlm_room > TLM_EVENTS_MAX)
+        {
+            tlm_room = TLM_EVENTS_MAX;
+        }
+    }
+
+    while ((ev = log_oldest(&ring)) != NULL)
+    {
+        if (tlm && tlm_used >= tlm_room)
+        {
+            break; // telemetry frame is full, the event stays in the ring
+        }
+        if (text)
+        {
+            log_format(ev, line, sizeof(line)); // format the event outside of the interrupts
+            n = snprintf(&batch[used], room - used, "Pico %02x: %s\n", address, line);
+            if (n < 0 || used + n + lines + 1 >= room)
+            {
+                break; // no more space, the event stays in the ring
+            }
+            used += n;
+            lines++;
+        }
+        if (tlm)
+        {
+            tlm_events[tlm_used++] = *ev;
+        }
+        bus_push(ev);
+        log_release(ring); // slot can be reused by the producer
+        count++;
+    }
+
+    if (used > 0)
+    {
+        fwrite(batch, 1, used, stdout); // send messages to serial port
+        fflush(stdout);
+    }
+    if (tlm_used > 0)
+    {
+        telemetry_send(TLM_EVENTS, tlm_events, tlm_used * sizeof(EVENT));
+    }
+    perf.events += count;
+    return count;
+}
+
+/**
+ * @brief Return the number of events the I2C master can read. Called from the I2C interrupt.
+ *
+ * @return uint8_t  Number of complete events pending, saturated to 255
+ */
+uint8_t __not_in_flash_func(log_bus_pending)(void)
+{
+    uint32_t count = log_count(&log_bus);
+
+    return count > 0xff ? 0xff : count;
+}
+
+/**
+ * @brief Return the number of events the I2C master will never read, since the last clear.
+ *        Called from the I2C interrupt.
+ *
+ * @return uint8_t  Events lost in the source rings or in the readout ring, saturated to 255
+ */
+uint8_t __not_in_flash_func(log_bus_dropped)(void)
+{
+    uint32_t drop = log_dropped() + log_bus.drop - bus_drop_base;
+
+    return drop > 0xff ? 0xff : drop;
+}
+
+/**
+ * @brief Restart the drop counter read by log_bus_dropped(). Called from the I2C interrupt.
+ */
+void __not_in_flash_func(log_bus_clear_drop)(void)
+{
+    bus_drop_base = log_dropped() + log_bus.drop;
+}
+
+/**
+ * @brief Return the next byte of the event stream. Called from the I2C interrupt.
+ *
+ * @details Each event is sent as the 12 bytes of EVENT, little endian: time (4), event, cmd,
+ *          gpio, spare, value (4). An event is released only when its last byte is read, so a
+ *          transfer stopped in the middle of an event continues with the next transfer.
+ *
+ * @return uint8_t  Next byte, LOG_BUS_EMPTY when no event is pending
+ */
+uint8_t __not_in_flash_func(log_bus_read_byte)(void)
+{
+    EVENT* ev = log_peek(&log_bus);
+    uint8_t value;
+
+    if (ev == NULL)
+    {
+        return LOG_BUS_EMPTY;
+    }
+
+    value = ((const uint8_t*) ev)[bus_offset++];
+    if (bus_offset == sizeof(EVENT))
+    {
+        bus_offset = 0;
+        log_release(&log_bus);
+    }
+    return value;
+}
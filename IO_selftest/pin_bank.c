@@ -0,0 +1,212 @@
+/**
+ * @file    pin_bank.c
+ * @author  Daniel Lockhead
+ * @date    2024
+ *
+ * @brief   Shadow pin configuration applied by a single commit
+ *
+ * @details The functions are called from the I2C interrupt, and from the main loop when a script
+ *          sends the bank commands. The I2C interrupt can preempt a script, so the stream position,
+ *          the shadow and the saved bank are only changed with the interrupts disabled. Each byte
+ *          and each commit is atomic, a master and a script writing the stream at the same time
+ *          still interleave their bytes.
+ *
+ * @copyright Copyright (c) 2024, D.Lockhead. All rights reserved.
+ *
+ * This software is licensed under the BSD 3-Clause License.
+ * See the LICENSE file for more details.
+ */
+
+#include "include/pin_bank.h"
+#include "hardware/gpio.h"
+#include "hardware/structs/io_bank0.h"
+#include "hardware/structs/pads_bank0.h"
+#include "hardware/structs/sio.h"
+#include "hardware/sync.h"
+
+#define PAD_BITS 0xfful ///< Pad register bits written by the commit, as command 61.
+
+/**
+ * @brief Configuration of all GPIO
+ */
+typedef struct
+{
+    uint8_t pad[NUM_BANK0_GPIOS];  ///< Pad register of each pin.
+    uint8_t func[NUM_BANK0_GPIOS]; ///< Function select of each pin.
+    uint32_t out;                  ///< Output levels, one bit per pin.
+    uint32_t oe;                   ///< Output enables, one bit per pin.
+} pin_bank_t;
+
+static pin_bank_t shadow; ///< Configuration filled by the master
+static pin_bank_t saved;  ///< Configuration of the pins before the last commit
+static uint8_t pos;       ///< Next byte of the shadow stream
+
+/**
+ * @brief Read the configuration of the pins.
+ *
+ * @param bank  receives the configuration
+ */
+static void __not_in_flash_func(pin_bank_save)(pin_bank_t* bank)
+{
+    for (uint gpio = 0; gpio < NUM_BANK0_GPIOS; gpio++)
+    {
+        bank->pad[gpio] = pads_bank0_hw->io[gpio] & PAD_BITS;
+        bank->func[gpio] = (io_bank0_hw->io[gpio].ctrl & IO_BANK0_GPIO0_CTRL_FUNCSEL_BITS) >> IO_BANK0_GPIO0_CTRL_FUNCSEL_LSB;
+    }
+    bank->out = sio_hw->gpio_out;
+    bank->oe = sio_hw->gpio_oe;
+}
+
+/**
+ * @brief Apply a configuration to the pins of a mask. The output levels are written before the
+ *        directions, and both before the functions, so a pin becoming a SIO output starts at its level.
+ *
+ * @param bank  configuration to apply
+ * @param mask  pins to change, the others keep their configuration
+ */
+static void __not_in_flash_func(pin_bank_apply)(const pin_bank_t* bank, uint32_t mask)
+{
+    gpio_put_masked(mask, bank->out);
+    gpio_set_dir_masked(mask, bank->oe);
+
+    for (uint gpio = 0; gpio < NUM_BANK0_GPIOS; gpio++)
+    {
+        if (mask & (1ul << gpio))
+        {
+            hw_write_masked(&pads_bank0_hw->io[gpio], bank->pad[gpio], PAD_BITS);
+            hw_write_masked(&io_bank0_hw->io[gpio].ctrl, (uint32_t) bank->func[gpio] << IO_BANK0_GPIO0_CTRL_FUNCSEL_LSB,
+                            IO_BANK0_GPIO0_CTRL_FUNCSEL_BITS);
+        }
+    }
+}
+
+/**
+ * @brief Start with the shadow and the saved bank equal to the configuration at boot.
+ */
+void pin_bank_init(void)
+{
+    pin_bank_save(&shadow);
+    saved = shadow;
+    pos = 0;
+}
+
+/**
+ * @brief Select the pin of the next shadow stream byte.
+ *
+ * @param pin  first pin written or read by the stream
+ */
+void __not_in_flash_func(pin_bank_select)(uint8_t pin)
+{
+    uint32_t irq = save_and_disable_interrupts();
+
+    pos = pin < NUM_BANK0_GPIOS ? pin * PIN_BANK_BYTES : NUM_BANK0_GPIOS * PIN_BANK_BYTES;
+    restore_interrupts(irq);
+}
+
+/**
+ * @brief Write the next byte of the shadow stream, the pins do not change.
+ *
+ * @param value  pad, function or level/direction byte, see pin_bank.h
+ * @return true if written, false after the last pin.
+ */
+bool __not_in_flash_func(pin_bank_write)(uint8_t value)
+{
+    uint32_t irq = save_and_disable_interrupts();
+    uint8_t gpio = pos / PIN_BANK_BYTES;
+    uint32_t bit = 1ul << gpio;
+
+    if (gpio >= NUM_BANK0_GPIOS)
+    {
+        restore_interrupts(irq);
+        return false;
+    }
+
+    switch (pos % PIN_BANK_BYTES)
+    {
+    case 0:
+        shadow.pad[gpio] = value;
+        break;
+    case 1:
+        shadow.func[gpio] = value & IO_BANK0_GPIO0_CTRL_FUNCSEL_BITS;
+        break;
+    default:
+        shadow.out = (value & 0x01) ? shadow.out | bit : shadow.out & ~bit;
+        shadow.oe = (value & 0x02) ? shadow.oe | bit : shadow.oe & ~bit;
+        break;
+    }
+    pos++;
+    restore_interrupts(irq);
+    return true;
+}
+
+/**
+ * @brief Read the next byte of the shadow stream.
+ *
+ * @return uint8_t  Shadow byte, 0 after the last pin
+ */
+uint8_t __not_in_flash_func(pin_bank_read)(void)
+{
+    uint32_t irq = save_and_disable_interrupts();
+    uint8_t gpio = pos / PIN_BANK_BYTES;
+    uint8_t value;
+
+    if (gpio >= NUM_BANK0_GPIOS)
+    {
+        restore_interrupts(irq);
+        return 0;
+    }
+
+    switch (pos % PIN_BANK_BYTES)
+    {
+    case 0:
+        value = shadow.pad[gpio];
+        break;
+    case 1:
+        value = shadow.func[gpio];
+        break;
+    default:
+        value = ((shadow.out >> gpio) & 1) | (((shadow.oe >> gpio) & 1) << 1);
+        break;
+    }
+    pos++;
+    restore_interrupts(irq);
+    return value;
+}
+
+/**
+ * @brief Copy the configuration of the pins into the shadow, so only the pins to change need to be written.
+ */
+void __not_in_flash_func(pin_bank_load)(void)
+{
+    uint32_t irq = save_and_disable_interrupts();
+
+    pin_bank_save(&shadow);
+    restore_interrupts(irq);
+}
+
+/**
+ * @brief Save the configuration of the pins and apply the shadow.
+ *
+ * @param mask  pins the master may change
+ */
+void __not_in_flash_func(pin_bank_commit)(uint32_t mask)
+{
+    uint32_t irq = save_and_disable_interrupts();
+
+    pin_bank_save(&saved);
+    pin_bank_apply(&shadow, mask);
+    restore_interrupts(irq);
+}
+
+/**
+ * @brief Apply the configuration saved by the last commit.
+ *
+ * @param mask  pins the master may change
+ */
+void __not_in_flash_func(pin_bank_restore)(uint32_t mask)
+{
+    uint32_t irq = save_and_disable_interrupts();
+
+    pin_bank_apply(&saved, mask);
+    restore_interrupts(irq);
+}
@@ -0,0 +1,333 @@
+/**
+ * @file    script.c
+ * @author  Daniel Lockhead
+ * @date    2024
+ *
+ * @brief   Bytecode script engine
+ *
+ * @details The script is loaded and started from the I2C interrupt, and executed by the main loop
+ *          with script_task(). A few opcodes are executed at each call, the waits do not block so
+ *          the watchdog, USB and the event log keep running during a long script.
+ *
+ *          The I2C interrupt never changes the state while a script is running, the main loop only
+ *          changes it while a script is running, so no lock is needed.
+ *
+ * @copyright Copyright (c) 2024, D.Lockhead. All rights reserved.
+ *
+ * This software is licensed under the BSD 3-Clause License.
+ * See the LICENSE file for more details.
+ */
+
+#include "include/script.h"
+#include <stddef.h>
+
+#define CMD_GPIO_CLR 10     ///< Clear Gpio command.
+#define CMD_GPIO_SET 11     ///< Set Gpio command.
+#define CMD_GPIO_GET 15     ///< Read true value of Gpio command.
+#define CMD_GPIO_DIR_OUT 20 ///< Set Gpio Direction to Output command.
+#define CMD_GPIO_DIR_IN 21  ///< Set Gpio Direction to Input command.
+
+/**
+ * @brief Size in bytes of each opcode with its operands, 0 for an invalid opcode
+ */
+static const uint8_t op_size[] = {
+    [OP_END] = 1,
+    [OP_SET] = 2,
+    [OP_CLR] = 2,
+    [OP_DIR] = 3,
+    [OP_READ] = 2,
+    [OP_EXPECT] = 3,
+    [OP_WAIT_US] = 3,
+    [OP_WAIT_MS] = 3,
+    [OP_LOOP] = 2,
+    [OP_NEXT] = 1,
+    [OP_CMD] = 3,
+    [OP_GET] = 3,
+    [OP_EXPECT_GET] = 4,
+};
+
+/**
+ * @brief Active loop
+ */
+typedef struct
+{
+    uint16_t start; ///< pc of the first opcode of the loop body.
+    uint16_t count; ///< Remaining iterations.
+} script_loop_t;
+
+static uint8_t program[SCRIPT_SIZE];           ///< Script loaded by the master
+static volatile uint16_t length;               ///< Number of bytes loaded
+static volatile uint8_t state;                 ///< script_state_t
+static volatile bool starting;                 ///< Start requested, the main loop initializes the run
+static uint16_t pc;                            ///< Next opcode to execute
+static uint16_t fail_pc;                       ///< Opcode who failed or was refused
+static script_loop_t loops[SCRIPT_LOOP_DEPTH]; ///< Active loops, innermost last
+static uint8_t depth;                          ///< Number of active loops
+static bool waiting;                           ///< A wait opcode is in progress
+static uint32_t deadline;                      ///< End of the wait, in us
+static uint8_t results[SCRIPT_RESULT_SIZE];    ///< Values read by READ and GET
+static volatile uint8_t result_count;          ///< Number of values in results
+static uint8_t result_read;                    ///< Next value returned to the master
+
+/**
+ * @brief Clear the script before a new upload. Refused while a script is running.
+ */
+void __not_in_flash_func(script_reset)(void)
+{
+    if (state != SCRIPT_BUSY)
+    {
+        length = 0;
+        state = SCRIPT_IDLE;
+    }
+}
+
+/**
+ * @brief Append one byte to the script.
+ *
+ * @param byte  next byte of the script
+ * @return true if the byte was added, false if the script is full or running.
+ */
+bool __not_in_flash_func(script_load)(uint8_t byte)
+{
+    if (state == SCRIPT_BUSY || length >= SCRIPT_SIZE)
+    {
+        return false;
+    }
+    program[length] = byte;
+    length = length + 1;
+    return true;
+}
+
+/**
+ * @brief Request the execution of the loaded script, done by the next calls of script_task().
+ *
+ * @return true if the script will run, false if a script is already running or none is loaded.
+ */
+bool __not_in_flash_func(script_start)(void)
+{
+    if (state == SCRIPT_BUSY || length == 0)
+    {
+        return false;
+    }
+    result_read = 0;
+    starting = true;
+    state = SCRIPT_BUSY; // last, the main loop starts when it sees the new state
+    return true;
+}
+
+/**
+ * @brief Stop the script.
+ *
+ * @param end  final state
+ * @param at   pc reported to the master
+ */
+static void script_stop(script_state_t end, uint16_t at)
+{
+    fail_pc = at;
+    state = end;
+}
+
+/**
+ * @brief Add a value to the result buffer.
+ *
+ * @param value  value to add
+ * @return true if added, false if the buffer is full.
+ */
+static bool result_add(uint8_t value)
+{
+    if (result_count >= SCRIPT_RESULT_SIZE)
+    {
+        return false;
+    }
+    results[result_count] = value;
+    result_count = result_count + 1;
+    return true;
+}
+
+/**
+ * @brief Execute the opcode at pc.
+ *
+ * @param io  access to the commands
+ */
+static void script_step(const script_io_t* io)
+{
+    uint16_t at = pc;
+    uint8_t op = program[pc];
+    const uint8_t* arg = &program[pc + 1];
+    uint8_t size = op < sizeof(op_size) ? op_size[op] : 0;
+    uint8_t value = 0;
+    bool ok = true;
+
+    if (size == 0 || pc + size > length)
+    {
+        script_stop(SCRIPT_ERROR, at); // unknown opcode, missing operand or missing END
+        return;
+    }
+    pc += size;
+
+    switch (op)
+    {
+    case OP_END:
+        script_stop(SCRIPT_PASS, at);
+        return;
+    case OP_SET:
+        ok = io->write(CMD_GPIO_SET, arg[0]);
+        break;
+    case OP_CLR:
+        ok = io->write(CMD_GPIO_CLR, arg[0]);
+        break;
+    case OP_DIR:
+        ok = io->write(arg[1] ? CMD_GPIO_DIR_OUT : CMD_GPIO_DIR_IN, arg[0]);
+        break;
+    case OP_READ:
+        ok = io->read(CMD_GPIO_GET, arg[0], &value) && result_add(value);
+        break;
+    case OP_EXPECT:
+        ok = io->read(CMD_GPIO_GET, arg[0], &value);
+        if (ok && value != arg[1])
+        {
+            script_stop(SCRIPT_FAIL, at);
+            return;
+        }
+        break;
+    case OP_WAIT_US:
+    case OP_WAIT_MS:
+        deadline = io->time_us() + (uint32_t) (arg[0] | (arg[1] << 8)) * (op == OP_WAIT_MS ? 1000 : 1);
+        waiting = true;
+        break;
+    case OP_LOOP:
+        if (depth >= SCRIPT_LOOP_DEPTH)
+        {
+            ok = false;
+            break;
+        }
+        loops[depth].start = pc;
+        loops[depth].count = arg[0] ? arg[0] : 256;
+        depth++;
+        break;
+    case OP_NEXT:
+        if (depth == 0)
+        {
+            ok = false;
+            break;
+        }
+        if (--loops[depth - 1].count != 0)
+        {
+            pc = loops[depth - 1].start;
+        }
+        else
+        {
+            depth--;
+        }
+        break;
+    case OP_CMD:
+        ok = io->write(arg[0], arg[1]);
+        break;
+    case OP_GET:
+        ok = io->read(arg[0], arg[1], &value) && result_add(value);
+        break;
+    case OP_EXPECT_GET:
+        ok = io->read(arg[0], arg[1], &value);
+        if (ok && value != arg[2])
+        {
+            script_stop(SCRIPT_FAIL, at);
+            return;
+        }
+        break;
+    }
+
+    if (!ok)
+    {
+        script_stop(SCRIPT_ERROR, at);
+    }
+}
+
+/**
+ * @brief Run the started script for a few opcodes, called at each iteration of the main loop.
+ *
+ * @param io  access to the commands
+ * @return true when the script has just ended (pass, fail or error).
+ */
+bool script_task(const script_io_t* io)
+{
+    if (state != SCRIPT_BUSY)
+    {
+        return false;
+    }
+
+    if (starting)
+    {
+        starting = false;
+        pc = 0;
+        fail_pc = 0;
+        depth = 0;
+        waiting = false;
+        result_count = 0;
+    }
+
+    for (int step = 0; step < SCRIPT_STEPS && state == SCRIPT_BUSY; step++)
+    {
+        if (waiting)
+        {
+            if ((int32_t) (io->time_us() - deadline) < 0)
+            {
+                return false; // wait again at the next call
+            }
+            waiting = false;
+        }
+        script_step(io);
+    }
+    return state != SCRIPT_BUSY;
+}
+
+/**
+ * @brief Return the script state.
+ *
+ * @return uint8_t  script_state_t
+ */
+uint8_t __not_in_flash_func(script_state)(void)
+{
+    return state;
+}
+
+/**
+ * @brief Return the position of the opcode who failed or was refused.
+ *
+ * @return uint8_t  Offset in the script, 0 while running
+ */
+uint8_t __not_in_flash_func(script_pc)(void)
+{
+    return fail_pc;
+}
+
+/**
+ * @brief Return the number of values in the result buffer.
+ *
+ * @return uint8_t  Number of values
+ */
+uint8_t __not_in_flash_func(script_result_count)(void)
+{
+    return result_count;
+}
+
+/**
+ * @brief Return the next value of the result buffer.
+ *
+ * @return uint8_t  Next value, 0 after the last one
+ */
+uint8_t __not_in_flash_func(script_result_byte)(void)
+{
+    if (result_read >= result_count)
+    {
+        return 0;
+    }
+    return results[result_read++];
+}
+
+/**
+ * @brief Restart the reading of the result buffer at the first value.
+ */
+void __not_in_flash_func(script_result_rewind)(void)
+{
+    result_read = 0;
+}
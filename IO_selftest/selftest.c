@@ -15,12 +15,24 @@
  */
 
 #include "include/selftest.h"
+#include "include/log_queue.h"
+#include "include/pin_bank.h"
 #include "hardware/gpio.h"
+#include "hardware/irq.h"
 #include "hardware/pwm.h"
 #include "hardware/spi.h"
+#include "hardware/structs/io_bank0.h"
+#include "hardware/structs/pads_bank0.h"
+#include "hardware/sync.h"
+#include "hardware/timer.h"
 #include "hardware/watchdog.h"
+#include "pico/multicore.h"
+#include "include/script.h"
 #include "include/serial.h"
+#include "include/smbus.h"
+#include "include/spi_pattern.h"
 #include "include/spi_slave.h"
+#include "include/telemetry.h"
 #include "userconfig.h"
 #include <i2c_fifo.h>
 #include <i2c_slave.h>
@@ -31,397 +43,1545 @@
 
 static const uint I2C_OFFSET_ADDRESS = 0x20; // offset to add to the physical address read
 static const uint REG_STATUS = 100;          // Register used to report Status
+static const uint CMD_BLOCK_WRITE = 160;     // SMBus block write
 
-static const uint I2C_BAUDRATE = 100000;      // 100 kHz
-static const uint I2C_SLAVE_ADDRESS_IO0 = 26; // Bit 0 of I2C Address
-static const uint I2C_SLAVE_ADDRESS_IO1 = 27; // Bit 1 of I2C Address
+static const uint I2C_BAUDRATE = I2C_BAUDRATE_BUILD; // Speed at boot, set by CMake (100 kHz by default)
+static const uint I2C_SPEED_UNIT = 100000;           // Unit of the I2C speed commands, 100 kHz
+static const uint I2C_SPEED_MAX = 10;                // Fast-mode Plus, 1 MHz
+static const uint I2C_IDLE_TIMEOUT_US = 10000;       // Longest wait for the end of a transaction before a speed change
+static const uint I2C_SLAVE_ADDRESS_IO0 = 26;        // Bit 0 of I2C Address
+static const uint I2C_SLAVE_ADDRESS_IO1 = 27;        // Bit 1 of I2C Address
 
 // Define lines as GPIO at boot
 static const uint32_t GPIO_BOOT_MASK = 0b00011100011111111111111111111111;
+// Lines the master can change with the mask commands: boot GPIO without I2C slave pins and address straps
+#define GPIO_USER_MASK                                                                                                                               \
+    (GPIO_BOOT_MASK & ~((1ul << I2C_SLAVE_SDA_PIN) | (1ul << I2C_SLAVE_SCL_PIN) | (1ul << I2C_SLAVE_ADDRESS_IO0) | (1ul << I2C_SLAVE_ADDRESS_IO1) | \
+                        I2C_AUX_PINS_MASK))
 // Define direction of GPIO lines
 static const uint32_t GPIO_SET_DIR_MASK = 0b0010000010000000000000000000; // GPIO MASK
 static const uint32_t GPIO_SELF_OUT_MASK = 0x00ul;                        // All output to 0
 static const uint32_t GPIO_SELF_DIR_MASK = 0b00010000000000000000000000000000;
 
 /**
- * @brief Global structure for message queue management.
+ * @brief Error flags collected during execution
+ *
+ */
+static union
+{
+    uint8_t all_flags; /// All flags combined into a single byte.
+    struct
+    {
+        uint8_t cfg : 1;     /// Configuration error flag.
+        uint8_t cmd : 1;     /// Command error flag.
+        uint8_t error : 1;   /// General error flag.
+        uint8_t watch : 1;   /// Watchdog error flag.
+        uint8_t busy : 1;    /// Deferred commands waiting or executing.
+        uint8_t done : 1;    /// Deferred commands completed since the last status read.
+        uint8_t bcast : 1;   /// Last general call write was applied.
+        uint8_t sparesD : 1; /// Spare flag D.
+    };
+} status;
+
+/**
+ * @brief SMBus block transfer. The bytes written by the master are collected by the block commands
+ *        and checked at the end of the transaction, nothing is applied before the whole block is valid.
+ */
+typedef struct
+{
+    uint8_t in[SMBUS_BLOCK_MAX + 2];  // byte count, data bytes and PEC written by the master
+    uint8_t in_len;                   // bytes written, sizeof(in) + 1 when the block is too long
+    uint8_t cmd;                      // block command who received in[]
+    uint8_t out[SMBUS_BLOCK_MAX + 2]; // byte count, data bytes and PEC returned by the process call
+    uint8_t out_len;                  // bytes in out[]
+    uint8_t out_pos;                  // next byte of out[] returned to the master
+} block_t;
+
+/**
+ * @brief The slave implements a 256 byte memory. The memory address use the command byte value as memory pointer,
+ *        The 8 bit data is written starting at command value. In a burst, each data byte goes to the next
+ *        register (auto-increment), the pointer returns to the command byte at the end of the transaction.
+ *        Each I2C slave port has its own context, the scripts too.
+ *
+ */
+typedef struct
+{
+    uint8_t reg[256];         // contains data following command byte
+    uint8_t reg_address;      // contains command number
+    uint8_t reg_offset;       // register pointer = reg_address + reg_offset during a burst
+    uint8_t reg_status;       // contains status of command
+    bool reg_address_written; // Flag for command byte received
+    bool prefetched;          // reg[reg_address] computed at the Restart, returned as is by the next read request
+    uint8_t i2c_add;
+    i2c_inst_t* i2c; // controller of the port, NULL for the scripts
+    uint baudrate;   // current I2C bus speed in Hz
+    block_t block;   // SMBus block in progress
+} cmd_context_t;
+
+static cmd_context_t context; // main port, i2c1
+#if SELFTEST_I2C0_SLAVE
+static cmd_context_t aux_context;   // second port, i2c0, in transaction mode
+static uint8_t aux_rx_buf[1 + 256]; // command byte and a burst over all the registers
+#    define AUX_RESPONSE_MAX 16     // registers handed at once to the Tx FIFO of the second port
+static uint8_t aux_tx_buf[AUX_RESPONSE_MAX]; // response of the second port, a copy of the registers
+static size_t aux_tx_done;                   // response bytes of the current read already counted and logged
+#endif
+static volatile uint32_t log_activity; // events sent by core1, core0 flashes the board led when it changes
+
+/**
+ * @brief Handler called when the master writes the data byte of a command. The data is already
+ *        saved in ctx->reg[cmd].
+ */
+typedef void (*cmd_write_t)(cmd_context_t* ctx, uint8_t cmd);
+
+/**
+ * @brief Handler called when the master reads a command. The handler updates ctx->reg[cmd] with
+ *        the value to return, without handler the register content is returned.
+ */
+typedef void (*cmd_read_t)(cmd_context_t* ctx, uint8_t cmd);
+
+#define CMD_NOLOG 0x01    ///< Bytes returned to the master are not logged.
+#define CMD_STREAM 0x02   ///< Register pointer does not advance, a burst accesses the same command repeatedly.
+#define CMD_DEFER 0x04    ///< Slow write, the I2C interrupt only queues it and the main loop executes it.
+#define CMD_NOSCRIPT 0x08 ///< Command refused inside a script (script, block, status and stream reads of the master).
+#define CMD_PREFETCH 0x10 ///< Read without side effect, computed at the Restart before the read request.
+#define CMD_BCAST 0x20    ///< Write accepted from the general call address, applied by every board of the bus.
+
+/**
+ * @brief One entry of the command table, indexed by the command byte
+ */
+typedef struct
+{
+    cmd_write_t write; // write handler, NULL if the data is only saved
+    cmd_read_t read;   // read handler, NULL if the register is returned as is
+    uint8_t flags;     // CMD_xxx flags
+} cmd_entry_t;
+
+static_assert((CMD_QUEUE_SIZE & (CMD_QUEUE_SIZE - 1)) == 0, "CMD_QUEUE_SIZE must be a power of two");
+
+/**
+ * @brief Deferred command captured by the I2C interrupt
+ */
+typedef struct
+{
+    cmd_context_t* ctx; // context of the port who received the command
+    uint8_t cmd;        // command byte
+    uint8_t data;       // data byte written by the master
+} cmd_job_t;
+
+/**
+ * @brief Single-producer/single-consumer ring of deferred commands. The I2C interrupts write head, both
+ *        ports have the same priority so they never preempt each other. The main loop writes tail once
+ *        the command is executed. Indexes are free running.
+ */
+static struct
+{
+    cmd_job_t slot[CMD_QUEUE_SIZE]; // commands waiting for the main loop
+    volatile uint32_t head;         // number of commands queued
+    volatile uint32_t tail;         // number of commands executed
+    uint32_t seen;                  // tail at the last status read, used for the done bit
+} cmd_queue;
+
+#define SNAPSHOT_VERSION 1 ///< Layout of snapshot_t, incremented when the layout changes.
+
+/**
+ * @brief Device state latched by command 180 and read in one burst with command 181, little endian.
+ */
+typedef struct __attribute__((packed))
+{
+    uint8_t version;               // SNAPSHOT_VERSION
+    uint8_t size;                  // bytes of the snapshot, PEC included
+    uint8_t status;                // status register (100), done bit as of the last status read
+    uint8_t uart;                  // UART protocol (105)
+    uint8_t spi;                   // SPI protocol (115)
+    uint8_t i2c_speed;             // bus speed of the port who latched, 100 kHz units (95)
+    uint8_t pwm_enabled;           // PWM output running on GPIOF
+    uint16_t pwm_top;              // PWM counter wrap value
+    uint16_t pwm_div;              // PWM clock divider, 8.4 fixed point
+    uint32_t gpio_in;              // levels of all gpio
+    uint32_t gpio_out;             // SIO output levels
+    uint32_t gpio_oe;              // SIO output enables
+    uint8_t pad[NUM_BANK0_GPIOS];  // pad registers (65)
+    uint8_t func[NUM_BANK0_GPIOS]; // function selects (75)
+    uint8_t pec;                   // SMBus CRC-8 of the previous bytes
+} snapshot_t;
+
+/**
+ * @brief Last snapshot and the reading position of the master, shared by the ports like the log stream.
+ */
+static struct
+{
+    union
+    {
+        snapshot_t state;
+        uint8_t bytes[sizeof(snapshot_t)];
+    };
+    uint8_t pos; // next byte returned by command 181
+} snapshot;
+
+#define INJECT_DELAY 0x01   ///< Stretch the clock before the reply of the target reads.
+#define INJECT_NACK 0x02    ///< NACK the data bytes written to the target command.
+#define INJECT_DROP 0x04    ///< Release the bus on the target reads, the master reads 0xff.
+#define INJECT_HOLD_US 1000 ///< Time the controller stays disabled after a NACK or a drop, the master ends its transfer.
+
+/**
+ * @brief Latency injection test mode, used to check the timeouts and retries of the master. Off when
+ *        mode is 0, the I2C handler then only tests mode. The delays run on a hardware alarm, the interrupt
+ *        returns and the controller stretches the clock until the alarm writes the reply.
+ */
+static struct
+{
+    uint16_t delay_us;  // fixed delay of the replies (190-191)
+    uint8_t jitter_us;  // random delay added, 0 to jitter_us (192)
+    uint8_t target;     // command byte affected, 0 for all commands (193)
+    uint8_t mode;       // INJECT_DELAY, INJECT_NACK and INJECT_DROP bits (194), 0 = off
+    uint16_t delayed;   // replies delayed, read with 195-196
+    uint16_t faults;    // NACK and drops injected, read with 197-198
+    uint32_t rng;       // xorshift state of the jitter
+    uint alarm;         // hardware alarm of the delays
+    volatile bool busy; // alarm armed, a single action at a time for both ports
+    i2c_inst_t* i2c;    // controller of the armed action
+    uint8_t byte;       // reply written by the alarm
+    bool release;       // the alarm enables the controller again instead of writing a reply
+} inject;
+
+
+/*
+ * The pad and function helpers of the SDK are not inline, they would run from flash inside the
+ * I2C interrupt. These RAM copies access the registers directly.
+ */
+
+/// Enable the pull-up and/or the pull-down of a pad
+static inline void pad_set_pulls(uint gpio, bool up, bool down)
+{
+    hw_write_masked(&pads_bank0_hw->io[gpio], (up ? PADS_BANK0_GPIO0_PUE_BITS : 0) | (down ? PADS_BANK0_GPIO0_PDE_BITS : 0),
+                    PADS_BANK0_GPIO0_PUE_BITS | PADS_BANK0_GPIO0_PDE_BITS);
+}
+
+/// Set the drive strength of a pad
+static inline void pad_set_drive(uint gpio, uint strength)
+{
+    hw_write_masked(&pads_bank0_hw->io[gpio], strength << PADS_BANK0_GPIO0_DRIVE_LSB, PADS_BANK0_GPIO0_DRIVE_BITS);
+}
+
+/// Return the drive strength of a pad
+static inline uint8_t pad_get_drive(uint gpio)
+{
+    return (pads_bank0_hw->io[gpio] & PADS_BANK0_GPIO0_DRIVE_BITS) >> PADS_BANK0_GPIO0_DRIVE_LSB;
+}
+
+/// Return the function selected on a gpio
+static inline uint8_t io_get_function(uint gpio)
+{
+    return (io_bank0_hw->io[gpio].ctrl & IO_BANK0_GPIO0_CTRL_FUNCSEL_BITS) >> IO_BANK0_GPIO0_CTRL_FUNCSEL_LSB;
+}
+
+/**
+ * @brief Latch the device state into the snapshot. Interrupts are disabled while the registers
+ *        are read, so the SPI and UART handlers cannot change the state in the middle.
+ *
+ * @param ctx  context of the port, for the bus speed
+ */
+static void __not_in_flash_func(snapshot_latch)(const cmd_context_t* ctx)
+{
+    snapshot_t* snap = &snapshot.state;
+    uint slice = pwm_gpio_to_slice_num(GPIOF);
+    uint32_t irq = save_and_disable_interrupts();
+
+    status.busy = cmd_queue.head != cmd_queue.tail;
+    snap->status = status.all_flags;
+    snap->uart = get_uart_protocol();
+    snap->spi = get_spi_protocol();
+    snap->pwm_enabled = (pwm_hw->slice[slice].csr & PWM_CH0_CSR_EN_BITS) != 0;
+    snap->pwm_top = pwm_hw->slice[slice].top;
+    snap->pwm_div = pwm_hw->slice[slice].div;
+    snap->gpio_in = sio_hw->gpio_in;
+    snap->gpio_out = sio_hw->gpio_out;
+    snap->gpio_oe = sio_hw->gpio_oe;
+    for (uint gpio = 0; gpio < NUM_BANK0_GPIOS; gpio++)
+    {
+        snap->pad[gpio] = pads_bank0_hw->io[gpio];
+        snap->func[gpio] = io_get_function(gpio);
+    }
+    restore_interrupts(irq);
+
+    snap->version = SNAPSHOT_VERSION;
+    snap->size = sizeof(snapshot_t);
+    snap->i2c_speed = ctx->baudrate / I2C_SPEED_UNIT;
+    snap->pec = smbus_crc8(0, snapshot.bytes, sizeof(snapshot_t) - 1);
+    snapshot.pos = 0;
+}
+
+/*
+ * Write handlers
+ */
+
+/// Clear (10) or Set (11) Gpio
+static void __not_in_flash_func(wr_gpio_put)(cmd_context_t* ctx, uint8_t cmd)
+{
+    gpio_put(ctx->reg[cmd], cmd == 11);
+    LOG_EVENT(LOG_GPIO, LOG_INFO, EV_CMD_WRITE, cmd, ctx->reg[cmd], 0);
+}
+
+/// Set Gpio Direction to Output (20) or Input (21)
+static void __not_in_flash_func(wr_gpio_dir)(cmd_context_t* ctx, uint8_t cmd)
+{
+    gpio_set_dir(ctx->reg[cmd], cmd == 20);
+    LOG_EVENT(LOG_GPIO, LOG_INFO, EV_CMD_WRITE, cmd, ctx->reg[cmd], 0);
+}
+
+/// Set GPIO strength, 2mA (30), 4mA (31), 8mA (32) or 12mA (33)
+static void __not_in_flash_func(wr_gpio_strength)(cmd_context_t* ctx, uint8_t cmd)
+{
+    pad_set_drive(ctx->reg[cmd], cmd - 30);
+    LOG_EVENT(LOG_GPIO, LOG_INFO, EV_CMD_WRITE, cmd, ctx->reg[cmd], 0);
+}
+
+/// Set pull-up (41)
+static void __not_in_flash_func(wr_gpio_pull_up)(cmd_context_t* ctx, uint8_t cmd)
+{
+    pad_set_pulls(ctx->reg[cmd], true, false);
+    LOG_EVENT(LOG_GPIO, LOG_INFO, EV_CMD_WRITE, cmd, ctx->reg[cmd], 0);
+}
+
+/// Clear pull-up and pull-down (50)
+static void __not_in_flash_func(wr_gpio_no_pull)(cmd_context_t* ctx, uint8_t cmd)
+{
+    pad_set_pulls(ctx->reg[cmd], false, false);
+    LOG_EVENT(LOG_GPIO, LOG_INFO, EV_CMD_WRITE, cmd, ctx->reg[cmd], 0);
+}
+
+/// Set pull-down (51)
+static void __not_in_flash_func(wr_gpio_pull_down)(cmd_context_t* ctx, uint8_t cmd)
+{
+    pad_set_pulls(ctx->reg[cmd], false, true);
+    LOG_EVENT(LOG_GPIO, LOG_INFO, EV_CMD_WRITE, cmd, ctx->reg[cmd], 0);
+}
+
+/// Set PAD state (60), nothing to do other than save on register
+static void __not_in_flash_func(wr_pad_value)(cmd_context_t* ctx, uint8_t cmd)
+{
+    LOG_EVENT(LOG_GPIO, LOG_INFO, EV_CMD_WRITE, cmd, ctx->reg[cmd], 0);
+}
+
+/// Set GPx to PAD state (61), state is the value written with command 60
+static void __not_in_flash_func(wr_pad_state)(cmd_context_t* ctx, uint8_t cmd)
+{
+    hw_write_masked(&pads_bank0_hw->io[ctx->reg[cmd]], ctx->reg[cmd - 1], 0xfful); // Set Pad state
+    LOG_EVENT(LOG_GPIO, LOG_INFO, EV_CMD_WRITE, cmd, ctx->reg[cmd], ctx->reg[cmd - 1]);
+}
+
+/// Set PWM state (80) or PWM frequency (81), deferred
+static void wr_pwm(cmd_context_t* ctx, uint8_t cmd)
+{
+    set_pwm_frequency(ctx->reg[80], ctx->reg[81]);
+    LOG_EVENT(LOG_PWM, LOG_INFO, EV_CMD_WRITE, cmd, ctx->reg[cmd], 0);
+}
+
+/// Return the 32 bits little endian value written in the 4 registers ending at cmd
+static inline uint32_t reg_get32(const cmd_context_t* ctx, uint8_t cmd)
+{
+    return ctx->reg[cmd - 3] | (ctx->reg[cmd - 2] << 8) | (ctx->reg[cmd - 1] << 16) | ((uint32_t) ctx->reg[cmd] << 24);
+}
+
+/// Set outputs (133), clear outputs (137), set direction out (141) or in (145) of all gpio in a 32 bits mask.
+/// The mask is written little endian in the 4 registers ending at the command, executed on the last byte.
+static void __not_in_flash_func(wr_gpio_mask)(cmd_context_t* ctx, uint8_t cmd)
+{
+    uint32_t mask = reg_get32(ctx, cmd);
+
+    if (mask & ~GPIO_USER_MASK)
+    {
+        status.cmd = 1; // reserved pins, nothing is changed
+        LOG_EVENT(LOG_GPIO, LOG_ERROR, EV_CMD_ERROR, cmd, 0, mask);
+        return;
+    }
+
+    switch (cmd)
+    {
+    case 133:
+        gpio_put_masked(mask, mask);
+        break;
+    case 137:
+        gpio_put_masked(mask, 0);
+        break;
+    case 141:
+        gpio_set_dir_masked(mask, mask);
+        break;
+    default:
+        gpio_set_dir_masked(mask, 0);
+        break;
+    }
+    LOG_EVENT(LOG_GPIO, LOG_INFO, EV_CMD_WRITE, cmd, 0, mask);
+}
+
+/// Select the first pin of the shadow stream (170)
+static void __not_in_flash_func(wr_bank_pin)(cmd_context_t* ctx, uint8_t cmd)
+{
+    pin_bank_select(ctx->reg[cmd]);
+    LOG_EVENT(LOG_GPIO, LOG_DEBUG, EV_CMD_WRITE, cmd, ctx->reg[cmd], 0);
+}
+
+/// Write the shadow stream (171), 3 bytes per pin (see pin_bank.h), the pins do not change
+static void __not_in_flash_func(wr_bank_data)(cmd_context_t* ctx, uint8_t cmd)
+{
+    if (!pin_bank_write(ctx->reg[cmd]))
+    {
+        status.cmd = 1; // past the last pin
+        LOG_EVENT(LOG_GPIO, LOG_ERROR, EV_CMD_ERROR, cmd, ctx->reg[cmd], 0);
+    }
+}
+
+/// Commit the shadow to the pins (172), restore the pins before the last commit (173) or copy the pins
+/// into the shadow (174), data byte is ignored. Reserved pins are never changed, value = CPU cycles used.
+static void __not_in_flash_func(wr_bank_commit)(cmd_context_t* ctx, uint8_t cmd)
+{
+    uint32_t start = perf_cycles();
+
+    switch (cmd)
+    {
+    case 172:
+        pin_bank_commit(GPIO_USER_MASK);
+        break;
+    case 173:
+        pin_bank_restore(GPIO_USER_MASK);
+        break;
+    default:
+        pin_bank_load();
+        break;
+    }
+    LOG_EVENT(LOG_GPIO, LOG_INFO, EV_CMD_WRITE, cmd, ctx->reg[cmd], (start - perf_cycles()) & PERF_SYSTICK_MASK);
+}
+
+/// Clear the script before a new upload (150), data byte is ignored
+static void __not_in_flash_func(wr_script_reset)(cmd_context_t* ctx, uint8_t cmd)
+{
+    script_reset();
+    LOG_EVENT(LOG_SYS, LOG_INFO, EV_CMD_WRITE, cmd, ctx->reg[cmd], 0);
+}
+
+/// Append bytes to the script (151), stream command so a burst uploads the script
+static void __not_in_flash_func(wr_script_load)(cmd_context_t* ctx, uint8_t cmd)
+{
+    if (!script_load(ctx->reg[cmd]))
+    {
+        status.cmd = 1; // script full or running
+        LOG_EVENT(LOG_SYS, LOG_ERROR, EV_CMD_ERROR, cmd, ctx->reg[cmd], 0);
+    }
+}
+
+/// Run the loaded script (152), data byte is ignored
+static void __not_in_flash_func(wr_script_run)(cmd_context_t* ctx, uint8_t cmd)
+{
+    if (!script_start())
+    {
+        status.cmd = 1; // script running or empty
+        LOG_EVENT(LOG_SYS, LOG_ERROR, EV_CMD_ERROR, cmd, ctx->reg[cmd], 0);
+        return;
+    }
+    LOG_EVENT(LOG_SYS, LOG_INFO, EV_CMD_WRITE, cmd, ctx->reg[cmd], 0);
+}
+
+/// Restart the reading of the script results at the first value (155), data byte is ignored
+static void __not_in_flash_func(wr_script_rewind)(cmd_context_t* ctx, uint8_t cmd)
+{
+    script_result_rewind();
+}
+
+/// Latch the device state (180), read it with a burst of 181, data byte is ignored
+static void __not_in_flash_func(wr_snapshot)(cmd_context_t* ctx, uint8_t cmd)
+{
+    snapshot_latch(ctx);
+    LOG_EVENT(LOG_SYS, LOG_INFO, EV_CMD_WRITE, cmd, ctx->reg[cmd], snapshot.state.status);
+}
+
+/// Restart the reading of the snapshot at the first byte (181), data byte is ignored
+static void __not_in_flash_func(wr_snapshot_rewind)(cmd_context_t* ctx, uint8_t cmd)
+{
+    snapshot.pos = 0;
+}
+
+/// Clear log drop counter (93), data byte is ignored
+static void __not_in_flash_func(wr_log_clear_drop)(cmd_context_t* ctx, uint8_t cmd)
+{
+    log_bus_clear_drop(); // Restart the count of lost events
+    LOG_EVENT(LOG_SYS, LOG_INFO, EV_CMD_WRITE, cmd, ctx->reg[cmd], 0);
+}
+
+/// Set I2C bus speed of the port (94), data = speed in 100 kHz units: 1 Standard, 4 Fast-mode, 10 Fast-mode Plus, deferred.
+/// The master should wait for the status done bit, then talk at the new speed.
+static void wr_i2c_speed(cmd_context_t* ctx, uint8_t cmd)
+{
+    uint8_t speed = ctx->reg[cmd];
+    absolute_time_t timeout = make_timeout_time_us(I2C_IDLE_TIMEOUT_US);
+
+    if (ctx->i2c == NULL || speed == 0 || speed > I2C_SPEED_MAX)
+    {
+        status.cmd = 1;
+        LOG_EVENT(LOG_I2C, LOG_ERROR, EV_CMD_ERROR, cmd, speed, 0);
+        return;
+    }
+
+    // the controller is disabled while the timing is changed, wait for the Stop of the current transaction
+    while ((i2c_get_hw(ctx->i2c)->status & I2C_IC_STATUS_SLV_ACTIVITY_BITS) && !time_reached(timeout))
+    {
+        tight_loop_contents();
+    }
+    ctx->baudrate = speed * I2C_SPEED_UNIT;
+    i2c_set_baudrate(ctx->i2c, ctx->baudrate); // SDA hold time and spike filter follow the speed
+    LOG_EVENT(LOG_I2C, LOG_INFO, EV_CMD_WRITE, cmd, speed, ctx->baudrate);
+}
+
+/// Set the latency injection: delay in us (190-191 little endian, applied on 191), jitter in us (192),
+/// target command (193, 0 for all) or mode (194, 0 = off)
+static void __not_in_flash_func(wr_inject)(cmd_context_t* ctx, uint8_t cmd)
+{
+    switch (cmd)
+    {
+    case 191:
+        inject.delay_us = ctx->reg[190] | (ctx->reg[191] << 8);
+        break;
+    case 192:
+        inject.jitter_us = ctx->reg[cmd];
+        break;
+    case 193:
+        inject.target = ctx->reg[cmd];
+        break;
+    default:
+        inject.mode = ctx->reg[cmd] & (INJECT_DELAY | INJECT_NACK | INJECT_DROP);
+        break;
+    }
+    LOG_EVENT(LOG_I2C, LOG_INFO, EV_CMD_WRITE, cmd, ctx->reg[cmd], inject.delay_us);
+}
+
+/// Clear the latency injection counters (195), data byte is ignored
+static void __not_in_flash_func(wr_inject_clear)(cmd_context_t* ctx, uint8_t cmd)
+{
+    inject.delayed = 0;
+    inject.faults = 0;
+    LOG_EVENT(LOG_I2C, LOG_INFO, EV_CMD_WRITE, cmd, ctx->reg[cmd], 0);
+}
+
+/// Collect the bytes of a block write (160) or of the write phase of a block process call (161),
+/// the block is checked and executed at the end of the transaction by block_finish()
+static void __not_in_flash_func(wr_block)(cmd_context_t* ctx, uint8_t cmd)
+{
+    block_t* block = &ctx->block;
+
+    block->cmd = cmd;
+    if (block->in_len < sizeof(block->in))
+    {
+        block->in[block->in_len] = ctx->reg[cmd];
+    }
+    if (block->in_len <= sizeof(block->in))
+    {
+        block->in_len++;
+    }
+}
+
+/// Enable Uart TX/RX w/wo RTS/CTS (101), deferred
+static void wr_uart_enable(cmd_context_t* ctx, uint8_t cmd)
+{
+    enable_uart(ctx->reg[cmd]);
+    LOG_EVENT(LOG_UART, LOG_INFO, EV_CMD_WRITE, cmd, ctx->reg[cmd], 0);
+}
+
+/// Disable Uart and set as SIO (102), deferred
+static void wr_uart_disable(cmd_context_t* ctx, uint8_t cmd)
+{
+    disable_uart(ctx->reg[cmd]);
+    LOG_EVENT(LOG_UART, LOG_INFO, EV_CMD_WRITE, cmd, ctx->reg[cmd], 0);
+}
+
+/// Set uart protocol (103), deferred
+static void wr_uart_protocol(cmd_context_t* ctx, uint8_t cmd)
+{
+    set_uart_protocol(ctx->reg[cmd]);
+    LOG_EVENT(LOG_UART, LOG_INFO, EV_CMD_WRITE, cmd, ctx->reg[cmd], 0);
+}
+
+/// Enable SPI communication (111), deferred
+static void wr_spi_enable(cmd_context_t* ctx, uint8_t cmd)
+{
+    enable_spi();
+    LOG_EVENT(LOG_SPI, LOG_INFO, EV_CMD_WRITE, cmd, ctx->reg[cmd], 0);
+}
+
+/// Disable SPI and set as SIO (112), deferred
+static void wr_spi_disable(cmd_context_t* ctx, uint8_t cmd)
+{
+    disable_spi(ctx->reg[cmd]);
+    LOG_EVENT(LOG_SPI, LOG_INFO, EV_CMD_WRITE, cmd, ctx->reg[cmd], 0);
+}
+
+/// Set SPI format (113), deferred
+static void wr_spi_protocol(cmd_context_t* ctx, uint8_t cmd)
+{
+    set_spi_protocol(ctx->reg[cmd]);
+    LOG_EVENT(LOG_SPI, LOG_INFO, EV_CMD_WRITE, cmd, ctx->reg[cmd], 0);
+}
+
+/// Set SPI frames per DMA buffer (114), 0 = 256, used at the next enable
+static void __not_in_flash_func(wr_spi_frame_len)(cmd_context_t* ctx, uint8_t cmd)
+{
+    set_spi_frame_len(ctx->reg[cmd]);
+    LOG_EVENT(LOG_SPI, LOG_INFO, EV_CMD_WRITE, cmd, ctx->reg[cmd], 0);
+}
+
+/// Set SPI engine (116), PL022 or PIO with word size and bit order, used at the next enable
+static void __not_in_flash_func(wr_spi_engine)(cmd_context_t* ctx, uint8_t cmd)
+{
+    if (!set_spi_engine(ctx->reg[cmd]))
+    {
+        status.cmd = 1;
+        LOG_EVENT(LOG_SPI, LOG_ERROR, EV_CMD_ERROR, cmd, ctx->reg[cmd], 0);
+        return;
+    }
+    LOG_EVENT(LOG_SPI, LOG_INFO, EV_CMD_WRITE, cmd, ctx->reg[cmd], 0);
+}
+
+/// Set SPI test pattern (117), spi_pattern_t, used at the next enable
+static void __not_in_flash_func(wr_spi_pattern)(cmd_context_t* ctx, uint8_t cmd)
+{
+    if (!spi_pattern_select(ctx->reg[cmd]))
+    {
+        status.cmd = 1;
+        LOG_EVENT(LOG_SPI, LOG_ERROR, EV_CMD_ERROR, cmd, ctx->reg[cmd], 0);
+        return;
+    }
+    LOG_EVENT(LOG_SPI, LOG_INFO, EV_CMD_WRITE, cmd, ctx->reg[cmd], 0);
+}
+
+/// Latch the SPI pattern counters and restart their reading (118), data bit 0 = 1 clears the counters
+static void __not_in_flash_func(wr_spi_stats)(cmd_context_t* ctx, uint8_t cmd)
+{
+    spi_pattern_latch(ctx->reg[cmd] & 0x01);
+    LOG_EVENT(LOG_SPI, LOG_INFO, EV_CMD_WRITE, cmd, ctx->reg[cmd], 0);
+}
+
+/// Set log level (120), data = subsystem << 4 | level
+static void __not_in_flash_func(wr_log_level)(cmd_context_t* ctx, uint8_t cmd)
+{
+    if (!log_set_level(ctx->reg[cmd]))
+    {
+        status.cmd = 1;
+        LOG_EVENT(LOG_SYS, LOG_ERROR, EV_CMD_ERROR, cmd, ctx->reg[cmd], 0);
+    }
+    else
+    {
+        LOG_EVENT(LOG_SYS, LOG_INFO, EV_CMD_WRITE, cmd, ctx->reg[cmd], 0);
+    }
+}
+
+/*
+ * Read handlers, for command requesting a Get Value, the register is updated before return the content
+ */
+
+/// get Major Version (01)
+static void __not_in_flash_func(rd_version_major)(cmd_context_t* ctx, uint8_t cmd)
+{
+    ctx->reg[cmd] = IO_SELFTEST_VERSION_MAJOR;
+    LOG_EVENT(LOG_SYS, LOG_INFO, EV_CMD_READ, cmd, 0, ctx->reg[cmd]);
+}
+
+/// get Minor Version (02)
+static void __not_in_flash_func(rd_version_minor)(cmd_context_t* ctx, uint8_t cmd)
+{
+    ctx->reg[cmd] = IO_SELFTEST_VERSION_MINOR;
+    LOG_EVENT(LOG_SYS, LOG_INFO, EV_CMD_READ, cmd, 0, ctx->reg[cmd]);
+}
+
+/// read True value of Gpio (15)
+static void __not_in_flash_func(rd_gpio_get)(cmd_context_t* ctx, uint8_t cmd)
+{
+    bool tvalue = gpio_get(ctx->reg[cmd]);
+
+    LOG_EVENT(LOG_GPIO, LOG_INFO, EV_CMD_READ, cmd, ctx->reg[cmd], tvalue);
+    ctx->reg[cmd] = tvalue;
+}
+
+/// get GPIO Direction (25)
+static void __not_in_flash_func(rd_gpio_dir)(cmd_context_t* ctx, uint8_t cmd)
+{
+    bool tvalue = gpio_get_dir(ctx->reg[cmd]);
+
+    LOG_EVENT(LOG_GPIO, LOG_INFO, EV_CMD_READ, cmd, ctx->reg[cmd], tvalue);
+    ctx->reg[cmd] = tvalue;
+}
+
+/// get GPIO strength (35)
+static void __not_in_flash_func(rd_gpio_strength)(cmd_context_t* ctx, uint8_t cmd)
+{
+    uint8_t svalue = pad_get_drive(ctx->reg[cmd]);
+
+    LOG_EVENT(LOG_GPIO, LOG_INFO, EV_CMD_READ, cmd, ctx->reg[cmd], svalue);
+    ctx->reg[cmd] = svalue;
+}
+
+/// get pull-up (45)
+static void __not_in_flash_func(rd_gpio_pull_up)(cmd_context_t* ctx, uint8_t cmd)
+{
+    bool tvalue = gpio_is_pulled_up(ctx->reg[cmd]);
+
+    LOG_EVENT(LOG_GPIO, LOG_INFO, EV_CMD_READ, cmd, ctx->reg[cmd], tvalue);
+    ctx->reg[cmd] = tvalue;
+}
+
+/// get pull-down (55)
+static void __not_in_flash_func(rd_gpio_pull_down)(cmd_context_t* ctx, uint8_t cmd)
+{
+    bool tvalue = gpio_is_pulled_down(ctx->reg[cmd]);
+
+    LOG_EVENT(LOG_GPIO, LOG_INFO, EV_CMD_READ, cmd, ctx->reg[cmd], tvalue);
+    ctx->reg[cmd] = tvalue;
+}
+
+/// get PAD state (65)
+static void __not_in_flash_func(rd_pad_state)(cmd_context_t* ctx, uint8_t cmd)
+{
+    uint8_t svalue = pads_bank0_hw->io[ctx->reg[cmd]] & 0xff;
+
+    LOG_EVENT(LOG_GPIO, LOG_INFO, EV_CMD_READ, cmd, ctx->reg[cmd], svalue);
+    ctx->reg[cmd] = svalue;
+}
+
+/// get GPIO function (75)
+static void __not_in_flash_func(rd_gpio_function)(cmd_context_t* ctx, uint8_t cmd)
+{
+    uint8_t svalue = io_get_function(ctx->reg[cmd]);
+
+    LOG_EVENT(LOG_GPIO, LOG_INFO, EV_CMD_READ, cmd, ctx->reg[cmd], svalue);
+    ctx->reg[cmd] = svalue;
+}
+
+/// get level of all user gpio (146), the 4 bytes are latched so a burst read of 146-149 is coherent
+static void __not_in_flash_func(rd_gpio_all)(cmd_context_t* ctx, uint8_t cmd)
+{
+    uint32_t levels = gpio_get_all() & GPIO_USER_MASK;
+
+    ctx->reg[cmd] = levels;
+    ctx->reg[cmd + 1] = levels >> 8;
+    ctx->reg[cmd + 2] = levels >> 16;
+    ctx->reg[cmd + 3] = levels >> 24;
+    LOG_EVENT(LOG_GPIO, LOG_INFO, EV_CMD_READ, cmd, 0, levels);
+}
+
+/// get shadow stream (171), 3 bytes per pin from the pin selected by 170
+static void __not_in_flash_func(rd_bank_data)(cmd_context_t* ctx, uint8_t cmd)
+{
+    ctx->reg[cmd] = pin_bank_read();
+}
+
+/// get script state (153), script_state_t
+static void __not_in_flash_func(rd_script_state)(cmd_context_t* ctx, uint8_t cmd)
+{
+    ctx->reg[cmd] = script_state();
+}
+
+/// get number of script results (154)
+static void __not_in_flash_func(rd_script_count)(cmd_context_t* ctx, uint8_t cmd)
+{
+    ctx->reg[cmd] = script_result_count();
+}
+
+/// get script results (155), stream command so a burst reads all the values
+static void __not_in_flash_func(rd_script_result)(cmd_context_t* ctx, uint8_t cmd)
+{
+    ctx->reg[cmd] = script_result_byte();
+}
+
+/// get position in the script of the opcode who failed (156)
+static void __not_in_flash_func(rd_script_pc)(cmd_context_t* ctx, uint8_t cmd)
+{
+    ctx->reg[cmd] = script_pc();
+}
+
+/// get snapshot size (180), 0 before the first latch
+static void __not_in_flash_func(rd_snapshot_size)(cmd_context_t* ctx, uint8_t cmd)
+{
+    ctx->reg[cmd] = snapshot.state.size;
+}
+
+/// get snapshot (181), stream command returning the bytes of snapshot_t, 0 after the last one
+static void __not_in_flash_func(rd_snapshot)(cmd_context_t* ctx, uint8_t cmd)
+{
+    ctx->reg[cmd] = snapshot.pos < sizeof(snapshot_t) ? snapshot.bytes[snapshot.pos++] : 0;
+}
+
+/// get latency injection counters (195), 4 registers: delayed replies (195-196) and faults (197-198), little endian
+static void __not_in_flash_func(rd_inject_stats)(cmd_context_t* ctx, uint8_t cmd)
+{
+    ctx->reg[cmd] = inject.delayed;
+    ctx->reg[cmd + 1] = inject.delayed >> 8;
+    ctx->reg[cmd + 2] = inject.faults;
+    ctx->reg[cmd + 3] = inject.faults >> 8;
+    LOG_EVENT(LOG_I2C, LOG_INFO, EV_CMD_READ, cmd, 0, inject.delayed | (inject.faults << 16));
+}
+
+/// get the reply of the block process call (161): byte count, data bytes and PEC, stream command
+static void __not_in_flash_func(rd_block)(cmd_context_t* ctx, uint8_t cmd)
+{
+    block_t* block = &ctx->block;
+
+    ctx->reg[cmd] = block->out_pos < block->out_len ? block->out[block->out_pos++] : LOG_BUS_EMPTY;
+}
+
+/// get number of log events pending (90)
+static void __not_in_flash_func(rd_log_pending)(cmd_context_t* ctx, uint8_t cmd)
+{
+    ctx->reg[cmd] = log_bus_pending();
+    LOG_EVENT(LOG_SYS, LOG_DEBUG, EV_CMD_READ, cmd, 0, ctx->reg[cmd]);
+}
+
+/// get number of log events lost (91)
+static void __not_in_flash_func(rd_log_dropped)(cmd_context_t* ctx, uint8_t cmd)
+{
+    ctx->reg[cmd] = log_bus_dropped();
+    LOG_EVENT(LOG_SYS, LOG_DEBUG, EV_CMD_READ, cmd, 0, ctx->reg[cmd]);
+}
+
+/// get log events (92), 12 bytes per event, not logged to avoid feeding the stream with its own reads
+static void __not_in_flash_func(rd_log_stream)(cmd_context_t* ctx, uint8_t cmd)
+{
+    ctx->reg[cmd] = log_bus_read_byte();
+}
+
+/// get status register (100), busy and done report the deferred commands
+static void __not_in_flash_func(rd_status)(cmd_context_t* ctx, uint8_t cmd)
+{
+    uint32_t tail = cmd_queue.tail;
+
+    status.busy = cmd_queue.head != tail;
+    status.done = !status.busy && tail != cmd_queue.seen;
+    cmd_queue.seen = tail;
+    ctx->reg[REG_STATUS] = status.all_flags;
+    LOG_EVENT(LOG_SYS, LOG_INFO, EV_CMD_READ, cmd, 0, ctx->reg[REG_STATUS]);
+}
+
+/// get I2C bus speed of the port (95), in 100 kHz units
+static void __not_in_flash_func(rd_i2c_speed)(cmd_context_t* ctx, uint8_t cmd)
+{
+    ctx->reg[cmd] = ctx->baudrate / I2C_SPEED_UNIT;
+    LOG_EVENT(LOG_I2C, LOG_INFO, EV_CMD_READ, cmd, 0, ctx->reg[cmd]);
+}
+
+/// get UART protocol (105)
+static void __not_in_flash_func(rd_uart_protocol)(cmd_context_t* ctx, uint8_t cmd)
+{
+    uint8_t svalue = get_uart_protocol();
+
+    LOG_EVENT(LOG_UART, LOG_INFO, EV_CMD_READ, cmd, 0, svalue);
+    ctx->reg[cmd] = svalue;
+}
+
+/// get SPI protocol (115)
+static void __not_in_flash_func(rd_spi_protocol)(cmd_context_t* ctx, uint8_t cmd)
+{
+    uint8_t svalue = get_spi_protocol();
+
+    LOG_EVENT(LOG_SPI, LOG_INFO, EV_CMD_READ, cmd, 0, svalue);
+    ctx->reg[cmd] = svalue;
+}
+
+/// Get SPI engine (116)
+static void __not_in_flash_func(rd_spi_engine)(cmd_context_t* ctx, uint8_t cmd)
+{
+    ctx->reg[cmd] = get_spi_engine();
+}
+
+/// Get SPI test pattern (117)
+static void __not_in_flash_func(rd_spi_pattern)(cmd_context_t* ctx, uint8_t cmd)
+{
+    ctx->reg[cmd] = spi_pattern_selected();
+}
+
+/// get SPI pattern counters (118), stream command returning the bytes of spi_pattern_stats_t, 0 after the last one
+static void __not_in_flash_func(rd_spi_stats)(cmd_context_t* ctx, uint8_t cmd)
+{
+    ctx->reg[cmd] = spi_pattern_read();
+}
+
+/// get log level of subsystem (125), subsystem is the value written with this command
+static void __not_in_flash_func(rd_log_level)(cmd_context_t* ctx, uint8_t cmd)
+{
+    uint8_t svalue = ctx->reg[cmd] < LOG_SUB_COUNT ? log_level[ctx->reg[cmd]] : 0;
+
+    LOG_EVENT(LOG_SYS, LOG_INFO, EV_CMD_READ, cmd, ctx->reg[cmd], svalue);
+    ctx->reg[cmd] = svalue;
+}
+
+/**
+ * @brief Command table indexed by the command byte. A new command is added with one row.
+ *        The table is kept in RAM with the handlers, so the dispatch does not depend on the flash cache.
+ */
+static const cmd_entry_t __not_in_flash("cmd") cmd_table[256] = {
+    [1] = {NULL, rd_version_major, CMD_PREFETCH},                                            // Major version
+    [2] = {NULL, rd_version_minor, CMD_PREFETCH},                                            // Minor version
+    [10] = {wr_gpio_put, NULL, 0},                                                           // Clear Gpio
+    [11] = {wr_gpio_put, NULL, 0},                                                           // Set Gpio
+    [15] = {NULL, rd_gpio_get, CMD_PREFETCH},                                                // Read true value of Gpio
+    [20] = {wr_gpio_dir, NULL, 0},                                                           // Set Gpio Direction to Output
+    [21] = {wr_gpio_dir, NULL, 0},                                                           // Set Gpio Direction to Input
+    [25] = {NULL, rd_gpio_dir, CMD_PREFETCH},                                                // Get Gpio Direction
+    [30] = {wr_gpio_strength, NULL, 0},                                                      // Set GPIO strength = 2mA
+    [31] = {wr_gpio_strength, NULL, 0},                                                      // Set GPIO strength = 4mA
+    [32] = {wr_gpio_strength, NULL, 0},                                                      // Set GPIO strength = 8mA
+    [33] = {wr_gpio_strength, NULL, 0},                                                      // Set GPIO strength = 12mA
+    [35] = {NULL, rd_gpio_strength, CMD_PREFETCH},                                           // Get GPIO strength
+    [41] = {wr_gpio_pull_up, NULL, 0},                                                       // Set pull-up
+    [45] = {NULL, rd_gpio_pull_up, CMD_PREFETCH},                                            // Get pull-up
+    [50] = {wr_gpio_no_pull, NULL, 0},                                                       // Clear pull-up and pull-down
+    [51] = {wr_gpio_pull_down, NULL, 0},                                                     // Set pull-down
+    [55] = {NULL, rd_gpio_pull_down, CMD_PREFETCH},                                          // Get pull-down
+    [60] = {wr_pad_value, NULL, CMD_BCAST},                                                  // Set PAD state value
+    [61] = {wr_pad_state, NULL, CMD_BCAST},                                                  // Set GPx to PAD state
+    [65] = {NULL, rd_pad_state, CMD_PREFETCH},                                               // Get PAD state
+    [75] = {NULL, rd_gpio_function, CMD_PREFETCH},                                           // Get GPIO function
+    [80] = {wr_pwm, NULL, CMD_DEFER | CMD_BCAST},                                            // Set PWM state
+    [81] = {wr_pwm, NULL, CMD_DEFER | CMD_BCAST},                                            // Set PWM frequency
+    [90] = {NULL, rd_log_pending, CMD_PREFETCH},                                             // Get log events pending
+    [91] = {NULL, rd_log_dropped, CMD_PREFETCH},                                             // Get log events lost
+    [92] = {NULL, rd_log_stream, CMD_NOLOG | CMD_STREAM | CMD_NOSCRIPT},                     // Get log events stream
+    [93] = {wr_log_clear_drop, NULL, 0},                                                     // Clear log drop counter
+    [94] = {wr_i2c_speed, NULL, CMD_DEFER},                                                  // Set I2C bus speed
+    [95] = {NULL, rd_i2c_speed, CMD_PREFETCH},                                               // Get I2C bus speed
+    [100] = {NULL, rd_status, CMD_NOSCRIPT},                                                 // Get status register
+    [101] = {wr_uart_enable, NULL, CMD_DEFER | CMD_BCAST},                                   // Enable Uart
+    [102] = {wr_uart_disable, NULL, CMD_DEFER | CMD_BCAST},                                  // Disable Uart
+    [103] = {wr_uart_protocol, NULL, CMD_DEFER | CMD_BCAST},                                 // Set uart protocol
+    [105] = {NULL, rd_uart_protocol, CMD_PREFETCH},                                          // Get uart protocol
+    [111] = {wr_spi_enable, NULL, CMD_DEFER | CMD_BCAST},                                    // Enable SPI
+    [112] = {wr_spi_disable, NULL, CMD_DEFER | CMD_BCAST},                                   // Disable SPI
+    [113] = {wr_spi_protocol, NULL, CMD_DEFER | CMD_BCAST},                                  // Set SPI format
+    [114] = {wr_spi_frame_len, NULL, CMD_BCAST},                                             // Set SPI frame length
+    [115] = {NULL, rd_spi_protocol, CMD_PREFETCH},                                           // Get SPI protocol
+    [116] = {wr_spi_engine, rd_spi_engine, CMD_BCAST | CMD_PREFETCH},                        // Set/Get SPI engine
+    [117] = {wr_spi_pattern, rd_spi_pattern, CMD_BCAST | CMD_PREFETCH},                      // Set/Get SPI test pattern
+    [118] = {wr_spi_stats, rd_spi_stats, CMD_STREAM | CMD_NOLOG | CMD_BCAST | CMD_NOSCRIPT}, // Get the SPI pattern counters, write to latch
+    [120] = {wr_log_level, NULL, 0},                                                         // Set log level
+    [125] = {NULL, rd_log_level, CMD_PREFETCH},                                              // Get log level of subsystem
+    [133] = {wr_gpio_mask, NULL, CMD_BCAST},                                                 // Set outputs by mask, mask in 130-133
+    [137] = {wr_gpio_mask, NULL, CMD_BCAST},                                                 // Clear outputs by mask, mask in 134-137
+    [141] = {wr_gpio_mask, NULL, CMD_BCAST},                                                 // Set direction output by mask, mask in 138-141
+    [145] = {wr_gpio_mask, NULL, CMD_BCAST},                                                 // Set direction input by mask, mask in 142-145
+    [146] = {NULL, rd_gpio_all, CMD_PREFETCH},                                               // Get level of all user gpio, 4 bytes in 146-149
+    [150] = {wr_script_reset, NULL, CMD_NOSCRIPT},                                           // Clear the script
+    [151] = {wr_script_load, NULL, CMD_STREAM | CMD_NOSCRIPT},                               // Append bytes to the script
+    [152] = {wr_script_run, NULL, CMD_NOSCRIPT},                                             // Run the script
+    [153] = {NULL, rd_script_state, CMD_NOSCRIPT | CMD_PREFETCH},                            // Get script state
+    [154] = {NULL, rd_script_count, CMD_NOSCRIPT | CMD_PREFETCH},                            // Get number of script results
+    [155] = {wr_script_rewind, rd_script_result, CMD_STREAM | CMD_NOLOG | CMD_NOSCRIPT},     // Get script results, write to restart the reading
+    [156] = {NULL, rd_script_pc, CMD_NOSCRIPT | CMD_PREFETCH},                               // Get position of the failed opcode
+    [160] = {wr_block, NULL, CMD_STREAM | CMD_NOSCRIPT},                                     // SMBus block write, executed at the Stop
+    [161] = {wr_block, rd_block, CMD_STREAM | CMD_NOLOG | CMD_NOSCRIPT},                     // SMBus block process call, read registers
+    [170] = {wr_bank_pin, NULL, CMD_BCAST},                                                  // Select the first pin of the shadow stream
+    [171] = {wr_bank_data, rd_bank_data, CMD_STREAM | CMD_NOLOG | CMD_BCAST},                // Shadow pin stream, 3 bytes per pin
+    [172] = {wr_bank_commit, NULL, CMD_BCAST},                                               // Commit the shadow to the pins
+    [173] = {wr_bank_commit, NULL, CMD_BCAST},                                               // Restore the pins before the last commit
+    [174] = {wr_bank_commit, NULL, CMD_BCAST},                                               // Copy the pins into the shadow
+    [180] = {wr_snapshot, rd_snapshot_size, CMD_PREFETCH},                                   // Latch the device state, read the snapshot size
+    [181] = {wr_snapshot_rewind, rd_snapshot, CMD_STREAM | CMD_NOLOG | CMD_NOSCRIPT},        // Get the snapshot, write to restart the reading
+    [191] = {wr_inject, NULL, 0},                                                            // Set injected delay in us, low byte in 190
+    [192] = {wr_inject, NULL, 0},                                                            // Set injected jitter in us
+    [193] = {wr_inject, NULL, 0},                                                            // Set command affected by the injection, 0 for all
+    [194] = {wr_inject, NULL, 0},                                                            // Set injection mode, 0 = off
+    [195] = {wr_inject_clear, rd_inject_stats, 0},                                           // Get injection counters in 195-198, write to clear
+};
+
+static cmd_context_t script_context; // register memory of the scripts, the I2C master registers are not changed
+
+/**
+ * @brief Execute a write command for a script.
+ */
+static bool script_write(uint8_t cmd, uint8_t data)
+{
+    if (cmd_table[cmd].flags & CMD_NOSCRIPT)
+    {
+        return false; // a script cannot load or start a script, nor use the master block buffer
+    }
+    script_context.reg[cmd] = data;
+    if (cmd_table[cmd].write != NULL)
+    {
+        cmd_table[cmd].write(&script_context, cmd);
+    }
+    return true;
+}
+
+/**
+ * @brief Execute a read command for a script.
+ */
+static bool script_read(uint8_t cmd, uint8_t param, uint8_t* value)
+{
+    if (cmd_table[cmd].flags & CMD_NOSCRIPT)
+    {
+        return false; // the streams and the status done bit belong to the I2C master, the interrupt may read them meanwhile
+    }
+    script_context.reg[cmd] = param;
+    if (cmd_table[cmd].read != NULL)
+    {
+        cmd_table[cmd].read(&script_context, cmd);
+    }
+    *value = script_context.reg[cmd];
+    return true;
+}
+
+/**
+ * @brief Access to the commands for the script engine
+ */
+static const script_io_t script_io = {
+    .write = script_write,
+    .read = script_read,
+    .time_us = time_us_32,
+};
+
+/**
+ * @brief Queue a slow write command for the main loop. Called from the I2C interrupt, which
+ *        only captures the command and its data so it returns in a few microseconds.
+ *
+ * @param ctx  context holding the data byte
+ * @param cmd  command byte
+ */
+static void __not_in_flash_func(cmd_defer)(cmd_context_t* ctx, uint8_t cmd)
+{
+    uint32_t head = cmd_queue.head;
+
+    if (head - cmd_queue.tail >= CMD_QUEUE_SIZE)
+    {
+        status.cmd = 1; // queue full, the command is lost
+        LOG_EVENT(LOG_SYS, LOG_ERROR, EV_CMD_ERROR, cmd, ctx->reg[cmd], 0);
+        return;
+    }
+    cmd_queue.slot[head & (CMD_QUEUE_SIZE - 1)] = (cmd_job_t){ctx, cmd, ctx->reg[cmd]};
+    __dmb(); // slot content must be visible before the new head
+    cmd_queue.head = head + 1;
+}
+
+/**
+ * @brief Execute a write command received from the master, the data byte is in ctx->reg[cmd].
+ *        Slow commands are queued for the main loop.
+ *
+ * @param ctx  context of the I2C master
+ * @param cmd  command byte
  */
-struct
+static void __not_in_flash_func(cmd_write)(cmd_context_t* ctx, uint8_t cmd)
 {
-    MESSAGE messages[QUEUE_SIZE]; ///< Array of messages in the queue.
-    int begin;                    ///< Index of the queue's first message.
-    int end;                      ///< Index of the queue's last message.
-    int current_load;             ///< Number of messages currently in the queue.
-} queue;
+    const cmd_entry_t* entry = &cmd_table[cmd];
+
+    if (entry->flags & CMD_DEFER)
+    {
+        cmd_defer(ctx, cmd); // executed later by the main loop
+    }
+    else if (entry->write != NULL)
+    {
+        entry->write(ctx, cmd);
+    }
+}
 
 /**
- * @brief Enqueue a message into the queue.
+ * @brief Execute a data byte written by the master, the bytes of a burst go to consecutive registers.
+ *        From the general call address, only the configuration writes are accepted.
  *
- * @param message Pointer to the message to be enqueued.
- * @return true if the message was successfully enqueued, false if the queue is full.
+ * @param ctx           context of the I2C master, ctx->reg_address holds the command byte
+ * @param data          byte written
+ * @param general_call  the byte was sent to the general call address
  */
-bool enque(MESSAGE* message)
+static void __not_in_flash_func(cmd_receive)(cmd_context_t* ctx, uint8_t data, bool general_call)
 {
-    if (queue.current_load < QUEUE_SIZE)
+    uint8_t cmd = ctx->reg_address + ctx->reg_offset;
+    const cmd_entry_t* entry = &cmd_table[cmd];
+
+    perf.i2c_rx++;
+    if (!general_call || entry->write == NULL)
     {
-        if (queue.end == QUEUE_SIZE)
-        {
-            queue.end = 0;
-        }
-        queue.messages[queue.end] = *message;
-        queue.end++;
-        queue.current_load++;
-        return true;
+        ctx->reg[cmd] = data; // registers without handler (mask bytes) only store the byte
+        cmd_write(ctx, cmd);
+    }
+    else if (entry->flags & CMD_BCAST)
+    {
+        ctx->reg[cmd] = data;
+        cmd_write(ctx, cmd);
+        status.bcast = 1;
     }
     else
     {
-        return false;
+        status.cmd = 1; // only configuration writes are accepted from the general call address
+        status.bcast = 0;
+        LOG_EVENT(LOG_I2C, LOG_WARNING, EV_CMD_ERROR, cmd, data, 0);
+    }
+    if (!(entry->flags & CMD_STREAM))
+    {
+        ctx->reg_offset++;
     }
 }
 
 /**
- * @brief Initialize the queue.
+ * @brief Compute the next byte read by the master, the bytes of a burst return consecutive registers.
+ *
+ * @param ctx  context of the I2C master, ctx->reg_address holds the command byte
+ * @return uint8_t  register returned, ctx->reg[] holds its value
  */
-void init_queue()
+static uint8_t __not_in_flash_func(cmd_read)(cmd_context_t* ctx)
 {
-    queue.begin = 0;                                                  /// Initialize the beginning index.
-    queue.end = 0;                                                    /// Initialize the end index.
-    queue.current_load = 0;                                           /// Initialize the current load.
-    memset(&queue.messages[0], 0, QUEUE_SIZE * sizeof(MESSAGE_SIZE)); /// Clear the queue.
+    uint8_t cmd = ctx->reg_address + ctx->reg_offset;
+    const cmd_entry_t* entry = &cmd_table[cmd];
+
+    if (ctx->prefetched)
+    {
+        ctx->prefetched = false; // first byte already computed at the Restart
+    }
+    else if (entry->read != NULL)
+    {
+        entry->read(ctx, cmd); // update the register before return the content
+    }
+    return cmd;
 }
 
 /**
- * @brief Dequeue a message from the queue.
+ * @brief Count and log a byte handed to the master, then move to the next register of the burst.
  *
- * @param message Pointer to the message to be dequeued.
- * @return true if the message was successfully dequeued, false if the queue is empty.
+ * @param ctx  context of the I2C master
+ * @param cmd  register returned by cmd_read()
  */
-bool deque(MESSAGE* message)
+static void __not_in_flash_func(cmd_read_done)(cmd_context_t* ctx, uint8_t cmd)
 {
-    if (queue.current_load > 0)
+    const cmd_entry_t* entry = &cmd_table[cmd];
+
+    perf.i2c_tx++;
+    if (!(entry->flags & CMD_NOLOG))
     {
-        *message = queue.messages[queue.begin];                   /// Retrieve the message from the queue.
-        memset(&queue.messages[queue.begin], 0, sizeof(MESSAGE)); /// Clear the dequeued message.
-        queue.begin = (queue.begin + 1) % QUEUE_SIZE;             /// Update the beginning index.
-        queue.current_load--;
-        return true;
+        LOG_EVENT(LOG_I2C, LOG_DEBUG, EV_READ_REPLY, cmd, 0, ctx->reg[cmd]);
+    }
+    if (!(entry->flags & CMD_STREAM))
+    {
+        ctx->reg_offset++;
+    }
+}
+
+/**
+ * @brief Refuse a block, nothing of the block is applied.
+ *
+ * @param block  block refused
+ * @param count  byte count received
+ * @param len    number of bytes received
+ */
+static void __not_in_flash_func(block_error)(block_t* block, uint8_t count, uint8_t len)
+{
+    status.error = 1;
+    block->out_len = 0;
+    LOG_EVENT(LOG_I2C, LOG_ERROR, EV_CMD_ERROR, block->cmd, count, len);
+}
+
+/**
+ * @brief Check and execute the block received in the transaction who just ended, called from the
+ *        I2C interrupt at the Stop or Restart.
+ *
+ * @details Block write (160): count, first register, count - 1 values, optional PEC. The values are
+ *          written from the first register as a burst would do, a stream command receives them all.
+ *          Block process call (161): count = 2, first register, number of registers, then after the
+ *          Restart the master reads count, the registers and the PEC.
+ *          The PEC covers the address and command bytes as defined by SMBus. A block with a wrong
+ *          length or PEC is refused as a whole and flagged with status.error.
+ *
+ * @param ctx  context of the I2C master
+ */
+static void __not_in_flash_func(block_finish)(cmd_context_t* ctx)
+{
+    block_t* block = &ctx->block;
+    uint8_t addr = ctx->i2c_add << 1; // address byte of the write phase
+    uint8_t count = block->in[0];
+    uint8_t len = block->in_len;
+    uint8_t first = block->in[1];
+    uint8_t size;
+    uint8_t pec;
+    uint8_t cmd;
+
+    block->in_len = 0;
+    if (count < 2 || count > SMBUS_BLOCK_MAX || (len != count + 1 && len != count + 2))
+    {
+        block_error(block, count, len);
+        return;
+    }
+
+    pec = smbus_crc8(0, &addr, 1);
+    pec = smbus_crc8(pec, &block->cmd, 1);
+    pec = smbus_crc8(pec, block->in, count + 1);
+    if (len == count + 2 && pec != block->in[count + 1])
+    {
+        block_error(block, count, len); // corrupted on the bus
+        return;
+    }
+
+    if (block->cmd == CMD_BLOCK_WRITE)
+    {
+        size = count - 1;
+        cmd = first;
+        for (uint i = 0; i < size; i++)
+        {
+            if (cmd_table[cmd].write == wr_block)
+            {
+                block_error(block, count, len); // nested block
+                return;
+            }
+            if (!(cmd_table[cmd].flags & CMD_STREAM))
+            {
+                cmd++;
+            }
+        }
+        cmd = first;
+        for (uint i = 0; i < size; i++)
+        {
+            ctx->reg[cmd] = block->in[2 + i];
+            cmd_write(ctx, cmd);
+            if (!(cmd_table[cmd].flags & CMD_STREAM))
+            {
+                cmd++; // same order as a burst write
+            }
+        }
+        LOG_EVENT(LOG_I2C, LOG_INFO, EV_CMD_WRITE, block->cmd, first, size);
+        return;
+    }
+
+    // block process call, the PEC of the reply continues the PEC of the write phase
+    size = block->in[2];
+    if (count != 2 || len != count + 1 || size == 0 || size > SMBUS_BLOCK_MAX)
+    {
+        block_error(block, count, len);
+        return;
+    }
+    cmd = first;
+    block->out[0] = size;
+    for (uint i = 0; i < size; i++)
+    {
+        if (cmd_table[cmd].read != NULL && cmd_table[cmd].read != rd_block)
+        {
+            cmd_table[cmd].read(ctx, cmd);
+        }
+        block->out[1 + i] = ctx->reg[cmd];
+        if (!(cmd_table[cmd].flags & CMD_STREAM))
+        {
+            cmd++; // same order as a burst read
+        }
+    }
+    addr |= 1; // address byte of the read phase
+    pec = smbus_crc8(pec, &addr, 1);
+    block->out[1 + size] = smbus_crc8(pec, block->out, 1 + size);
+    block->out_len = size + 2;
+    block->out_pos = 0;
+    LOG_EVENT(LOG_I2C, LOG_INFO, EV_CMD_READ, block->cmd, first, size);
+}
+
+/**
+ * @brief Execute the deferred commands, called at each iteration of the main loop.
+ *        The status busy bit stays set until the last command is executed.
+ */
+static void cmd_task(void)
+{
+    uint32_t tail = cmd_queue.tail;
+    cmd_job_t job;
+
+    while (cmd_queue.head != tail)
+    {
+        __dmb(); // head must be read before the slot content
+        job = cmd_queue.slot[tail & (CMD_QUEUE_SIZE - 1)];
+        job.ctx->reg[job.cmd] = job.data; // the master may have written the register again since
+        cmd_table[job.cmd].write(job.ctx, job.cmd);
+        tail++;
+        cmd_queue.tail = tail;
+    }
+}
+
+/**
+ * @brief Interrupt of the latency injection alarm: write the delayed reply, or enable the controller
+ *        again after a NACK or a drop.
+ */
+static void __not_in_flash_func(inject_alarm)(void)
+{
+    timer_hw->intr = 1u << inject.alarm;
+    if (inject.release)
+    {
+        i2c_slave_resume(inject.i2c);
     }
     else
+    {
+        i2c_write_byte(inject.i2c, inject.byte); // the master is released
+    }
+    inject.busy = false;
+}
+
+/**
+ * @brief Arm the alarm of the latency injection. For a release, the controller is disabled at once:
+ *        the bytes written by the master are NACKed and the bus is released during a read.
+ *
+ * @param i2c      controller of the port
+ * @param byte     reply written by the alarm
+ * @param release  disable the controller until the alarm instead of delaying a reply
+ * @param us       delay of the alarm
+ * @return true if armed, false if an action is already pending.
+ */
+static bool __not_in_flash_func(inject_arm)(i2c_inst_t* i2c, uint8_t byte, bool release, uint32_t us)
+{
+    if (inject.busy)
     {
         return false;
     }
+    inject.busy = true;
+    inject.i2c = i2c;
+    inject.byte = byte;
+    inject.release = release;
+    if (release)
+    {
+        i2c_slave_drop(i2c); // FIFOs are flushed, the master sees a NACK or reads 0xff, the transfer is finished
+    }
+    // the alarm register is written directly, the SDK alarm functions run from flash
+    uint32_t target = timer_hw->timerawl + us;
+    timer_hw->alarm[inject.alarm] = target;
+    if ((int32_t) (timer_hw->timerawl - target) >= 0 && (timer_hw->armed & (1u << inject.alarm)))
+    {
+        timer_hw->armed = 1u << inject.alarm; // time already passed, the alarm would match only after the counter wraps
+        inject_alarm();
+    }
+    return true;
 }
 
 /**
- * @brief Error flags collected during execution
+ * @brief Apply the latency injection to a reply, called only when the injection is on.
  *
+ * @param i2c   controller of the port
+ * @param cmd   command byte of the transaction
+ * @param byte  reply to the master
+ * @return true if the reply is delayed or dropped, false if it must be written now.
  */
-static union
+static bool __not_in_flash_func(inject_reply)(i2c_inst_t* i2c, uint8_t cmd, uint8_t byte)
 {
-    uint8_t all_flags; /// All flags combined into a single byte.
-    struct
+    uint32_t us = inject.delay_us;
+
+    if (inject.target != 0 && inject.target != cmd)
     {
-        uint8_t cfg : 1;     /// Configuration error flag.
-        uint8_t cmd : 1;     /// Command error flag.
-        uint8_t error : 1;   /// General error flag.
-        uint8_t watch : 1;   /// Watchdog error flag.
-        uint8_t sparesA : 1; /// Spare flag A.
-        uint8_t sparesB : 1; /// Spare flag B.
-        uint8_t sparesC : 1; /// Spare flag C.
-        uint8_t sparesD : 1; /// Spare flag D.
-    };
-} status;
+        return false;
+    }
+    if (inject.mode & INJECT_DROP)
+    {
+        if (!inject_arm(i2c, 0, true, INJECT_HOLD_US))
+        {
+            return false;
+        }
+        inject.faults++;
+        return true;
+    }
+    if (!(inject.mode & INJECT_DELAY))
+    {
+        return false;
+    }
+    if (inject.jitter_us != 0)
+    {
+        inject.rng ^= inject.rng << 13;
+        inject.rng ^= inject.rng >> 17;
+        inject.rng ^= inject.rng << 5;
+        us += inject.rng % (inject.jitter_us + 1u);
+    }
+    if (!inject_arm(i2c, byte, false, us))
+    {
+        return false;
+    }
+    inject.delayed++;
+    return true;
+}
 
 /**
- * @brief The slave implements a 128 byte memory. The memory address use the command byte value as memory pointer,
- *        The 8 bit data is written starting at command value
+ * @brief Apply the latency injection to a command byte written by the master, called only when
+ *        the injection is on. The data bytes of the target command are NACKed.
  *
+ * @param i2c  controller of the port
+ * @param cmd  command byte
+ * @return true if the transfer is dropped, the bytes left in the Rx FIFO must not be executed.
  */
-static struct
+static bool __not_in_flash_func(inject_write)(i2c_inst_t* i2c, uint8_t cmd)
 {
-    uint8_t reg[128];         // contains data following command byte
-    uint8_t reg_address;      // contains command number
-    uint8_t reg_status;       // contains status of command
-    bool reg_address_written; // Flag for command byte received
-    uint8_t i2c_add;
-} context;
+    if ((inject.mode & INJECT_NACK) && (inject.target == 0 || inject.target == cmd) && inject_arm(i2c, 0, true, INJECT_HOLD_US))
+    {
+        inject.faults++;
+        LOG_EVENT(LOG_I2C, LOG_WARNING, EV_CMD_ERROR, cmd, 0, inject.faults);
+        return true;
+    }
+    return false;
+}
 
 /**
  * @brief Our handler is called from the I2C ISR, so it must complete quickly. Blocking calls
- * printing to stdio may interfere with interrupt handling.
+ * printing to stdio may interfere with interrupt handling. The main port uses this handler, the second
+ * port runs in transaction mode (aux_message_handler() and aux_response_handler()). Both interrupts have
+ * the same priority on core0, so the shared rings keep a single writer.
  *
  * @param i2c i2c instance used
  * @param event interrupt from receive or transmit
  */
-static void i2c_slave_handler(i2c_inst_t* i2c, i2c_slave_event_t event)
+static void __not_in_flash_func(i2c_slave_handler)(i2c_inst_t* i2c, i2c_slave_event_t event)
 {
-    MESSAGE rec;
-    uint8_t cmd; // = 127;  // keep command value
-    bool tvalue;
-    uint8_t svalue;
-    uint32_t maskvalue;
-    char str_answer[80];
+    uint32_t start = perf_cycles();
+    cmd_context_t* ctx = &context;
+    const cmd_entry_t* entry;
+    uint8_t cmd;
 
     switch (event)
     {
     case I2C_SLAVE_RECEIVE: // master has written some data
-        if (!context.reg_address_written)
+        while (i2c_get_read_available(i2c) > 0)
         {
-            // writes always start with the memory address
-            context.reg_address = i2c_read_byte(i2c); // Command byte
-            context.reg_address_written = true;
-            // sprintf(&rec.data[0],"On i2c  cmd");
-            // enque(&rec);
-        }
-        else
-        {                                                          // WRITE COMMAND
-            context.reg[context.reg_address] = i2c_read_byte(i2c); // read Byte
-                                                                   // sprintf(&rec.data[0],"On i2c  data");
-                                                                   // enque(&rec);
-
-            cmd = context.reg_address;
-
-            switch (cmd)
-            { // Command byte
-
-            case 10: // Clear Gpio
-                gpio_put(context.reg[context.reg_address], 0);
-                sprintf(&rec.data[0], "Cmd %02d, Clear Gpio: %02d ", cmd, context.reg[context.reg_address]);
-                enque(&rec);
-                break;
-
-            case 11: // Set Gpio
-                gpio_put(context.reg[context.reg_address], 1);
-                sprintf(&rec.data[0], "Cmd %02d, Set Gpio: %02d ", cmd, context.reg[context.reg_address]);
-                enque(&rec);
-                break;
-
-            case 20:                                               // Set Gpio Direction to Output
-                gpio_set_dir(context.reg[context.reg_address], 1); // turn OFF Led
-                sprintf(&rec.data[0], "Cmd %02d, Set Dir Out Gpio: %02d ", cmd, context.reg[context.reg_address]);
-                enque(&rec);
-                break;
-
-            case 21:                                               // Set Gpio Direction to Input
-                gpio_set_dir(context.reg[context.reg_address], 0); // turn OFF Led
-                sprintf(&rec.data[0], "Cmd %02d, Set dir In Gpio: %02d ", cmd, context.reg[context.reg_address]);
-                enque(&rec);
-                break;
-
-            case 30:                                                                                // Set GPIO strength = 2mA
-                gpio_set_drive_strength(context.reg[context.reg_address], GPIO_DRIVE_STRENGTH_2MA); // set Value
-                sprintf(&rec.data[0], "Cmd %02d, 2mA Gpio: %02d ", cmd, context.reg[context.reg_address]);
-                enque(&rec);
-                break;
-
-            case 31:                                                                                // Set GPIO strength = 4mA
-                gpio_set_drive_strength(context.reg[context.reg_address], GPIO_DRIVE_STRENGTH_4MA); // set Value
-                sprintf(&rec.data[0], "Cmd %02d, 4mA Gpio: %02d ", cmd, context.reg[context.reg_address]);
-                enque(&rec);
-                break;
-
-            case 32:                                                                                // Set GPIO strength = 8mA
-                gpio_set_drive_strength(context.reg[context.reg_address], GPIO_DRIVE_STRENGTH_8MA); // set Value
-                sprintf(&rec.data[0], "Cmd %02d, 8mA Gpio: %02d ", cmd, context.reg[context.reg_address]);
-                enque(&rec);
-                break;
-
-            case 33:                                                                                 // Set GPIO strength = 12mA
-                gpio_set_drive_strength(context.reg[context.reg_address], GPIO_DRIVE_STRENGTH_12MA); // set Value
-                sprintf(&rec.data[0], "Cmd %02d, 12mA Gpio: %02d ", cmd, context.reg[context.reg_address]);
-                enque(&rec);
-                break;
-
-            case 41:                                            // Set pull-up
-                gpio_pull_up(context.reg[context.reg_address]); // turn ON pull-up
-                sprintf(&rec.data[0], "Cmd %02d, Pull-up Gpio: %02d,  ", cmd, context.reg[context.reg_address]);
-                enque(&rec);
-                break;
-
-            case 50:                                                  // Clear pull-up and pull-down
-                gpio_disable_pulls(context.reg[context.reg_address]); // turn ON pull-up
-                sprintf(&rec.data[0], "Cmd %02d, Clear pull-up, pull-down Gpio: %02d,  ", cmd, context.reg[context.reg_address]);
-                enque(&rec);
-                break;
-
-            case 51:                                              // Set pull-down
-                gpio_pull_down(context.reg[context.reg_address]); // turn ON pull-down
-                sprintf(&rec.data[0], "Cmd %02d, Pull-down Gpio: %02d,  ", cmd, context.reg[context.reg_address]);
-                enque(&rec);
-                break;
-
-            case 60: // Set PAD state, Nothing to do other than save on register
-                sprintf(&rec.data[0], "Cmd %02d, Pad State: %01d ", cmd, context.reg[context.reg_address]);
-                enque(&rec);
-                break;
-
-            case 61: // Set GPx to PAD state
-                maskvalue = 0xfful;
-                hw_write_masked(&pads_bank0_hw->io[context.reg[context.reg_address]], context.reg[cmd - 1], maskvalue); // Set Pad state
-                sprintf(&rec.data[0], "Cmd %02d, Set Pad State to Gpio: %02d ,State: 0x%01x ", cmd, context.reg[context.reg_address],
-                        context.reg[cmd - 1]);
-                enque(&rec);
-                break;
-
-            case 80:                                                                                       // Set PWM state
-                set_pwm_frequency(context.reg[context.reg_address], context.reg[context.reg_address + 1]); // Set PWM
-                sprintf(&rec.data[0], "Cmd %02d, PWM State: %01d ", cmd, context.reg[context.reg_address]);
-                enque(&rec);
-                break;
-
-            case 81:                                                                                       // Set PWM frequency
-                set_pwm_frequency(context.reg[context.reg_address - 1], context.reg[context.reg_address]); // Set PWM
-                sprintf(&rec.data[0], "Cmd %02d, PWM Frequency: %01d ", cmd, context.reg[context.reg_address]);
-                enque(&rec);
-                break;
-
-            case 101:                                          // Enable Uart TX/RX w/wo RTS/CTS
-                enable_uart(context.reg[context.reg_address]); // Enable uart
-                sprintf(&rec.data[0], "Cmd %d, Enable UART, handshake RTS/CTS(1): %d ", cmd, context.reg[context.reg_address]);
-                enque(&rec);
-                break;
-
-            case 102:                                           // Disable Uart and set as SIO
-                disable_uart(context.reg[context.reg_address]); // Disable uart
-                sprintf(&rec.data[0], "Cmd %d, Disable UART, Set GPIO Input(0) Output(1): %d ", cmd, context.reg[context.reg_address]);
-                enque(&rec);
-                break;
-
-            case 103:                                                            // Set uart protocol
-                set_uart_protocol(context.reg[context.reg_address], str_answer); // Set uart protocol
-                sprintf(&rec.data[0], "%s", str_answer);
-                enque(&rec);
-                break;
-
-            case 111:         // Enable SPI communication
-                enable_spi(); // Enable spi
-                sprintf(&rec.data[0], "Cmd %d, Enable SPI", cmd);
-                enque(&rec);
-                break;
-
-            case 112:                                          // Disable SPI  and set as SIO
-                disable_spi(context.reg[context.reg_address]); // Disable spi
-                sprintf(&rec.data[0], "Cmd %d, Disable SPI, Set GPIO Input(0) Output(1): %d ", cmd, context.reg[context.reg_address]);
-                enque(&rec);
-                break;
-
-            case 113:                                                           // Set SPI format
-                set_spi_protocol(context.reg[context.reg_address], str_answer); // Set spi protocol
-                sprintf(&rec.data[0], "%s", str_answer);
-                enque(&rec);
-                break;
+            if (!ctx->reg_address_written)
+            {
+                // writes always start with the memory address
+                ctx->reg_address = i2c_read_byte(i2c); // Command byte
+                ctx->reg_address_written = true;
+                ctx->prefetched = false; // a response computed at the Restart belongs to the previous command
+                if (inject.mode != 0 && inject_write(i2c, ctx->reg_address))
+                {
+                    break; // test mode, the controller is disabled and the driver finishes the transfer
+                }
+                continue;
             }
+
+            // WRITE COMMAND
+            cmd_receive(ctx, i2c_read_byte(i2c), i2c_slave_is_general_call(i2c));
         }
         break;
 
     case I2C_SLAVE_REQUEST: // master is requesting data
-                            // load from register
-        cmd = context.reg_address;
-
-        // For command requesting a Get Value, The register is updated before return the content
-        // For readback of Set value, we just return the contents of register
-
-        switch (cmd)
-        { // Command byte yo et register
-
-        case 01: // get Major Version
-            context.reg[context.reg_address] = IO_SELFTEST_VERSION_MAJOR;
-            sprintf(&rec.data[0], "Cmd %02d, MAJ Version: %02d ", cmd, context.reg[context.reg_address]);
-            enque(&rec);
-            break;
-
-        case 02: // get Minor Version
-            context.reg[context.reg_address] = IO_SELFTEST_VERSION_MINOR;
-            sprintf(&rec.data[0], "Cmd %02d, MIN Version: %02d ", cmd, context.reg[context.reg_address]);
-            enque(&rec);
-            break;
-
-        case 15:                                                 // read True value of Gpio
-            tvalue = gpio_get(context.reg[context.reg_address]); // Read true Value
-            sprintf(&rec.data[0], "Cmd %02d, read True Gpio: %02d ,State: %01d ", cmd, context.reg[context.reg_address], tvalue);
-            enque(&rec);
-            context.reg[context.reg_address] = tvalue;
-            break;
-
-        case 25:                                                     // get GPIO Direction
-            tvalue = gpio_get_dir(context.reg[context.reg_address]); // Read Direction Value
-            sprintf(&rec.data[0], "Cmd %02d, Red Dir Gpio: %02d ,State: %01d ", cmd, context.reg[context.reg_address], tvalue);
-            enque(&rec);
-            context.reg[context.reg_address] = tvalue;
-            break;
-
-        case 35:                                                                // get GPIO strength
-            svalue = gpio_get_drive_strength(context.reg[context.reg_address]); // Read strength Value
-            sprintf(&rec.data[0], "Cmd %02d, Read strength Gpio: %02d ,State: %01d ", cmd, context.reg[context.reg_address], svalue);
-            enque(&rec);
-            context.reg[context.reg_address] = svalue;
-            break;
-
-        case 45:                                                          // get pull-up
-            tvalue = gpio_is_pulled_up(context.reg[context.reg_address]); // Read true Value
-            sprintf(&rec.data[0], "Cmd %02d, read pull-up Gpio: %02d ,State: %01d ", cmd, context.reg[context.reg_address], tvalue);
-            enque(&rec);
-            context.reg[context.reg_address] = tvalue;
-            break;
-
-        case 55:                                                            // get pull-down
-            tvalue = gpio_is_pulled_down(context.reg[context.reg_address]); // Read true Value
-            sprintf(&rec.data[0], "Cmd %02d, Read pull-down Gpio: %02d ,State: %01d ", cmd, context.reg[context.reg_address], tvalue);
-            enque(&rec);
-            context.reg[context.reg_address] = tvalue;
-            break;
-
-        case 65:                                                                 // get PAD state
-            svalue = pads_bank0_hw->io[context.reg[context.reg_address]] & 0xff; // Read gpio PAD Value
-            sprintf(&rec.data[0], "Cmd %02d, Gpio: %02d ,Read PAD State: 0x%01x ", cmd, context.reg[context.reg_address], svalue);
-            enque(&rec);
-            context.reg[context.reg_address] = svalue;
-            break;
-
-        case 75:                                                          // get GPIO function
-            svalue = gpio_get_function(context.reg[context.reg_address]); // Read function
-            sprintf(&rec.data[0], "Cmd %02d, Read function Gpio: %02d , funct: 0x%02x ", cmd, context.reg[context.reg_address], svalue);
-            enque(&rec);
-            context.reg[context.reg_address] = svalue;
-            break;
-
-        case 100: // get status register, nothing to do
-            context.reg[REG_STATUS] = status.all_flags;
-            sprintf(&rec.data[0], "Cmd %02d,Status register: 0x%01x ", cmd, context.reg[REG_STATUS]);
-            enque(&rec);
-            break;
-
-        case 105:                                   // get UART protocol
-            svalue = get_uart_protocol(str_answer); // Get uart protocol
-            sprintf(&rec.data[0], "%s", str_answer);
-            enque(&rec);
-            context.reg[context.reg_address] = svalue;
-            break;
-
-        case 115:                                  // get SPI protocol
-            svalue = get_spi_protocol(str_answer); // Get spi protocol
-            sprintf(&rec.data[0], "%s", str_answer);
-            enque(&rec);
-            context.reg[context.reg_address] = svalue;
-            break;
+        cmd = cmd_read(ctx);
+        if (inject.mode == 0 || !inject_reply(i2c, ctx->reg_address, ctx->reg[cmd]))
+        {
+            i2c_write_byte(i2c, ctx->reg[cmd]);
+            perf_isr_end(&perf.i2c_req_max, start); // the master is held from the read request to this write
         }
-
-        i2c_write_byte(i2c, context.reg[context.reg_address]);
-        sprintf(&rec.data[0], "Read Cmd : %02d , Value: %02d ", cmd, context.reg[context.reg_address]);
-        enque(&rec);
-
+        cmd_read_done(ctx, cmd);
         break;
+
     case I2C_SLAVE_FINISH: // master has signalled Stop / Restart
-        context.reg_address_written = false;
-        // sprintf(&rec.data[0],"On i2c_finish");
-        // enque(&rec);
+        if (ctx->block.in_len > 0)
+        {
+            block_finish(ctx); // execute the block written in this transaction
+        }
+        ctx->reg_address_written = false;
+        ctx->reg_offset = 0; // next transaction starts again at the command byte
+        ctx->prefetched = false;
+        break;
 
+    case I2C_SLAVE_RESTART: // the command was written, compute the response before the master reads it
+        entry = &cmd_table[ctx->reg_address];
+        if ((entry->flags & CMD_PREFETCH) && entry->read != NULL)
+        {
+            entry->read(ctx, ctx->reg_address);
+            ctx->prefetched = true;
+        }
         break;
     default:
         break;
     }
+    perf_isr_end(&perf.isr_i2c_max, start);
+}
+
+#if SELFTEST_I2C0_SLAVE
+
+/**
+ * @brief Message written to the second port, called from the I2C ISR in transaction mode: the command
+ *        byte followed by the data bytes of a burst, executed like the same bytes on the main port.
+ *        The latency injection and the Restart prefetch are only done on the main port.
+ *
+ * @param i2c      i2c instance used
+ * @param address  address of the message, 0 for the general call address
+ * @param data     command byte and data bytes
+ * @param len      number of bytes
+ */
+static void __not_in_flash_func(aux_message_handler)(i2c_inst_t* i2c, uint8_t address, const uint8_t* data, size_t len)
+{
+    uint32_t start = perf_cycles();
+    cmd_context_t* ctx = &aux_context;
+
+    ctx->reg_address = data[0]; // Command byte
+    ctx->reg_offset = 0;
+    for (size_t i = 1; i < len; i++)
+    {
+        cmd_receive(ctx, data[i], address == 0);
+    }
+    if (ctx->block.in_len > 0)
+    {
+        block_finish(ctx); // execute the block written in this message
+    }
+    ctx->reg_offset = 0; // next transaction starts again at the command byte
+    perf_isr_end(&perf.isr_i2c_max, start);
+}
+
+/**
+ * @brief Count and log the response bytes of the second port read by the master, and move the burst past them.
+ *
+ * @param ctx  context of the second port
+ * @param len  response bytes read since the start of the read
+ */
+static void __not_in_flash_func(aux_response_done)(cmd_context_t* ctx, size_t len)
+{
+    while (aux_tx_done < len)
+    {
+        cmd_read_done(ctx, ctx->reg_address + ctx->reg_offset);
+        aux_tx_done++;
+    }
+}
+
+/**
+ * @brief Response of the second port, called from the I2C ISR in transaction mode when the master reads
+ *        past the bytes already handed over. The first register is computed as on the main port, the next
+ *        ones are copied while they have no read handler, so no register is computed before the master
+ *        reads it. A stream command returns one byte at a time so no byte of the stream is lost.
+ *        The bytes are counted and logged once the master has read them.
+ *
+ * @param i2c     i2c instance used
+ * @param offset  bytes already handed over and read in this read, 0 at the start of the read
+ * @param data    set to the registers returned
+ * @return size_t  number of registers returned
+ */
+static size_t __not_in_flash_func(aux_response_handler)(i2c_inst_t* i2c, size_t offset, const uint8_t** data)
+{
+    uint32_t start = perf_cycles();
+    cmd_context_t* ctx = &aux_context;
+    const cmd_entry_t* entry;
+    size_t len = 1;
+    uint8_t cmd;
+
+    if (offset == 0)
+    {
+        ctx->reg_offset = 0; // each read starts at the command byte
+        aux_tx_done = 0;
+    }
+    aux_response_done(ctx, offset);
+    cmd = cmd_read(ctx);
+    aux_tx_buf[0] = ctx->reg[cmd];
+
+    while (len < AUX_RESPONSE_MAX && cmd != 255 && !(cmd_table[cmd].flags & CMD_STREAM))
+    {
+        cmd++;
+        entry = &cmd_table[cmd];
+        if (entry->read != NULL || (entry->flags & CMD_STREAM))
+        {
+            break; // computed only when the master reads it
+        }
+        aux_tx_buf[len++] = ctx->reg[cmd];
+    }
+    *data = aux_tx_buf;
+    perf_isr_end(&perf.isr_i2c_max, start);
+    return len;
+}
+
+/**
+ * @brief End of a read of the second port, called from the I2C ISR in transaction mode.
+ *
+ * @param i2c  i2c instance used
+ * @param len  response bytes read by the master
+ */
+static void __not_in_flash_func(aux_response_end)(i2c_inst_t* i2c, size_t len)
+{
+    aux_response_done(&aux_context, len);
 }
 
+#endif
+
 /**
  * @brief function who read the 2 externals pins to define the I2C address to use.
  *        The address = 0x20 + value of 2 externals pins
@@ -449,23 +1609,50 @@ uint8_t read_i2c_address()
 /**
  * @brief Set the up slave object
  *
- * @param i2c_add Address to use to configure the I2C slave
+ * @param ctx  context of the port, ctx->i2c_add is the address to use to configure the I2C slave
+ * @param i2c  controller of the port
+ * @param sda  SDA pin
+ * @param scl  SCL pin
  */
-static void setup_i2c_slave(uint8_t i2c_add)
+static void setup_i2c_slave(cmd_context_t* ctx, i2c_inst_t* i2c, uint sda, uint scl)
 {
-    gpio_init(I2C_SLAVE_SDA_PIN);
-    gpio_set_function(I2C_SLAVE_SDA_PIN, GPIO_FUNC_I2C);
-    gpio_pull_up(I2C_SLAVE_SDA_PIN);
+    gpio_init(sda);
+    gpio_set_function(sda, GPIO_FUNC_I2C);
+    gpio_pull_up(sda);
 
-    gpio_init(I2C_SLAVE_SCL_PIN);
-    gpio_set_function(I2C_SLAVE_SCL_PIN, GPIO_FUNC_I2C);
-    gpio_pull_up(I2C_SLAVE_SCL_PIN);
+    gpio_init(scl);
+    gpio_set_function(scl, GPIO_FUNC_I2C);
+    gpio_pull_up(scl);
 
-    i2c_init(i2c1, I2C_BAUDRATE);
+    ctx->i2c = i2c;
+    ctx->baudrate = I2C_BAUDRATE;
+    i2c_init(i2c, ctx->baudrate); // sets the SDA hold time and the spike filter used in slave mode
+
+    // configure the controller for slave mode, with clock stretching while the Rx FIFO is full
+#if SELFTEST_I2C0_SLAVE
+    if (ctx == &aux_context)
+    {
+        i2c_slave_transaction_init(i2c, ctx->i2c_add, aux_rx_buf, sizeof(aux_rx_buf), &aux_message_handler, &aux_response_handler,
+                                   &aux_response_end);
+    }
+    else
+#endif
+    {
+        i2c_slave_init(i2c, ctx->i2c_add, &i2c_slave_handler);
+    }
+    i2c_slave_set_general_call(i2c, true); // broadcast configuration, see CMD_BCAST
+}
 
-    // configure I2C1 for slave mode
-    i2c_slave_init(i2c1, i2c_add, &i2c_slave_handler);
-    // i2c_slave_init(i2c0, I2C_SLAVE_ADDRESS, &i2c_slave_handler);
+/**
+ * @brief Claim the hardware alarm of the latency injection, its interrupt runs on this core with the I2C ones.
+ */
+static void setup_inject(void)
+{
+    inject.alarm = hardware_alarm_claim_unused(true);
+    inject.rng = time_us_32() | 1; // xorshift state must not be 0
+    hw_set_bits(&timer_hw->inte, 1u << inject.alarm);
+    irq_set_exclusive_handler(TIMER_IRQ_0 + inject.alarm, inject_alarm);
+    irq_set_enabled(TIMER_IRQ_0 + inject.alarm, true);
 }
 
 /// Used on in development to loopback I2C to simulate master talking to slave
@@ -586,6 +1773,30 @@ void set_pwm_frequency(bool setpwm, uint8_t sfreq)
     }
 }
 
+/**
+ * @brief Core1 loop: USB device, console, telemetry and log formatting. Core0 only services the
+ *        I2C, SPI and UART interrupts and executes the commands, a busy console does not delay them.
+ */
+static void core1_main(void)
+{
+    absolute_time_t tlm_time = make_timeout_time_ms(TLM_COUNTERS_MS); // next performance counters frame
+
+    telemetry_usb_init(); // USB interrupt is enabled on this core
+
+    while (1)
+    {
+        telemetry_task(); // service USB and send the console characters
+
+        if (time_reached(tlm_time))
+        {
+            telemetry_send_counters(); // skipped when the telemetry port is closed or full
+            tlm_time = delayed_by_ms(tlm_time, TLM_COUNTERS_MS);
+        }
+
+        log_activity += log_drain(context.i2c_add); // format and send the pending events
+    }
+}
+
 /**
  * @brief main loop to execute i2c command from master. Pico led is flashing to indicate heartbeat
  *
@@ -594,38 +1805,46 @@ void set_pwm_frequency(bool setpwm, uint8_t sfreq)
 
 int main()
 {
-    MESSAGE rec;
-    uint16_t ctr;   // counter used for flashing led
-    uint16_t pulse; // limit for flashing led frequency
+    uint32_t pulse;               // led flashing period in ms
+    uint8_t led_on = 1;           // heartbeat state of the board led
+    absolute_time_t led_time;     // next toggle of the board led
+    absolute_time_t beat_time;    // next heartbeat message
+    absolute_time_t restore_time; // end of the led activity flash
+    uint32_t activity = 0;        // last value of log_activity
+    uint32_t core1_loops = 0;     // last value of the core1 loop counter
+    bool led_flash = false;       // led is turned OFF to show console activity
 
     status.all_flags = 0;
-    pulse = 400; // slow led flashing frequency
+    pulse = LED_SLOW_MS; // slow led flashing frequency
+
+    gpio_init_mask(GPIO_BOOT_MASK); // set which lines will be GPIO
+    log_init();                     // initialise queue for serial message
+    telemetry_init();               // console stdio driver and interrupt cycle counter
+    stdio_init_all();
 
     if (watchdog_caused_reboot())
     {
         status.watch = 1;
-        pulse = 50; // fast flashing led to indicate watchdog trig
-        fprintf(stdout, "----------->   Watchdog cause reboot  <---------\n\r");
+        pulse = LED_FAST_MS; // fast flashing led to indicate watchdog trig
+        LOG_EVENT(LOG_SYS, LOG_ERROR, EV_WATCHDOG, 0, 0, 0);
     }
 
-    gpio_init_mask(GPIO_BOOT_MASK); // set which lines will be GPIO
-    init_queue();                   // initialise queue for serial message
-    stdio_init_all();
-
     // Configure watchdog with the desired timeout period
     watchdog_enable(WATCHDOG_TIMEOUT_MS, true); //
 
-    fprintf(stdout, "Selftest Version: %d.%d\n", IO_SELFTEST_VERSION_MAJOR, IO_SELFTEST_VERSION_MINOR);
-
     context.i2c_add = read_i2c_address(); // Setup I2C Address
 
-    sprintf(&rec.data[0], "Pico Selftest boot for I2C address 0x%02x", context.i2c_add);
-    enque(&rec); // Add message to the queue
+    LOG_EVENT(LOG_SYS, LOG_INFO, EV_BOOT, 0, context.i2c_add, (IO_SELFTEST_VERSION_MAJOR << 8) | IO_SELFTEST_VERSION_MINOR);
 
     gpio_set_dir_masked(GPIO_SET_DIR_MASK, GPIO_SELF_DIR_MASK);
     gpio_put_masked(GPIO_SET_DIR_MASK, GPIO_SELF_OUT_MASK);
 
-    setup_i2c_slave(context.i2c_add);
+    setup_inject();
+    setup_i2c_slave(&context, i2c1, I2C_SLAVE_SDA_PIN, I2C_SLAVE_SCL_PIN);
+#if SELFTEST_I2C0_SLAVE
+    aux_context.i2c_add = context.i2c_add + I2C_AUX_ADDRESS_OFFSET; // second port, served in parallel
+    setup_i2c_slave(&aux_context, i2c0, I2C_AUX_SDA_PIN, I2C_AUX_SCL_PIN);
+#endif
     set_default_serial(); // set default value for uart
                           // enable_uart(0);  // temporary for test interrupt
 
@@ -638,52 +1857,67 @@ int main()
 
     gpio_init(PICO_DEFAULT_LED_PIN);
     gpio_set_dir(PICO_DEFAULT_LED_PIN, GPIO_OUT); // Configure Pico led board
-    gpio_put(PICO_DEFAULT_LED_PIN, 1);            // turn ON green led on Pico
+    gpio_put(PICO_DEFAULT_LED_PIN, led_on);       // turn ON green led on Pico
 
-    ctr = 0;
-    int mess = 0;
-    uint8_t led_on = 0;
+    led_time = make_timeout_time_ms(pulse);
+    beat_time = make_timeout_time_ms(HEARTBEAT_MS);
+    restore_time = get_absolute_time();
 
-    while (1)
-    { // infinite loop, waiting for I2C command from Master
+    pin_bank_init(); // shadow starts from the boot configuration
 
-        watchdog_update();
-        sleep_ms(10);
-        ctr++;
-        mess++;
+    multicore_launch_core1(core1_main); // USB, console and telemetry run on core1
 
-        /** Flashing led */
-        if (ctr > pulse)
+    while (1)
+    { // infinite loop, waiting for I2C command from Master, nothing in this loop is blocking
+
+        if (perf.loops != core1_loops)
         {
-            led_on = !led_on;                       // Toggle the LED state
-            gpio_put(PICO_DEFAULT_LED_PIN, led_on); // Turn ON or OFF Pico board led
-            ctr = 0;                                // reset the counter
+            watchdog_update(); // both cores are running
+            core1_loops = perf.loops;
         }
+        cmd_task(); // execute the slow commands queued by the I2C interrupt
 
-        if (mess > 1500)
+        /** Flashing led */
+        if (time_reached(led_time))
         {
-            // printf("i2c add: 0x%02x\n", context.i2c_add); // for debug only
-            fprintf(stdout, "Heartbeat I2C Selftest add: 0x%02x  version: %d.%d\n", context.i2c_add, IO_SELFTEST_VERSION_MAJOR,
-                    IO_SELFTEST_VERSION_MINOR);
-            mess = 0;
-        }
+            led_on = !led_on; // Toggle the LED state
+            if (!led_flash)
+            {
+                gpio_put(PICO_DEFAULT_LED_PIN, led_on); // Turn ON or OFF Pico board led
+            }
+            led_time = delayed_by_ms(led_time, pulse);
 
 #ifdef DEBUG_CODE
-        if (ctr >= pulse)
-        {
             fprintf(stdout, "\n\n Test of command\n");
             test_spi_command();
             // test_serial_command();
-        }
 #endif
+        }
+
+        if (time_reached(beat_time))
+        {
+            LOG_EVENT(LOG_SYS, LOG_INFO, EV_HEARTBEAT, 0, context.i2c_add, (IO_SELFTEST_VERSION_MAJOR << 8) | IO_SELFTEST_VERSION_MINOR);
+            beat_time = delayed_by_ms(beat_time, HEARTBEAT_MS);
+        }
+
+        if (script_task(&script_io)) // run the script started by the master, a few opcodes at a time
+        {
+            LOG_EVENT(LOG_SYS, LOG_INFO, EV_SCRIPT_END, 0, script_pc(), script_state());
+        }
+
+        /** Events sent to the console by core1, board led is turned OFF a short time to show activity */
+        if (log_activity != activity)
+        {
+            activity = log_activity;
+            gpio_put(PICO_DEFAULT_LED_PIN, 0); // Turn OFF board led
+            restore_time = make_timeout_time_ms(LED_ACTIVITY_MS);
+            led_flash = true;
+        }
 
-        while (deque(&rec))
+        if (led_flash && time_reached(restore_time))
         {
-            gpio_put(PICO_DEFAULT_LED_PIN, 0);                                 // Turn OFF board led
-            fprintf(stdout, "Pico %02x: %s\n", context.i2c_add, &rec.data[0]); // send message to serial port
-            watchdog_update();
-            sleep_ms(50);
-            gpio_put(PICO_DEFAULT_LED_PIN, 1); // Turn ON board led
+            gpio_put(PICO_DEFAULT_LED_PIN, led_on); // Restore board led
+            led_flash = false;
         }
     }
 }
@@ -15,7 +15,9 @@
 #include "include/serial.h"
 #include "hardware/irq.h"
 #include "hardware/uart.h"
+#include "include/log_queue.h"
 #include "include/selftest.h"
+#include "include/telemetry.h"
 #include "pico/stdlib.h"
 #include <stdio.h>
 #include <string.h>
@@ -54,19 +56,18 @@ union uartc serial; ///< global variable who contains configuration
  *        to the caller
  *
  */
-void on_uart_rx()
+void __not_in_flash_func(on_uart_rx)()
 {
-    MESSAGE rec;
+    uint32_t start = perf_cycles();
 
-    sprintf(&rec.data[0], "\nSerial Interrupt Received: ");
-    enque(&rec);
+    LOG_EVENT(LOG_UART, LOG_DEBUG, EV_UART_IRQ, 0, 0, 0);
 
     while (uart_is_readable(UART_ID))
     {
         uint8_t ch = uart_getc(UART_ID);
+        perf.uart_chars++;
         // send back the data
-        sprintf(&rec.data[0], "receive: %c \n", ch);
-        enque(&rec);
+        LOG_EVENT(LOG_UART, LOG_DEBUG, EV_UART_RX, 0, 0, ch);
         for (size_t i = 0; i < 1000; i++)
         {
             ch++;
@@ -77,6 +78,7 @@ void on_uart_rx()
             uart_putc(UART_ID, ch);
         }
     }
+    perf_isr_end(&perf.isr_uart_max, start);
 }
 
 /**
@@ -198,28 +200,26 @@ void disable_uart(uint8_t mode)
 /**
  * @brief From uart protocol byte, build a debug string
  *
+ * @param config uart protocol byte to decode
  * @param protocol_string string to return to the caller
- * @param set Flag to indicate to update format or not
  */
-void uart_string_protocol(char* protocol_string, bool set)
+void uart_string_protocol(uint8_t config, char* protocol_string)
 {
-    char par;
+    char par = 'N';
     const char* ans;
+    union uartc cfg;
 
     // extract info to print on debug port
+    cfg.config = config;
 
-    uint8_t br = serial.utc.baudrate;
-    uint8_t pb = serial.utc.parity;
-    uint8_t db = serial.utc.databit + 5;
-    uint8_t sb = serial.utc.stop + 1;
-    uint8_t hk = serial.utc.handshake;
+    uint8_t br = cfg.utc.baudrate;
+    uint8_t pb = cfg.utc.parity;
+    uint8_t db = cfg.utc.databit + 5;
+    uint8_t sb = cfg.utc.stop + 1;
+    uint8_t hk = cfg.utc.handshake;
 
     uint baud_set[4] = {19200, 38400, 57600, 115200};
 
-    if (pb == 0)
-    {
-        par = 'N';
-    }
     if (pb == 1)
     {
         par = 'E';
@@ -232,32 +232,31 @@ void uart_string_protocol(char* protocol_string, bool set)
     ans = (hk ? "YES" : "NO");
 
     sprintf(protocol_string, "Config uart is [speed:parity:databit:stop:handshake] = [%d,%c,%d,%d,%s]", baud_set[br], par, db, sb, ans);
-    if (set)
-    { // if set, program the new format
-        uart_set_format(UART_ID, db, sb, pb);
-    }
 }
 
 /**
- * @brief Set the uart protocol structure with value received externally
+ * @brief Set the uart protocol structure with value received externally and program the new format
  *
  * @param cfg_uart  One byte who define thr uart protocol to use
- * @param resultstr  return a string with the protocol used on uart
  */
-void set_uart_protocol(uint8_t cfg_uart, char* resultstr)
+void set_uart_protocol(uint8_t cfg_uart)
 {
-    serial.config = cfg_uart;              // save config in structure
-    uart_string_protocol(resultstr, true); // get string of uart protocol
+    serial.config = cfg_uart; // save config in structure
+
+    uint8_t db = serial.utc.databit + 5;
+    uint8_t sb = serial.utc.stop + 1;
+    uint8_t pb = serial.utc.parity;
+
+    uart_set_format(UART_ID, db, sb, pb);
 }
 
 /**
- * @brief Get the uart protocol structure with value received externally
+ * @brief Get the uart protocol structure
  *
- * @param resultstr  return a string with the protocol used on uart
+ * @return uint8_t  uart protocol byte
  */
-uint8_t get_uart_protocol(char* resultstr)
+uint8_t __not_in_flash_func(get_uart_protocol)(void)
 {
-    uart_string_protocol(resultstr, false); // get string of uart protocol
     return serial.config;
 }
 
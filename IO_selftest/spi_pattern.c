@@ -0,0 +1,279 @@
+/**
+ * @file    spi_pattern.c
+ * @author  Daniel Lockhead
+ * @date    2024
+ *
+ * @brief   SPI test pattern generator and checker
+ *
+ * @details spi_pattern_fill() and spi_pattern_check() are called by the SPI frame end interrupt,
+ *          spi_pattern_start() by enable_spi() while the SPI interrupts are off, the counters are
+ *          latched by the I2C interrupt with the interrupts disabled.
+ *
+ *          The PRBS register holds the last n bits of the sequence, the newest in bit 0. With the
+ *          polynomial x^n + x^m + 1 each bit is the XOR of the bits n and m places before it, so up to
+ *          m bits are computed at once with two shifts.
+ *
+ * @copyright Copyright (c) 2024, D.Lockhead. All rights reserved.
+ *
+ * This software is licensed under the BSD 3-Clause License.
+ * See the LICENSE file for more details.
+ */
+
+#include "include/spi_pattern.h"
+#include "hardware/sync.h"
+#include <string.h>
+
+/**
+ * @brief PRBS polynomial x^n + x^m + 1
+ */
+typedef struct
+{
+    uint8_t n; ///< Length of the register.
+    uint8_t m; ///< Second tap, also the most bits computed at once.
+} prbs_poly_t;
+
+static const prbs_poly_t poly[SPI_PATTERN_COUNT] = {
+    [SPI_PATTERN_PRBS7] = {7, 6},
+    [SPI_PATTERN_PRBS15] = {15, 14},
+    [SPI_PATTERN_PRBS31] = {31, 28},
+};
+
+/**
+ * @brief State of the generator and of the checker
+ */
+static struct
+{
+    uint8_t selected;          ///< Pattern used at the next start.
+    uint8_t pattern;           ///< Running pattern.
+    uint8_t bits;              ///< Word size.
+    uint32_t mask;             ///< Bits of a word.
+    uint8_t n;                 ///< PRBS register length.
+    uint8_t m;                 ///< PRBS second tap.
+    uint32_t tx;               ///< Generator: PRBS register, walking bit or counter.
+    uint32_t rx;               ///< Checker: PRBS register or last received word.
+    uint8_t history;           ///< Checker: bits in the PRBS register, 1 once a walk or counter word is received.
+    spi_pattern_stats_t stats; ///< Counters of the checker.
+} gen;
+
+/**
+ * @brief Counters latched for the master and the reading position
+ */
+static struct
+{
+    union
+    {
+        spi_pattern_stats_t stats;
+        uint8_t bytes[sizeof(spi_pattern_stats_t)];
+    };
+    uint8_t pos;
+} latched;
+
+/**
+ * @brief Count the bits set, without the libgcc helper who runs from flash.
+ *
+ * @param v  value
+ * @return uint32_t  bits set in v
+ */
+static uint32_t __not_in_flash_func(popcount)(uint32_t v)
+{
+    v = v - ((v >> 1) & 0x55555555);
+    v = (v & 0x33333333) + ((v >> 2) & 0x33333333);
+    return (((v + (v >> 4)) & 0x0f0f0f0f) * 0x01010101) >> 24;
+}
+
+/**
+ * @brief Compute the next bits of the PRBS sequence.
+ *
+ * @param reg  PRBS register
+ * @param w    number of bits, 1 to m
+ * @return uint32_t  next w bits, the first one in the MSB
+ */
+static uint32_t __not_in_flash_func(prbs_next)(uint32_t reg, uint8_t w)
+{
+    return ((reg >> (gen.n - w)) ^ (reg >> (gen.m - w))) & ((1ul << w) - 1);
+}
+
+/**
+ * @brief Move the walking bit to the next position.
+ *
+ * @param word  word with one bit set
+ * @return uint32_t  word rotated left by one bit in the word size
+ */
+static uint32_t __not_in_flash_func(walk_next)(uint32_t word)
+{
+    return ((word << 1) | (word >> (gen.bits - 1))) & gen.mask;
+}
+
+/**
+ * @brief Select the pattern used at the next spi_pattern_start().
+ *
+ * @param pattern  spi_pattern_t
+ * @return true if accepted, false for an unknown pattern.
+ */
+bool __not_in_flash_func(spi_pattern_select)(uint8_t pattern)
+{
+    if (pattern >= SPI_PATTERN_COUNT)
+    {
+        return false;
+    }
+    gen.selected = pattern;
+    return true;
+}
+
+/**
+ * @brief Return the pattern used at the next start.
+ *
+ * @return uint8_t  spi_pattern_t
+ */
+uint8_t __not_in_flash_func(spi_pattern_selected)(void)
+{
+    return gen.selected;
+}
+
+/**
+ * @brief Restart the generator and the checker with the selected pattern, the counters are cleared.
+ *
+ * @param bits  word size, 4 to 32
+ * @return uint8_t  running pattern, SPI_PATTERN_ECHO if none
+ */
+uint8_t spi_pattern_start(uint8_t bits)
+{
+    gen.pattern = gen.selected;
+    gen.bits = bits;
+    gen.mask = bits == 32 ? 0xffffffff : (1ul << bits) - 1;
+    gen.n = poly[gen.pattern].n;
+    gen.m = poly[gen.pattern].m;
+    gen.tx = gen.pattern == SPI_PATTERN_WALK ? 1 : gen.pattern == SPI_PATTERN_COUNTER ? 0 : (1ul << gen.n) - 1;
+    gen.rx = 0;
+    gen.history = 0;
+    memset(&gen.stats, 0, sizeof(gen.stats));
+    return gen.pattern;
+}
+
+/**
+ * @brief Write the next words of the pattern.
+ *
+ * @param buf    receives the words
+ * @param count  number of words
+ * @param shift  left shift of each word, for the FIFO alignment
+ */
+void __not_in_flash_func(spi_pattern_fill)(uint32_t* buf, uint32_t count, uint8_t shift)
+{
+    uint32_t reg_mask = (1ul << gen.n) - 1;
+
+    for (uint32_t k = 0; k < count; k++)
+    {
+        uint32_t word = gen.tx;
+
+        switch (gen.pattern)
+        {
+        case SPI_PATTERN_WALK:
+            gen.tx = walk_next(gen.tx);
+            break;
+        case SPI_PATTERN_COUNTER:
+            gen.tx = (gen.tx + 1) & gen.mask;
+            break;
+        default:
+            word = 0;
+            for (uint8_t left = gen.bits, w; left > 0; left -= w)
+            {
+                uint32_t next;
+
+                w = left < gen.m ? left : gen.m;
+                next = prbs_next(gen.tx, w);
+                word = (word << w) | next;
+                gen.tx = ((gen.tx << w) | next) & reg_mask;
+            }
+            break;
+        }
+        buf[k] = word << shift;
+    }
+}
+
+/**
+ * @brief Check the words received in a frame and update the counters.
+ *
+ * @param buf      received words
+ * @param count    number of words
+ * @param shift    right shift of each word, for the FIFO alignment
+ * @param overrun  received words were lost after these ones, the checker synchronizes again
+ */
+void __not_in_flash_func(spi_pattern_check)(const uint32_t* buf, uint32_t count, uint8_t shift, bool overrun)
+{
+    uint32_t reg_mask = (1ul << gen.n) - 1;
+    uint32_t errors = 0;
+
+    for (uint32_t k = 0; k < count; k++)
+    {
+        uint32_t word = (buf[k] >> shift) & gen.mask;
+
+        switch (gen.pattern)
+        {
+        case SPI_PATTERN_WALK:
+            errors += gen.history ? popcount(word ^ walk_next(gen.rx)) : 0;
+            gen.rx = word;
+            gen.history = 1;
+            break;
+        case SPI_PATTERN_COUNTER:
+            errors += gen.history ? popcount(word ^ ((gen.rx + 1) & gen.mask)) : 0;
+            gen.rx = word;
+            gen.history = 1;
+            break;
+        default:
+            for (uint8_t left = gen.bits, w; left > 0; left -= w)
+            {
+                uint32_t bits;
+
+                w = left < gen.m ? left : gen.m;
+                bits = (word >> (left - w)) & ((1ul << w) - 1);
+                if (gen.history >= gen.n)
+                {
+                    errors += popcount(bits ^ prbs_next(gen.rx, w));
+                }
+                else
+                {
+                    gen.history += w;
+                }
+                gen.rx = ((gen.rx << w) | bits) & reg_mask;
+            }
+            break;
+        }
+    }
+
+    gen.stats.errors += errors;
+    gen.stats.words += count;
+    gen.stats.frames++;
+    if (overrun)
+    {
+        gen.stats.overruns++;
+        gen.history = 0;
+    }
+}
+
+/**
+ * @brief Copy the counters for the master and restart the reading at the first byte.
+ *
+ * @param clear  true to clear the counters after the copy
+ */
+void __not_in_flash_func(spi_pattern_latch)(bool clear)
+{
+    uint32_t irq = save_and_disable_interrupts();
+
+    latched.stats = gen.stats;
+    if (clear)
+    {
+        memset(&gen.stats, 0, sizeof(gen.stats));
+    }
+    restore_interrupts(irq);
+    latched.pos = 0;
+}
+
+/**
+ * @brief Return the next byte of the latched counters.
+ *
+ * @return uint8_t  Counter byte, 0 after the last one
+ */
+uint8_t __not_in_flash_func(spi_pattern_read)(void)
+{
+    return latched.pos < sizeof(latched.bytes) ? latched.bytes[latched.pos++] : 0;
+}
@@ -13,17 +13,21 @@
  */
 
 #include "include/spi_slave.h"
+#include "hardware/dma.h"
 #include "hardware/irq.h"
+#include "hardware/pio.h"
 #include "hardware/spi.h"
+#include "hardware/structs/io_bank0.h"
+#include "include/log_queue.h"
 #include "include/selftest.h"
+#include "include/spi_pattern.h"
+#include "include/telemetry.h"
+#include "spi_slave.pio.h"
 #include <pico/stdlib.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
 
-uint8_t rbytes[255];  ///< SPI register for byte data (up to 255 bytes).
-uint16_t rwords[255]; ///< SPI register for word data (up to 255 words).
-
 /**
  * @brief Structure containing the SPI configuration byte.
  *
@@ -64,204 +68,331 @@ void set_default_spi()
     spi.stc.status = DEF_SPI_STATUS;   /// Disable by default
 }
 
-// byte memory for SPI read-write
-static uint8_t in_b_buf[SPI_RW_LEN], out_b_buf[SPI_RW_LEN];
-// Word memory for SPI read-write
-static uint16_t in_w_buf[SPI_RW_LEN], out_w_buf[SPI_RW_LEN];
+/**
+ * @brief DMA ping-pong buffers. The DMA receives into rx[active] and sends tx[active] while the CPU
+ *        prepares the other pair, the CPU only touches a pair once its frame is complete.
+ *        The entries hold the words as read from or written to the FIFO of the engine.
+ */
+static struct
+{
+    uint32_t rx[2][SPI_FRAME_MAX]; ///< Frames received from the master.
+    uint32_t tx[2][SPI_FRAME_MAX]; ///< Frames returned to the master.
+    uint16_t len;                  ///< Frames per buffer of the running engine, set by enable_spi().
+    uint16_t next_len;             ///< Frames per buffer used at the next enable_spi(), set by set_spi_frame_len().
+    uint32_t mask;                 ///< Bits of a frame, set by enable_spi().
+    uint8_t rx_shift;              ///< Right shift of a received entry, LSB first PIO words are left aligned.
+    uint8_t tx_shift;              ///< Left shift of a sent entry, MSB first PIO words must be left aligned.
+    uint8_t bits;                  ///< Word size, set by enable_spi().
+    uint8_t pattern;               ///< Running spi_pattern_t, SPI_PATTERN_ECHO for the inverted replies.
+    uint8_t active;                ///< Pair used by the DMA.
+    uint rx_chan;                  ///< DMA channel emptying the RX FIFO.
+    uint tx_chan;                  ///< DMA channel filling the TX FIFO.
+} dma_buf = {.len = SPI_RW_LEN, .next_len = SPI_RW_LEN};
 
 /**
- * @brief Structure to hold two hexadecimal characters.
- *
- * This structure is used to represent a byte as two hexadecimal characters.
+ * @brief SPI slave engine, the PL022 peripheral or a PIO state machine
  */
-typedef struct
+static struct
 {
-    char hi; ///< High nibble of the byte, represented as a hexadecimal character.
-    char lo; ///< Low nibble of the byte, represented as a hexadecimal character.
-} hex2_t;
+    uint8_t config;                    ///< Engine byte (116) used at the next enable_spi().
+    uint8_t active;                    ///< Engine byte of the running engine.
+    const struct pio_program* program; ///< PIO program loaded for the SPI mode.
+    uint offset;                       ///< Address of the PIO program.
+    uint start;                        ///< Address of the frame start in the PIO program.
+    uint sm;                           ///< PIO state machine.
+} engine;
+
+static_assert(SPI_PIO_SCK_PIN == PICO_SLAVE_SPI_SCK_PIN, "spi_slave.pio SCK pin must match spi_slave.h");
+static_assert(SPI_PIO_CSN_PIN == PICO_SLAVE_SPI_CSN_PIN, "spi_slave.pio CSn pin must match spi_slave.h");
 
 /**
- * @brief Convert a byte to two hexadecimal characters.
+ * @brief Start both DMA channels on a buffer pair, RX first so no received frame is lost.
  *
+ * @param pair  buffer pair to use, 0 or 1
+ * @param skip  replies of the pair already in the TX FIFO, the TX DMA starts after them
  */
-hex2_t byte_to_hex_chars(uint8_t byte)
+static void __not_in_flash_func(spi_dma_arm)(uint8_t pair, uint32_t skip)
 {
-    const char hex_chars[] = "0123456789ABCDEF";
-    hex2_t result;
-    result.hi = hex_chars[(byte >> 4) & 0x0F]; // high nibble
-    result.lo = hex_chars[byte & 0x0F];        // low nibble
-    return result;
+    dma_buf.active = pair;
+    dma_channel_set_write_addr(dma_buf.rx_chan, dma_buf.rx[pair], false);
+    dma_channel_set_trans_count(dma_buf.rx_chan, dma_buf.len, true);
+    if (skip < dma_buf.len)
+    {
+        dma_channel_set_read_addr(dma_buf.tx_chan, &dma_buf.tx[pair][skip], false);
+        dma_channel_set_trans_count(dma_buf.tx_chan, dma_buf.len - skip, true);
+    }
 }
 
 /**
- * @brief Structure to hold four hexadecimal characters.
- *
- * This structure is used to represent a 16-bit value as four hexadecimal characters.
+ * @brief Restart the PIO program at the frame start: FIFOs and partial words are dropped, MISO is released
+ *        and the state machine waits for the next CSn falling edge.
  */
-typedef struct
+static void __not_in_flash_func(spi_pio_restart)(void)
 {
-    char h0; ///< Most significant hexadecimal character (high nibble of the high byte).
-    char h1; ///< Second most significant hexadecimal character (low nibble of the high byte).
-    char h2; ///< Third most significant hexadecimal character (high nibble of the low byte).
-    char h3; ///< Least significant hexadecimal character (low nibble of the low byte).
-} hex4_t;
+    pio_sm_set_enabled(SPI_PIO, engine.sm, false);
+    pio_sm_clear_fifos(SPI_PIO, engine.sm);
+    pio_sm_restart(SPI_PIO, engine.sm);
+    pio_sm_exec(SPI_PIO, engine.sm, pio_encode_jmp(engine.start));
+    pio_sm_set_enabled(SPI_PIO, engine.sm, true);
+}
 
 /**
- * @brief Convert a word to four hexadecimal characters.
+ * @brief Check if the RX FIFO of the running engine holds a frame.
  *
+ * @return true if a frame can be read
  */
-hex4_t word_to_hex_chars(uint16_t word)
+static bool __not_in_flash_func(spi_rx_pending)(void)
 {
-    const char hex_chars[] = "0123456789ABCDEF";
-    hex4_t result;
-    result.h0 = hex_chars[(word >> 12) & 0x0F];
-    result.h1 = hex_chars[(word >> 8) & 0x0F];
-    result.h2 = hex_chars[(word >> 4) & 0x0F];
-    result.h3 = hex_chars[word & 0x0F];
-    return result;
+    if (engine.active & SPI_ENGINE_PIO)
+    {
+        return !pio_sm_is_rx_fifo_empty(SPI_PIO, engine.sm);
+    }
+    return spi_is_readable(SPI_PORT);
 }
 
 /**
- * @brief spi slave receiver interrupt
- *
- *  Two interrupts are received by command write_read
- *  The first interrupt read the the data from source and the second interrupts
- *  write reverse data to the source
+ * @brief Check and clear the overrun flag of the running engine: RX FIFO overrun of the PL022,
+ *        state machine stalled on a full RX FIFO for the PIO.
  *
+ * @return true if received frames were lost since the last call
  */
-void spi_slave_rx_interrupt_handler()
+static bool __not_in_flash_func(spi_rx_overrun)(void)
 {
-    MESSAGE rec;
-    int x = 0; // number of character received in read portion
-    static char msg[32];
-
-    if (spi.stc.databit == 0)
-    { // if 8 bits read and write
-        // receive byte from master and echo back the reverse on next interrupt
-        while (spi_is_readable(SPI_PORT))
+    spi_hw_t* hw = spi_get_hw(SPI_PORT);
+    uint32_t stall = 1u << (PIO_FDEBUG_RXSTALL_LSB + engine.sm);
+
+    if (engine.active & SPI_ENGINE_PIO)
+    {
+        if (SPI_PIO->fdebug & stall)
         {
-            spi_write_read_blocking(SPI_PORT, &out_b_buf[x], &in_b_buf[x], 1);
-            x++;
+            SPI_PIO->fdebug = stall;
+            return true;
         }
+    }
+    else if (hw->ris & SPI_SSPRIS_RORRIS_BITS)
+    {
+        hw->icr = SPI_SSPICR_RORIC_BITS;
+        return true;
+    }
+    return false;
+}
 
-        // After data received, prepare data to transmit on next interrupt
-        for (int k = 0; k < x; k++)
+/**
+ * @brief Stop the DMA at the CS rising edge, the frame may be shorter than the buffer. The frames left in the
+ *        RX FIFO are moved to the buffer by the CPU, the ones beyond the buffer are lost. The PL022 has no TX
+ *        flush: the replies pushed but not clocked stay in the TX FIFO and are sent first in the next frame.
+ *
+ * @param lost   receives the number of frames lost
+ * @param stale  receives the number of replies left in the TX FIFO
+ * @return uint32_t  frames received in the buffer
+ */
+static uint32_t __not_in_flash_func(spi_dma_stop_frame)(uint32_t* lost, uint32_t* stale)
+{
+    spi_hw_t* hw = spi_get_hw(SPI_PORT);
+    uint32_t* rx = dma_buf.rx[dma_buf.active];
+    uint32_t count;
+    uint32_t pushed;
+    uint32_t word;
+
+    dma_channel_abort(dma_buf.rx_chan);
+    dma_channel_abort(dma_buf.tx_chan);
+    dma_hw->ints0 = 1u << dma_buf.rx_chan; // the abort can raise the completion interrupt
+    count = dma_buf.len - dma_channel_hw_addr(dma_buf.rx_chan)->transfer_count;
+    pushed = dma_buf.len - dma_channel_hw_addr(dma_buf.tx_chan)->transfer_count;
+
+    // CS is high, the master no longer clocks: at most a FIFO of frames is left
+    *lost = 0;
+    while (spi_rx_pending())
+    {
+        if (engine.active & SPI_ENGINE_PIO)
         {
-
-            // Fast way to build message to send on debug console
-            msg[0] = 'S';
-            msg[1] = 'P';
-            msg[2] = 'I';
-            msg[3] = ' ';
-            msg[4] = 'I';
-            msg[5] = 'N';
-            msg[6] = 'T';
-            msg[7] = ' ';
-
-            hex2_t hex = byte_to_hex_chars(in_b_buf[k]);
-            msg[8] = 'R';
-            msg[9] = 'd';
-            msg[10] = ':';
-            msg[11] = '0';
-            msg[12] = 'x';
-            msg[13] = hex.hi;
-            msg[14] = hex.lo;
-            msg[15] = ' ';
-
-            hex = byte_to_hex_chars(out_b_buf[k]);
-            msg[16] = 'W';
-            msg[17] = 'r';
-            msg[18] = ':';
-            msg[19] = '0';
-            msg[20] = 'x';
-            msg[21] = hex.hi;
-            msg[22] = hex.lo;
-            msg[23] = '\0';
-
-            strcpy(rec.data, msg);
-            enque(&rec);
-
-            // Too slow, causing false failure on test
-            // sprintf(&rec.data[0], "SPI Interrupt: byte Data # %d, read: 0x%x, write: 0x%x", k, in_b_buf[k], out_b_buf[k]);
-            // enque(&rec);
-
-            if (in_b_buf[k] != 0)
-            {                                // if data read is valid
-                out_b_buf[k] = ~in_b_buf[k]; // set value for read data portion
-            }
+            word = pio_sm_get(SPI_PIO, engine.sm);
         }
-    }
-    else
-    { // if 16 bits
-      // receive byte from master and echo back the reverse on next interrupt
-        while (spi_is_readable(SPI_PORT))
+        else
         {
-            spi_write16_read16_blocking(SPI_PORT, &out_w_buf[x], &in_w_buf[x], 1);
-            x++;
+            word = hw->dr;
         }
-
-        for (int k = 0; k < x; k++)
+        if (count < dma_buf.len)
         {
-            // Fast way to build message to send on debug console
-            msg[0] = 'S';
-            msg[1] = 'P';
-            msg[2] = 'I';
-            msg[3] = ' ';
-            msg[4] = 'I';
-            msg[5] = 'N';
-            msg[6] = 'T';
-            msg[7] = ' ';
-
-            hex4_t hx = word_to_hex_chars(in_w_buf[k]);
-            msg[8] = 'R';
-            msg[9] = 'd';
-            msg[10] = ':';
-            msg[11] = '0';
-            msg[12] = 'x';
-            msg[13] = hx.h0;
-            msg[14] = hx.h1;
-            msg[15] = hx.h2;
-            msg[16] = hx.h3;
-            msg[17] = ' ';
-
-            hx = word_to_hex_chars(in_w_buf[k]);
-            msg[18] = 'W';
-            msg[19] = 'r';
-            msg[20] = ':';
-            msg[21] = '0';
-            msg[22] = 'x';
-            msg[23] = hx.h0;
-            msg[24] = hx.h1;
-            msg[25] = hx.h2;
-            msg[26] = hx.h3;
-            msg[27] = '\0';
-
-            strcpy(rec.data, msg);
-            enque(&rec);
-
-            // Too slow, causing false failure on test
-            // sprintf(&rec.data[0], "SPI Interrupt: word Data # %d, read: 0x%x, write: 0x%x", k, in_w_buf[k], out_w_buf[k]);
-            // enque(&rec);
-
-            if (in_w_buf[k] != 0)
-            {                                // if data read is valid
-                out_w_buf[k] = ~in_w_buf[k]; // set reverse value to write portion
-            }
+            rx[count++] = word;
         }
+        else
+        {
+            (*lost)++; // frames beyond the buffer
+        }
+    }
+    *stale = 0;
+    if (engine.active & SPI_ENGINE_PIO)
+    {
+        spi_pio_restart();
+    }
+    else if (pushed > count + *lost)
+    {
+        *stale = pushed - count - *lost; // one reply clocked per frame received
     }
+    return count;
 }
 
 /**
- * @brief Set the up spi slave object
- *        Use interrupt to send test data to the master
+ * @brief Frame end of the pattern modes. The TX buffer of the idle pair always holds the words following the
+ *        TX buffer of the active pair, so after a full buffer the DMA restarts at once and the pattern is
+ *        generated while the next frame is moving. After a short frame (CS is high) the words not yet in the
+ *        TX FIFO are moved to the front, the pattern continues after the words left in the FIFO.
  *
+ * @param cur      pair of the completed frame
+ * @param count    frames received
+ * @param used     replies of the pair clocked or left in the TX FIFO, the pattern continues after them
+ * @param overrun  received frames were lost
  */
-void enable_spi(void)
+static void __not_in_flash_func(spi_pattern_frame)(uint8_t cur, uint32_t count, uint32_t used, bool overrun)
 {
-    MESSAGE rec;
+    uint32_t* tx = dma_buf.tx[cur];
+    uint32_t* next = dma_buf.tx[cur ^ 1];
+    uint32_t len = dma_buf.len;
+    uint32_t k;
+
+    if (used == len)
+    {
+        spi_dma_arm(cur ^ 1, 0);
+        spi_pattern_check(dma_buf.rx[cur], count, dma_buf.rx_shift, overrun);
+        spi_pattern_fill(tx, len, dma_buf.tx_shift);
+        return;
+    }
 
-    // Enable SPI 0
-    spi_init(SPI_PORT, spi.stc.baudrate * 100E3); // not required for slave SPI
+    spi_pattern_check(dma_buf.rx[cur], count, dma_buf.rx_shift, overrun);
+    for (k = 0; k < len - used; k++)
+    {
+        tx[k] = tx[k + used];
+    }
+    for (k = 0; k < used; k++)
+    {
+        tx[len - used + k] = next[k];
+    }
+    for (k = 0; k < len - used; k++)
+    {
+        next[k] = next[k + used];
+    }
+    spi_pattern_fill(&next[len - used], used, dma_buf.tx_shift);
+    spi_dma_arm(cur, 0);
+}
+
+/**
+ * @brief End of a frame, called by the CS rising edge or when the RX buffer is full.
+ *        In the echo mode the reply of the next frame is prepared from the completed buffer and the DMA
+ *        restarts on the other pair, the log is written after the restart. The pattern modes only
+ *        update the counters.
+ *
+ * @param reason  SPI_END_CS or SPI_END_FULL, logged
+ */
+static void __not_in_flash_func(spi_frame_end)(uint8_t reason)
+{
+    uint32_t start = perf_cycles();
+    uint8_t cur = dma_buf.active;
+    const uint32_t* in = dma_buf.rx[cur];
+    const uint32_t* out = dma_buf.tx[cur];
+    uint32_t* reply = dma_buf.tx[cur ^ 1];
+    uint32_t mask = dma_buf.mask;
+    uint32_t count = dma_buf.len;
+    uint32_t lost = 0;
+    uint32_t stale = 0;
+    uint8_t ev;
+
+    // after a full buffer the master may still be clocking, the next frames stay in the FIFOs
+    if (reason == SPI_END_CS)
+    {
+        count = spi_dma_stop_frame(&lost, &stale);
+    }
+    if (count == 0)
+    {
+        spi_dma_arm(cur, stale); // CS edge without frame, for example after a full buffer
+        return;
+    }
+
+    if (dma_buf.pattern != SPI_PATTERN_ECHO)
+    {
+        bool overrun = spi_rx_overrun();      // read first, clears the flag
+        uint32_t used = count + lost + stale; // replies clocked or waiting in the TX FIFO
+
+        spi_pattern_frame(cur, count, used < dma_buf.len ? used : dma_buf.len, overrun || lost != 0);
+        perf.spi_frames += count;
+        perf_isr_end(&perf.isr_spi_max, start);
+        return;
+    }
+
+    // the reply of each frame is the inverted data received at the same position, 0 keeps the previous reply
+    for (uint32_t k = 0; k < dma_buf.len; k++)
+    {
+        reply[k] = (k < count && in[k] != 0) ? (~(in[k] >> dma_buf.rx_shift) & mask) << dma_buf.tx_shift : out[k];
+    }
+    spi_dma_arm(cur ^ 1, stale); // the replies left in the TX FIFO take the first positions
+    perf.spi_frames += count;
+    perf_isr_end(&perf.isr_spi_max, start);
+
+    LOG_EVENT(LOG_SPI, LOG_DEBUG, EV_SPI_FRAME, 0, reason, count | (lost << 16));
+    ev = mask <= 0xff ? EV_SPI_RX8 : mask <= 0xffff ? EV_SPI_RX16 : EV_SPI_RX32;
+    for (uint32_t k = 0; k < count; k++)
+    {
+        uint32_t rd = in[k] >> dma_buf.rx_shift;
+        uint32_t wr = out[k] >> dma_buf.tx_shift;
+
+        LOG_EVENT(LOG_SPI, LOG_DEBUG, ev, 0, k, ev == EV_SPI_RX32 ? rd : rd | (wr << 16));
+    }
+}
+
+/**
+ * @brief DMA interrupt, the RX buffer is full: the frame ends without waiting for CS.
+ */
+static void __not_in_flash_func(spi_dma_irq_handler)(void)
+{
+    if (dma_hw->ints0 & (1u << dma_buf.rx_chan))
+    {
+        dma_hw->ints0 = 1u << dma_buf.rx_chan;
+        spi_frame_end(SPI_END_FULL);
+    }
+}
+
+/**
+ * @brief CS rising edge, the master ended the frame.
+ */
+static void __not_in_flash_func(spi_cs_irq_handler)(void)
+{
+    if (gpio_get_irq_event_mask(PICO_SLAVE_SPI_CSN_PIN) & GPIO_IRQ_EDGE_RISE)
+    {
+        // gpio_acknowledge_irq() runs from flash
+        io_bank0_hw->intr[PICO_SLAVE_SPI_CSN_PIN / 8] = GPIO_IRQ_EDGE_RISE << (4 * (PICO_SLAVE_SPI_CSN_PIN % 8));
+        spi_frame_end(SPI_END_CS);
+    }
+}
+
+/**
+ * @brief Stop the DMA, the frame interrupts and the PIO engine, release the DMA channels and the state machine.
+ */
+static void spi_engine_stop(void)
+{
+    gpio_set_irq_enabled(PICO_SLAVE_SPI_CSN_PIN, GPIO_IRQ_EDGE_RISE, false);
+    gpio_remove_raw_irq_handler(PICO_SLAVE_SPI_CSN_PIN, spi_cs_irq_handler);
+    dma_channel_set_irq0_enabled(dma_buf.rx_chan, false);
+    irq_remove_handler(DMA_IRQ_0, spi_dma_irq_handler);
+    dma_channel_abort(dma_buf.rx_chan);
+    dma_channel_abort(dma_buf.tx_chan);
+    dma_channel_unclaim(dma_buf.rx_chan);
+    dma_channel_unclaim(dma_buf.tx_chan);
+
+    if (engine.active & SPI_ENGINE_PIO)
+    {
+        pio_sm_set_enabled(SPI_PIO, engine.sm, false);
+        pio_sm_unclaim(SPI_PIO, engine.sm);
+        pio_remove_program(SPI_PIO, engine.program, engine.offset);
+        gpio_set_inover(PICO_SLAVE_SPI_SCK_PIN, GPIO_OVERRIDE_NORMAL);
+    }
+}
+
+/**
+ * @brief Start the PL022 in slave mode with the format of the protocol byte (113).
+ */
+static void spi_periph_start(void)
+{
+    spi_init(SPI_PORT, spi.stc.baudrate * 100E3); // not required for slave SPI, enables the DMA requests
     gpio_set_function(PICO_SLAVE_SPI_RX_PIN, GPIO_FUNC_SPI);
     gpio_set_function(PICO_SLAVE_SPI_SCK_PIN, GPIO_FUNC_SPI);
     gpio_set_function(PICO_SLAVE_SPI_TX_PIN, GPIO_FUNC_SPI);
@@ -270,25 +401,187 @@ void enable_spi(void)
     spi_set_slave(SPI_PORT, true);
     set_spi_com_format();
 
-    // Attach the interrupt handler
-    irq_set_exclusive_handler(SPI0_IRQ, spi_slave_rx_interrupt_handler);
+    dma_buf.bits = spi.stc.databit == 0 ? 8 : 16;
+    dma_buf.mask = spi.stc.databit == 0 ? 0xff : 0xffff;
+    dma_buf.rx_shift = 0;
+    dma_buf.tx_shift = 0;
+}
+
+/**
+ * @brief Load the PIO program of the SPI mode (113) and configure a state machine with the word size and
+ *        bit order of the engine byte (116). The state machine is started after the DMA.
+ */
+static void spi_pio_start(void)
+{
+    uint bits = (engine.active & SPI_ENGINE_BITS) + 1;
+    bool lsb = engine.active & SPI_ENGINE_LSB;
+    bool cpha = spi.stc.mode & 1;
+    pio_sm_config cfg;
+
+    engine.program = cpha ? &spi_slave_cpha1_program : &spi_slave_cpha0_program;
+    engine.offset = pio_add_program(SPI_PIO, engine.program);
+    engine.start = engine.offset + (cpha ? spi_slave_cpha1_offset_start : spi_slave_cpha0_offset_start);
+    engine.sm = pio_claim_unused_sm(SPI_PIO, true);
+
+    cfg = cpha ? spi_slave_cpha1_program_get_default_config(engine.offset) : spi_slave_cpha0_program_get_default_config(engine.offset);
+    sm_config_set_in_pins(&cfg, PICO_SLAVE_SPI_TX_PIN);     // MOSI
+    sm_config_set_out_pins(&cfg, PICO_SLAVE_SPI_RX_PIN, 1); // MISO
+    sm_config_set_set_pins(&cfg, PICO_SLAVE_SPI_RX_PIN, 1);
+    sm_config_set_in_shift(&cfg, lsb, true, bits); // shift right for LSB first, autopush
+    sm_config_set_out_shift(&cfg, lsb, true, bits);
+
+    pio_gpio_init(SPI_PIO, PICO_SLAVE_SPI_RX_PIN);
+    pio_gpio_init(SPI_PIO, PICO_SLAVE_SPI_SCK_PIN);
+    pio_gpio_init(SPI_PIO, PICO_SLAVE_SPI_TX_PIN);
+    pio_gpio_init(SPI_PIO, PICO_SLAVE_SPI_CSN_PIN);
+    gpio_set_inover(PICO_SLAVE_SPI_SCK_PIN, (spi.stc.mode & 2) ? GPIO_OVERRIDE_INVERT : GPIO_OVERRIDE_NORMAL); // CPOL = 1
+    pio_sm_set_consecutive_pindirs(SPI_PIO, engine.sm, PICO_SLAVE_SPI_RX_PIN, 1, false);
+    pio_sm_init(SPI_PIO, engine.sm, engine.start, &cfg);
+
+    dma_buf.bits = bits;
+    dma_buf.mask = bits == 32 ? 0xffffffff : (1ul << bits) - 1;
+    dma_buf.rx_shift = lsb ? 32 - bits : 0;
+    dma_buf.tx_shift = lsb ? 0 : 32 - bits;
+    LOG_EVENT(LOG_SPI, LOG_INFO, EV_SPI_FORMAT, 0, 0, spi.config);
+}
+
+/**
+ * @brief Configure a DMA channel moving the frames between a FIFO of the engine and the buffers.
+ *
+ * @param chan  DMA channel
+ * @param dreq  data request of the FIFO
+ * @param rx    true to read the RX FIFO, false to fill the TX FIFO
+ * @param fifo  FIFO register
+ */
+static void spi_dma_config(uint chan, uint dreq, bool rx, volatile void* fifo)
+{
+    dma_channel_config cfg = dma_channel_get_default_config(chan);
+
+    channel_config_set_transfer_data_size(&cfg, DMA_SIZE_32);
+    channel_config_set_read_increment(&cfg, !rx);
+    channel_config_set_write_increment(&cfg, rx);
+    channel_config_set_dreq(&cfg, dreq);
+    dma_channel_configure(chan, &cfg, rx ? (volatile void*) dma_buf.rx[0] : fifo, rx ? fifo : (volatile void*) dma_buf.tx[0],
+                          dma_buf.len, false);
+}
+
+/**
+ * @brief Set the up spi slave object
+ *        Two DMA channels move the frames, the CPU only runs at the end of each frame
+ *
+ */
+void enable_spi(void)
+{
+    bool pio = engine.config & SPI_ENGINE_PIO;
+
+    if (spi.stc.status)
+    {
+        spi_engine_stop(); // enabled again, restart with the current format and length
+    }
+
+    engine.active = engine.config;
+    dma_buf.len = dma_buf.next_len; // never changed while the DMA is armed
+    if (pio)
+    {
+        spi_pio_start();
+    }
+    else
+    {
+        spi_periph_start();
+    }
+
+    dma_buf.pattern = spi_pattern_start(dma_buf.bits);
+    if (dma_buf.pattern != SPI_PATTERN_ECHO)
+    {
+        spi_pattern_fill(dma_buf.tx[0], dma_buf.len, dma_buf.tx_shift);
+        spi_pattern_fill(dma_buf.tx[1], dma_buf.len, dma_buf.tx_shift);
+    }
+    else
+    {
+        for (int i = 0; i < SPI_FRAME_MAX; i++)
+        { // initialize write buffers with value
+            dma_buf.tx[0][i] = ((i & 0x0f) * 0x11111111ul & dma_buf.mask) << dma_buf.tx_shift;
+            dma_buf.tx[1][i] = dma_buf.tx[0][i];
+        }
+    }
+
+    dma_buf.rx_chan = dma_claim_unused_channel(true);
+    dma_buf.tx_chan = dma_claim_unused_channel(true);
+    if (pio)
+    {
+        spi_dma_config(dma_buf.rx_chan, pio_get_dreq(SPI_PIO, engine.sm, false), true, &SPI_PIO->rxf[engine.sm]);
+        spi_dma_config(dma_buf.tx_chan, pio_get_dreq(SPI_PIO, engine.sm, true), false, &SPI_PIO->txf[engine.sm]);
+    }
+    else
+    {
+        spi_dma_config(dma_buf.rx_chan, spi_get_dreq(SPI_PORT, false), true, &spi_get_hw(SPI_PORT)->dr);
+        spi_dma_config(dma_buf.tx_chan, spi_get_dreq(SPI_PORT, true), false, &spi_get_hw(SPI_PORT)->dr);
+    }
+
+    // a full RX buffer ends the frame
+    dma_channel_set_irq0_enabled(dma_buf.rx_chan, true);
+    irq_add_shared_handler(DMA_IRQ_0, spi_dma_irq_handler, PICO_SHARED_IRQ_HANDLER_DEFAULT_ORDER_PRIORITY);
+    irq_set_enabled(DMA_IRQ_0, true);
 
-    // Enable the RX FIFO interrupt   (RXIM)
-    spi0_hw->imsc = SPI_SSPIMSC_RTIM_BITS | SPI_SSPIMSC_RORIM_BITS | SPI_SSPIMSC_RXIM_BITS;
+    // the CS rising edge ends the frame. With CPHA = 0 the PL022 needs CS high between each word,
+    // so only the buffer length frames the transfer in modes 0 and 2
+    if (pio || (spi.stc.mode & 1))
+    {
+        gpio_add_raw_irq_handler(PICO_SLAVE_SPI_CSN_PIN, spi_cs_irq_handler);
+        gpio_set_irq_enabled(PICO_SLAVE_SPI_CSN_PIN, GPIO_IRQ_EDGE_RISE, true);
+        irq_set_enabled(IO_IRQ_BANK0, true);
+    }
 
-    // Enable the SPI interrupt
-    irq_set_enabled(SPI0_IRQ, 1);
+    spi_dma_arm(0, 0);
+    if (pio)
+    {
+        pio_sm_set_enabled(SPI_PIO, engine.sm, true);
+    }
 
     spi.stc.status = 1; // Set flag to indicate of spi is enabled
 
-    for (int i = 0; i < SPI_RW_LEN; i++)
-    { // initialize write buffer with value
-        out_b_buf[i] = i | (i << 4);
-        out_w_buf[i] = i | (i << 4) | (i << 8) | (i << 12);
+    LOG_EVENT(LOG_SPI, LOG_INFO, EV_SPI_ENABLE, 0, engine.active, dma_buf.len | (dma_buf.pattern << 16));
+}
+
+/**
+ * @brief Set the number of frames of each DMA buffer, used at the next enable_spi().
+ *
+ * @param len  frames per buffer, 1 to SPI_FRAME_MAX, 0 for SPI_FRAME_MAX
+ */
+void __not_in_flash_func(set_spi_frame_len)(uint8_t len)
+{
+    dma_buf.next_len = len == 0 ? SPI_FRAME_MAX : len;
+}
+
+/**
+ * @brief Select the SPI slave engine, used at the next enable_spi().
+ *
+ * @param config  engine byte (116): SPI_ENGINE_PIO, SPI_ENGINE_LSB and word size - 1, 0 for the SPI peripheral
+ * @return true if accepted, false if a bit is reserved, the word is shorter than 4 bits or the bit order
+ *         or word size is set without the PIO engine.
+ */
+bool __not_in_flash_func(set_spi_engine)(uint8_t config)
+{
+    if (config & ~(SPI_ENGINE_PIO | SPI_ENGINE_LSB | SPI_ENGINE_BITS))
+    {
+        return false;
     }
+    if ((config & SPI_ENGINE_PIO) ? (config & SPI_ENGINE_BITS) < 3 : config != 0)
+    {
+        return false;
+    }
+    engine.config = config;
+    return true;
+}
 
-    sprintf(&rec.data[0], "Selftest SPI is Enabled\r\n");
-    enque(&rec);
+/**
+ * @brief Get the engine byte used at the next enable_spi().
+ *
+ * @return uint8_t  engine byte (116)
+ */
+uint8_t __not_in_flash_func(get_spi_engine)(void)
+{
+    return engine.config;
 }
 
 /**
@@ -298,6 +591,11 @@ void enable_spi(void)
  */
 void disable_spi(uint8_t mode)
 {
+    if (spi.stc.status)
+    {
+        spi_engine_stop();
+    }
+
     // Disable.
     spi_deinit(SPI_PORT);
 
@@ -311,14 +609,8 @@ void disable_spi(uint8_t mode)
     gpio_set_dir(PICO_SLAVE_SPI_TX_PIN, mode);  // set pins as input
     gpio_set_dir(PICO_SLAVE_SPI_CSN_PIN, mode); // set pins as input
 
-    // Disable the SPI interrupt
-    irq_set_enabled(SPI0_IRQ, 0);
-
-    // Detach the interrupt handler
-    irq_remove_handler(SPI0_IRQ, spi_slave_rx_interrupt_handler);
-
     spi.stc.status = 0; // Reset flag to indicate of serial port is disabled
-    fprintf(stdout, "Selftest SPI is disabled\r\n");
+    LOG_EVENT(LOG_SPI, LOG_INFO, EV_SPI_DISABLE, 0, 0, 0);
 }
 
 /**
@@ -330,7 +622,7 @@ void set_spi_com_format()
     bool cpol, cpha, msb;
 
     uint8_t databits = (spi.stc.databit == 0 ? 8 : 16);
-    msb = SPI_MSB_FIRST; // LSB First is not supported
+    msb = SPI_MSB_FIRST; // LSB First needs the PIO engine (116)
 
     switch (spi.stc.mode)
     {
@@ -362,56 +654,75 @@ void set_spi_com_format()
 
     // set SDPI format
     spi_set_format(SPI_PORT, databits, cpol, cpha, msb);
-    fprintf(stdout, "SPI Format,  Databit = %d, Mode = %d, define: Cpol = %d, Cpha = %d, Msb = %d\r\n", databits, spi.stc.mode, cpol, cpha, msb);
+    LOG_EVENT(LOG_SPI, LOG_INFO, EV_SPI_FORMAT, 0, 0, spi.config);
 }
 
 /**
  * @brief Set the SPI protocol structure with value received externally
  *
  * @param cfg_spi   One byte who define the spi protocol to use
- * @param resultstr  return a string with the protocol used on uart
  */
-void set_spi_protocol(uint8_t cfg_spi, char* resultstr)
+void set_spi_protocol(uint8_t cfg_spi)
 {
     uint8_t status = spi.stc.status; // save actual status
     spi.config = cfg_spi;            // save config in structure, status is in read only
     spi.stc.status = status;         // replace value read before actualization
-
-    spi_string_protocol(resultstr); // get string of spi protocol
 }
 
 /**
- * @brief Get the spi protocol structure with value received externally
+ * @brief Get the spi protocol structure
  *
- * @param resultstr  return a string with the protocol used on uart
+ * @return uint8_t  spi protocol byte
  */
-uint8_t get_spi_protocol(char* resultstr)
+uint8_t __not_in_flash_func(get_spi_protocol)(void)
 {
-    spi_string_protocol(resultstr); // get string of uart protocol
     return spi.config;
 }
 
 /**
  * @brief From spi protocol byte, build a debug string
  *
+ * @param config spi protocol byte to decode
  * @param protocol_string string to return to the caller
  */
-void spi_string_protocol(char* protocol_string)
+void spi_string_protocol(uint8_t config, char* protocol_string)
 {
     const char* ans;
     uint8_t db;
+    union spi_stc cfg;
 
     // extract info to print on debug port
+    cfg.config = config;
 
-    uint8_t br = spi.stc.baudrate;
-    uint8_t md = spi.stc.mode;
+    uint8_t br = cfg.stc.baudrate;
+    uint8_t md = cfg.stc.mode;
 
-    db = (spi.stc.databit == 0 ? 8 : 16);
-    ans = (spi.stc.status == 0 ? "DIS" : "ENA");
+    db = (cfg.stc.databit == 0 ? 8 : 16);
+    ans = (cfg.stc.status == 0 ? "DIS" : "ENA");
 
     sprintf(protocol_string, "Config SPI is [speed(x 100KHz):mode:databit:status:] = [%d,%d,%d,%s]", br, md, db, ans);
 }
 
+/**
+ * @brief From spi protocol byte, build the string of the format programmed by set_spi_com_format()
+ *
+ * @param config spi protocol byte to decode
+ * @param format_string string to return to the caller
+ */
+void spi_string_format(uint8_t config, char* format_string)
+{
+    union spi_stc cfg;
+
+    cfg.config = config;
+
+    uint8_t databits = (cfg.stc.databit == 0 ? 8 : 16);
+    uint8_t cpol = cfg.stc.mode >> 1; // mode 2 and 3
+    uint8_t cpha = cfg.stc.mode & 1;  // mode 1 and 3
+
+    sprintf(format_string, "SPI Format,  Databit = %d, Mode = %d, define: Cpol = %d, Cpha = %d, Msb = %d", databits, cfg.stc.mode, cpol, cpha,
+            SPI_MSB_FIRST);
+}
+
 /**
  * @brief test command to validate the command function
  *        used only in development of firmware
@@ -0,0 +1,393 @@
+/**
+ * @file    telemetry.c
+ * @author  Daniel Lockhead
+ * @date    2024
+ *
+ * @brief   USB text console and binary telemetry port
+ *
+ * @details stdio is routed to the first CDC interface by a stdio driver, the second CDC interface
+ *          receives the binary frames built by telemetry_send(). TinyUSB belongs to core1: it is
+ *          started by telemetry_usb_init() and serviced by telemetry_task(), both called by core1.
+ *          stdio can be used by both cores, the characters go through a fifo emptied by core1.
+ *
+ * @copyright Copyright (c) 2024, D.Lockhead. All rights reserved.
+ *
+ * This software is licensed under the BSD 3-Clause License.
+ * See the LICENSE file for more details.
+ */
+
+#include "include/telemetry.h"
+#include "include/log_queue.h"
+#include "device/usbd_pvt.h"
+#include "hardware/regs/m0plus.h"
+#include "hardware/sync.h"
+#include "hardware/watchdog.h"
+#include "pico/bootrom.h"
+#include "pico/stdio/driver.h"
+#include "pico/stdlib.h"
+#include "pico/usb_reset_interface.h"
+#include "tusb.h"
+
+#define TEXT_TIMEOUT_US 500000   ///< Longest wait for space in the console buffer before characters are dropped.
+#define RESET_BAUDRATE 1200      ///< Console baudrate requesting a reboot in BOOTSEL mode, as done by pico_stdio_usb.
+#define TEXT_FIFO_SIZE 1024      ///< Console characters waiting for core1, must be a power of two.
+#define RESET_FLASH_DELAY_MS 100 ///< Delay of the reboot to flash requested on the reset interface, as pico_stdio_usb.
+
+static_assert((TEXT_FIFO_SIZE & (TEXT_FIFO_SIZE - 1)) == 0, "TEXT_FIFO_SIZE must be a power of two");
+
+volatile perf_counters_t perf; ///< Performance counters sent on the telemetry port
+
+/**
+ * @brief Console characters written by stdio and sent to USB by core1. The stdio mutex allows only
+ *        one writer at a time, so the fifo has a single producer and a single consumer.
+ */
+static struct
+{
+    char buf[TEXT_FIFO_SIZE]; ///< Characters storage.
+    volatile uint32_t head;   ///< Characters written by stdio, free running.
+    volatile uint32_t tail;   ///< Characters sent to USB by core1, free running.
+} text_fifo;
+
+/**
+ * @brief Move the characters of the fifo to the console CDC buffer. Core1 only.
+ *        Without host the characters are discarded, as pico_stdio_usb does.
+ */
+static void text_fifo_flush(void)
+{
+    uint32_t head = text_fifo.head;
+    uint32_t tail = text_fifo.tail;
+    uint32_t len;
+    uint32_t n;
+
+    __dmb(); // head must be read before the characters
+    if (!tud_cdc_n_connected(CDC_ITF_TEXT))
+    {
+        text_fifo.tail = head;
+        return;
+    }
+
+    while (tail != head)
+    {
+        len = head - tail;
+        if (len > TEXT_FIFO_SIZE - (tail & (TEXT_FIFO_SIZE - 1)))
+        {
+            len = TEXT_FIFO_SIZE - (tail & (TEXT_FIFO_SIZE - 1)); // up to the end of the buffer
+        }
+        n = tud_cdc_n_write(CDC_ITF_TEXT, &text_fifo.buf[tail & (TEXT_FIFO_SIZE - 1)], len);
+        if (n == 0)
+        {
+            break; // CDC buffer is full, next call
+        }
+        tail += n;
+        perf.text_bytes += n;
+    }
+    __dmb(); // characters must be consumed before the new tail
+    text_fifo.tail = tail;
+    tud_cdc_n_write_flush(CDC_ITF_TEXT);
+}
+
+/**
+ * @brief Send characters to the text console, called by stdio on either core.
+ *        The characters are only copied to the fifo, core1 sends them to USB.
+ *
+ * @param buf     characters to send
+ * @param length  number of characters
+ */
+static void text_out_chars(const char* buf, int length)
+{
+    absolute_time_t timeout = make_timeout_time_us(TEXT_TIMEOUT_US);
+    uint32_t head = text_fifo.head;
+    int sent = 0;
+
+    while (sent < length)
+    {
+        if (head - text_fifo.tail < TEXT_FIFO_SIZE)
+        {
+            text_fifo.buf[head & (TEXT_FIFO_SIZE - 1)] = buf[sent++];
+            head++;
+            timeout = make_timeout_time_us(TEXT_TIMEOUT_US);
+            continue;
+        }
+
+        __dmb(); // publish the characters already copied
+        text_fifo.head = head;
+        if (get_core_num() == 1)
+        {
+            tud_task(); // fifo is full and core1 is the caller, let the host read it
+            text_fifo_flush();
+        }
+        if (time_reached(timeout))
+        {
+            break; // host does not read the console
+        }
+    }
+    __dmb(); // characters must be visible before the new head
+    text_fifo.head = head;
+}
+
+/**
+ * @brief Read characters from the text console, called by stdio. Only core1 reads USB,
+ *        the other core gets no character.
+ *
+ * @param buf     buffer receiving the characters
+ * @param length  size of the buffer
+ * @return int    number of characters read, PICO_ERROR_NO_DATA if none
+ */
+static int text_in_chars(char* buf, int length)
+{
+    uint32_t n = 0;
+
+    if (get_core_num() == 1 && tud_cdc_n_available(CDC_ITF_TEXT))
+    {
+        n = tud_cdc_n_read(CDC_ITF_TEXT, buf, length);
+    }
+    return n > 0 ? (int) n : PICO_ERROR_NO_DATA;
+}
+
+/**
+ * @brief stdio driver of the text console
+ */
+static stdio_driver_t text_driver = {
+    .out_chars = text_out_chars,
+    .in_chars = text_in_chars,
+    .crlf_enabled = PICO_STDIO_DEFAULT_CRLF,
+};
+
+/**
+ * @brief Reboot in BOOTSEL mode when the host opens the console at 1200 baud, so the firmware
+ *        can still be loaded without pressing the button. Called by TinyUSB.
+ *
+ * @param itf          CDC interface
+ * @param line_coding  new line coding requested by the host
+ */
+void tud_cdc_line_coding_cb(uint8_t itf, cdc_line_coding_t const* line_coding)
+{
+    if (itf == CDC_ITF_TEXT && line_coding->bit_rate == RESET_BAUDRATE)
+    {
+        reset_usb_boot(0, 0);
+    }
+}
+
+static uint8_t reset_itf_num; ///< Number of the reset interface, set when the host configures the device.
+
+/**
+ * @brief Accept the reset interface of pico_stdio_usb, used by picotool to reboot the board.
+ *
+ * @param rhport    USB port
+ * @param itf_desc  interface descriptor
+ * @param max_len   length of the descriptors left in the configuration
+ * @return uint16_t  length used, 0 if the interface is not the reset interface
+ */
+static uint16_t reset_open(uint8_t rhport, tusb_desc_interface_t const* itf_desc, uint16_t max_len)
+{
+    (void) rhport;
+    TU_VERIFY(itf_desc->bInterfaceClass == TUSB_CLASS_VENDOR_SPECIFIC && itf_desc->bInterfaceSubClass == RESET_INTERFACE_SUBCLASS &&
+                  itf_desc->bInterfaceProtocol == RESET_INTERFACE_PROTOCOL,
+              0);
+    TU_VERIFY(max_len >= sizeof(tusb_desc_interface_t), 0);
+    reset_itf_num = itf_desc->bInterfaceNumber;
+    return sizeof(tusb_desc_interface_t);
+}
+
+/**
+ * @brief Reboot requests of the reset interface, in BOOTSEL mode or to flash, as pico_stdio_usb.
+ *
+ * @param rhport   USB port
+ * @param stage    control transfer stage, the request is handled at the setup
+ * @param request  control request
+ * @return true if the request is accepted
+ */
+static bool reset_control_xfer_cb(uint8_t rhport, uint8_t stage, tusb_control_request_t const* request)
+{
+    uint32_t gpio_mask = 0;
+
+    (void) rhport;
+    if (stage != CONTROL_STAGE_SETUP)
+    {
+        return true;
+    }
+    if (request->wIndex != reset_itf_num)
+    {
+        return false;
+    }
+    if (request->bRequest == RESET_REQUEST_BOOTSEL)
+    {
+        if (request->wValue & 0x100)
+        {
+            gpio_mask = 1u << (request->wValue >> 9); // activity LED requested by the host
+        }
+        reset_usb_boot(gpio_mask, request->wValue & 0x7f); // does not return
+    }
+    if (request->bRequest == RESET_REQUEST_FLASH)
+    {
+        watchdog_reboot(0, 0, RESET_FLASH_DELAY_MS);
+        return true;
+    }
+    return false;
+}
+
+/// Nothing to start, the reset interface has no endpoint.
+static void reset_init(void)
+{
+}
+
+/// Bus reset, the interface number is set again by reset_open().
+static void reset_reset(uint8_t rhport)
+{
+    (void) rhport;
+    reset_itf_num = 0;
+}
+
+/// No endpoint, never called.
+static bool reset_xfer_cb(uint8_t rhport, uint8_t ep_addr, xfer_result_t result, uint32_t xferred_bytes)
+{
+    (void) rhport;
+    (void) ep_addr;
+    (void) result;
+    (void) xferred_bytes;
+    return true;
+}
+
+/**
+ * @brief Reset interface driver, the interface has no endpoint.
+ */
+static const usbd_class_driver_t reset_driver = {
+    .init = reset_init,
+    .reset = reset_reset,
+    .open = reset_open,
+    .control_xfer_cb = reset_control_xfer_cb,
+    .xfer_cb = reset_xfer_cb,
+    .sof = NULL,
+};
+
+/**
+ * @brief Register the reset interface driver next to the CDC driver. Called by TinyUSB.
+ *
+ * @param driver_count  receives the number of drivers
+ */
+usbd_class_driver_t const* usbd_app_driver_get_cb(uint8_t* driver_count)
+{
+    *driver_count = 1;
+    return &reset_driver;
+}
+
+/**
+ * @brief Route stdio to the text console and start the cycle counter used to time the interrupts.
+ *        Called by core0, SysTick is private to each core.
+ */
+void telemetry_init(void)
+{
+    systick_hw->rvr = PERF_SYSTICK_MASK;
+    systick_hw->cvr = 0;
+    systick_hw->csr = M0PLUS_SYST_CSR_CLKSOURCE_BITS | M0PLUS_SYST_CSR_ENABLE_BITS; // CPU clock, no interrupt
+
+    stdio_set_driver_enabled(&text_driver, true);
+}
+
+/**
+ * @brief Start the USB device. Called by core1, so the USB interrupt is serviced by core1.
+ */
+void telemetry_usb_init(void)
+{
+    tusb_init();
+}
+
+/**
+ * @brief Service the USB device and send the console characters, called at each iteration
+ *        of the core1 loop.
+ */
+void telemetry_task(void)
+{
+    tud_task();
+    text_fifo_flush();
+    perf.loops++;
+}
+
+/**
+ * @brief Return the number of console characters who can be written now without blocking.
+ *
+ * @return size_t  Free space in the console fifo
+ */
+size_t telemetry_text_room(void)
+{
+    return TEXT_FIFO_SIZE - (text_fifo.head - text_fifo.tail);
+}
+
+/**
+ * @brief Check if a host has opened the telemetry port.
+ *
+ * @return true if frames can be sent
+ */
+bool telemetry_connected(void)
+{
+    return tud_cdc_n_connected(CDC_ITF_TLM);
+}
+
+/**
+ * @brief Return the largest payload who can be sent now without blocking.
+ *
+ * @return size_t  Payload size in bytes, 0 if the port is closed or full
+ */
+size_t telemetry_room(void)
+{
+    uint32_t room;
+
+    if (!tud_cdc_n_connected(CDC_ITF_TLM))
+    {
+        return 0;
+    }
+
+    room = tud_cdc_n_write_available(CDC_ITF_TLM);
+    if (room <= TLM_FRAME_OVERHEAD)
+    {
+        return 0;
+    }
+    room -= TLM_FRAME_OVERHEAD;
+    return room > TLM_PAYLOAD_MAX ? TLM_PAYLOAD_MAX : room;
+}
+
+/**
+ * @brief Send one frame on the telemetry port. The frame is sent completely or not at all.
+ *
+ * @param type     frame type (tlm_type_t)
+ * @param payload  frame content
+ * @param len      payload size in bytes, at most telemetry_room()
+ * @return true if the frame was queued, false if the port is closed or has not enough space.
+ */
+bool telemetry_send(uint8_t type, const void* payload, uint16_t len)
+{
+    const uint8_t* data = payload;
+    uint8_t header[TLM_HEADER_SIZE] = {TLM_SYNC, type, len & 0xff, len >> 8};
+    uint8_t sum = header[1] ^ header[2] ^ header[3];
+
+    if (len > telemetry_room())
+    {
+        return false;
+    }
+
+    for (uint16_t i = 0; i < len; i++)
+    {
+        sum ^= data[i];
+    }
+
+    tud_cdc_n_write(CDC_ITF_TLM, header, sizeof(header));
+    tud_cdc_n_write(CDC_ITF_TLM, data, len);
+    tud_cdc_n_write(CDC_ITF_TLM, &sum, 1);
+    tud_cdc_n_write_flush(CDC_ITF_TLM);
+    perf.tlm_bytes += len + TLM_FRAME_OVERHEAD;
+    return true;
+}
+
+/**
+ * @brief Send a snapshot of the performance counters.
+ *
+ * @return true if the frame was queued, false if the port is closed or full.
+ */
+bool telemetry_send_counters(void)
+{
+    perf_counters_t snap = perf;
+
+    snap.uptime_us = time_us_32();
+    snap.drops = log_dropped();
+    return telemetry_send(TLM_COUNTERS, &snap, sizeof(snap));
+}
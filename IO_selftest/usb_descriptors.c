@@ -0,0 +1,173 @@
+/**
+ * @file    usb_descriptors.c
+ * @author  Daniel Lockhead
+ * @date    2024
+ *
+ * @brief   USB descriptors of the composite device: text console, reset interface and binary telemetry
+ *
+ * @details The first interfaces are the ones of pico_stdio_usb, at the same numbers: the console CDC
+ *          and the reset interface used by picotool. The telemetry CDC follows them, so a host who
+ *          knows the product id of the SDK still finds the interfaces it expects.
+ *
+ * @copyright Copyright (c) 2024, D.Lockhead. All rights reserved.
+ *
+ * This software is licensed under the BSD 3-Clause License.
+ * See the LICENSE file for more details.
+ */
+
+#include "include/telemetry.h"
+#include "pico/unique_id.h"
+#include "pico/usb_reset_interface.h"
+#include "tusb.h"
+
+#define USBD_VID 0x2E8A    ///< Raspberry Pi vendor id.
+#define USBD_PID 0x000A    ///< Product id of pico_stdio_usb, its console and reset interfaces come first.
+#define USBD_BCD 0x0200    ///< Device release, differs from the single CDC stdio_usb device.
+#define USBD_MAX_POWER 250 ///< Current drawn from the host, in mA.
+#define USBD_STR_MAX 32    ///< Longest string descriptor, in characters.
+
+#define EPNUM_CDC_TEXT_NOTIF 0x81 ///< Notification endpoint of the text console.
+#define EPNUM_CDC_TEXT_OUT 0x02   ///< Data OUT endpoint of the text console.
+#define EPNUM_CDC_TEXT_IN 0x82    ///< Data IN endpoint of the text console.
+#define EPNUM_CDC_TLM_NOTIF 0x83  ///< Notification endpoint of the telemetry port.
+#define EPNUM_CDC_TLM_OUT 0x04    ///< Data OUT endpoint of the telemetry port.
+#define EPNUM_CDC_TLM_IN 0x84     ///< Data IN endpoint of the telemetry port.
+
+#define USBD_RESET_DESC_LEN 9 ///< Size of the reset interface descriptor.
+
+/// Reset interface of pico_stdio_usb, a vendor interface without endpoint.
+#define USBD_RESET_DESCRIPTOR(_itfnum, _stridx)                                                                                                      \
+    USBD_RESET_DESC_LEN, TUSB_DESC_INTERFACE, _itfnum, 0, 0, TUSB_CLASS_VENDOR_SPECIFIC, RESET_INTERFACE_SUBCLASS, RESET_INTERFACE_PROTOCOL, _stridx
+
+#define USBD_DESC_LEN (TUD_CONFIG_DESC_LEN + CFG_TUD_CDC * TUD_CDC_DESC_LEN + USBD_RESET_DESC_LEN) ///< Size of the configuration descriptor.
+
+/**
+ * @brief Interface numbers, each CDC uses a control and a data interface. The console and the reset
+ *        interface keep the numbers of pico_stdio_usb.
+ */
+enum
+{
+    ITF_NUM_CDC_TEXT,
+    ITF_NUM_CDC_TEXT_DATA,
+    ITF_NUM_RESET,
+    ITF_NUM_CDC_TLM,
+    ITF_NUM_CDC_TLM_DATA,
+    ITF_NUM_TOTAL
+};
+
+/**
+ * @brief String descriptor indexes
+ */
+enum
+{
+    USBD_STR_LANGUAGE,
+    USBD_STR_MANUFACTURER,
+    USBD_STR_PRODUCT,
+    USBD_STR_SERIAL,
+    USBD_STR_CDC_TEXT,
+    USBD_STR_RESET,
+    USBD_STR_CDC_TLM,
+    USBD_STR_COUNT
+};
+
+static const tusb_desc_device_t desc_device = {
+    .bLength = sizeof(tusb_desc_device_t),
+    .bDescriptorType = TUSB_DESC_DEVICE,
+    .bcdUSB = 0x0200,
+    .bDeviceClass = TUSB_CLASS_MISC, // interface association for the 2 CDC
+    .bDeviceSubClass = MISC_SUBCLASS_COMMON,
+    .bDeviceProtocol = MISC_PROTOCOL_IAD,
+    .bMaxPacketSize0 = CFG_TUD_ENDPOINT0_SIZE,
+    .idVendor = USBD_VID,
+    .idProduct = USBD_PID,
+    .bcdDevice = USBD_BCD,
+    .iManufacturer = USBD_STR_MANUFACTURER,
+    .iProduct = USBD_STR_PRODUCT,
+    .iSerialNumber = USBD_STR_SERIAL,
+    .bNumConfigurations = 1,
+};
+
+static const uint8_t desc_config[USBD_DESC_LEN] = {
+    TUD_CONFIG_DESCRIPTOR(1, ITF_NUM_TOTAL, 0, USBD_DESC_LEN, 0, USBD_MAX_POWER),
+    TUD_CDC_DESCRIPTOR(ITF_NUM_CDC_TEXT, USBD_STR_CDC_TEXT, EPNUM_CDC_TEXT_NOTIF, 8, EPNUM_CDC_TEXT_OUT, EPNUM_CDC_TEXT_IN, CFG_TUD_CDC_EP_BUFSIZE),
+    USBD_RESET_DESCRIPTOR(ITF_NUM_RESET, USBD_STR_RESET),
+    TUD_CDC_DESCRIPTOR(ITF_NUM_CDC_TLM, USBD_STR_CDC_TLM, EPNUM_CDC_TLM_NOTIF, 8, EPNUM_CDC_TLM_OUT, EPNUM_CDC_TLM_IN, CFG_TUD_CDC_EP_BUFSIZE),
+};
+
+static const char* const desc_string[USBD_STR_COUNT] = {
+    [USBD_STR_MANUFACTURER] = "FirstTestStation",
+    [USBD_STR_PRODUCT] = "Selftest Board",
+    [USBD_STR_CDC_TEXT] = "Selftest Console",
+    [USBD_STR_RESET] = "Reset",
+    [USBD_STR_CDC_TLM] = "Selftest Telemetry",
+};
+
+/**
+ * @brief Return the device descriptor. Called by TinyUSB.
+ */
+const uint8_t* tud_descriptor_device_cb(void)
+{
+    return (const uint8_t*) &desc_device;
+}
+
+/**
+ * @brief Return the configuration descriptor. Called by TinyUSB.
+ *
+ * @param index  configuration index, only one configuration exists
+ */
+const uint8_t* tud_descriptor_configuration_cb(uint8_t index)
+{
+    (void) index;
+    return desc_config;
+}
+
+/**
+ * @brief Return a string descriptor in UTF-16. Called by TinyUSB.
+ *
+ * @param index   string index
+ * @param langid  language requested, only English is provided
+ * @return const uint16_t*  descriptor, NULL if the index is unknown
+ */
+const uint16_t* tud_descriptor_string_cb(uint8_t index, uint16_t langid)
+{
+    static uint16_t desc_str[USBD_STR_MAX + 1];
+    static char serial[2 * PICO_UNIQUE_BOARD_ID_SIZE_BYTES + 1];
+    const char* str;
+    uint8_t len;
+
+    (void) langid;
+
+    if (index == USBD_STR_LANGUAGE)
+    {
+        desc_str[1] = 0x0409; // English
+        len = 1;
+    }
+    else
+    {
+        if (index >= USBD_STR_COUNT)
+        {
+            return NULL;
+        }
+
+        if (index == USBD_STR_SERIAL)
+        {
+            if (serial[0] == 0)
+            {
+                pico_get_unique_board_id_string(serial, sizeof(serial)); // same serial as pico_stdio_usb
+            }
+            str = serial;
+        }
+        else
+        {
+            str = desc_string[index];
+        }
+
+        for (len = 0; len < USBD_STR_MAX && str[len] != 0; len++)
+        {
+            desc_str[1 + len] = str[len];
+        }
+    }
+
+    desc_str[0] = (TUSB_DESC_STRING << 8) | (2 * len + 2);
+    return desc_str;
+}
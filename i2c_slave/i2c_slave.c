@@ -7,14 +7,31 @@
 #include <hardware/irq.h>
 #include <i2c_slave.h>
 
+#define I2C_FIFO_DEPTH 16 ///< Entries of the Rx and Tx FIFO.
+#define I2C_RX_LEVEL 12   ///< Transaction mode: Rx FIFO entries raising the interrupt, leaves room before clock stretching.
+#define I2C_TX_LEVEL 4    ///< Transaction mode: Tx FIFO entries at or below which the FIFO is refilled.
+
 /**
  * @brief I2C slave device structure.
  */
 typedef struct i2c_slave_t
 {
-    i2c_inst_t* i2c;             /**< I2C instance. */
-    i2c_slave_handler_t handler; /**< I2C slave event handler. */
-    bool transfer_in_progress;   /**< Transfer status flag. */
+    i2c_inst_t* i2c;                           /**< I2C instance. */
+    i2c_slave_handler_t handler;               /**< I2C slave event handler, event mode. */
+    bool transfer_in_progress;                 /**< Transfer status flag. */
+    bool general_call;                         /**< Current transfer was sent to the general call address. */
+    bool dropped;                              /**< Controller disabled by i2c_slave_drop() until i2c_slave_resume(). */
+    uint32_t intr_mask;                        /**< Interrupt mask restored by i2c_slave_resume(). */
+    i2c_slave_rx_handler_t rx_handler;         /**< Message handler, transaction mode. */
+    i2c_slave_tx_handler_t tx_handler;         /**< Response handler, transaction mode. */
+    i2c_slave_tx_end_handler_t tx_end_handler; /**< End of read handler, transaction mode. */
+    uint8_t* rx_buf;                           /**< Message buffer. */
+    size_t rx_size;                            /**< Size of the message buffer. */
+    size_t rx_len;                             /**< Bytes of the current message. */
+    const uint8_t* tx_buf;                     /**< Response buffer. */
+    size_t tx_len;                             /**< Response length. */
+    size_t tx_pos;                             /**< Next response byte to push in the Tx FIFO. */
+    size_t tx_total;                           /**< Response bytes pushed in the Tx FIFO since the start of the read. */
 } i2c_slave_t;
 
 static i2c_slave_t i2c_slaves[2];
@@ -25,9 +42,18 @@ static inline void finish_transfer(i2c_slave_t* slave)
     {
         slave->handler(slave->i2c, I2C_SLAVE_FINISH);
         slave->transfer_in_progress = false;
+        slave->general_call = false;
     }
 }
 
+// The Stop of a transfer dropped by i2c_slave_drop() is never detected: the transfer ends here, the
+// events pending from it are discarded.
+static inline void drop_transfer(i2c_slave_t* slave, i2c_hw_t* hw)
+{
+    hw->clr_intr;
+    finish_transfer(slave);
+}
+
 static void __not_in_flash_func(i2c_slave_irq_handler)(i2c_slave_t* slave)
 {
     i2c_inst_t* i2c = slave->i2c;
@@ -43,58 +69,218 @@ static void __not_in_flash_func(i2c_slave_irq_handler)(i2c_slave_t* slave)
         hw->clr_tx_abrt;
         finish_transfer(slave);
     }
-    if (intr_stat & I2C_IC_INTR_STAT_R_START_DET_BITS)
+    // When the interrupt is serviced late, the Rx FIFO can still hold the last bytes of the transfer
+    // who ended with the pending Stop or Restart: they are delivered first. A Start pending without
+    // transfer in progress begins the transfer of these bytes, it is cleared before.
+    if ((intr_stat & I2C_IC_INTR_STAT_R_START_DET_BITS) && !slave->transfer_in_progress)
     {
         hw->clr_start_det;
-        finish_transfer(slave);
+        intr_stat &= ~I2C_IC_INTR_STAT_R_START_DET_BITS;
     }
+    if (intr_stat & I2C_IC_INTR_STAT_R_RX_FULL_BITS)
+    {
+        if (!slave->transfer_in_progress)
+        {
+            // latched once per transfer, set when the general call address was acknowledged, before the first byte
+            slave->general_call = (hw->raw_intr_stat & I2C_IC_RAW_INTR_STAT_GEN_CALL_BITS) != 0;
+            if (slave->general_call)
+            {
+                hw->clr_gen_call;
+            }
+        }
+        slave->transfer_in_progress = true;
+        slave->handler(i2c, I2C_SLAVE_RECEIVE);
+        if (slave->dropped)
+        {
+            drop_transfer(slave, hw);
+            return;
+        }
+    }
+    // a Stop and a Start pending together: the Stop ends the previous transfer, the Start begins the next one
     if (intr_stat & I2C_IC_INTR_STAT_R_STOP_DET_BITS)
     {
         hw->clr_stop_det;
         finish_transfer(slave);
     }
-    if (intr_stat & I2C_IC_INTR_STAT_R_RX_FULL_BITS)
+    if (intr_stat & I2C_IC_INTR_STAT_R_START_DET_BITS)
     {
-        slave->transfer_in_progress = true;
-        slave->handler(i2c, I2C_SLAVE_RECEIVE);
+        hw->clr_start_det;
+        bool restart = slave->transfer_in_progress; // no Stop since the last transfer
+        finish_transfer(slave);
+        if (restart)
+        {
+            slave->handler(i2c, I2C_SLAVE_RESTART);
+        }
     }
     if (intr_stat & I2C_IC_INTR_STAT_R_RD_REQ_BITS)
     {
         hw->clr_rd_req;
         slave->transfer_in_progress = true;
         slave->handler(i2c, I2C_SLAVE_REQUEST);
+        if (slave->dropped)
+        {
+            drop_transfer(slave, hw);
+        }
+    }
+}
+
+static void __not_in_flash_func(transaction_deliver)(i2c_slave_t* slave, i2c_hw_t* hw)
+{
+    if (slave->rx_len > 0)
+    {
+        slave->rx_handler(slave->i2c, slave->general_call ? 0 : (uint8_t) hw->sar, slave->rx_buf, slave->rx_len);
+        slave->rx_len = 0;
+    }
+}
+
+static void __not_in_flash_func(transaction_drain)(i2c_slave_t* slave, i2c_hw_t* hw)
+{
+    uint32_t value;
+
+    while (hw->rxflr > 0)
+    {
+        value = hw->data_cmd;
+        if (value & I2C_IC_DATA_CMD_FIRST_DATA_BYTE_BITS)
+        {
+            transaction_deliver(slave, hw); // first byte of a transfer, the previous message is complete
+            slave->general_call = (hw->raw_intr_stat & I2C_IC_RAW_INTR_STAT_GEN_CALL_BITS) != 0;
+            if (slave->general_call)
+            {
+                hw->clr_gen_call;
+            }
+        }
+        if (slave->rx_len < slave->rx_size)
+        {
+            slave->rx_buf[slave->rx_len++] = (uint8_t) value;
+        }
+    }
+}
+
+static void __not_in_flash_func(transaction_fill)(i2c_slave_t* slave, i2c_hw_t* hw)
+{
+    while (slave->tx_pos < slave->tx_len && hw->txflr < I2C_FIFO_DEPTH)
+    {
+        hw->data_cmd = slave->tx_buf[slave->tx_pos++];
+        slave->tx_total++;
+    }
+    if (slave->tx_pos < slave->tx_len)
+    {
+        hw_set_bits(&hw->intr_mask, I2C_IC_INTR_MASK_M_TX_EMPTY_BITS); // refill when the FIFO runs low
+    }
+    else
+    {
+        hw_clear_bits(&hw->intr_mask, I2C_IC_INTR_MASK_M_TX_EMPTY_BITS);
+    }
+}
+
+// unsent: response bytes fed but not read by the master, left in the Tx FIFO or flushed from it
+static inline void transaction_end_read(i2c_slave_t* slave, i2c_hw_t* hw, uint32_t unsent)
+{
+    if (slave->tx_total > 0)
+    {
+        slave->tx_end_handler(slave->i2c, unsent < slave->tx_total ? slave->tx_total - unsent : 0);
+    }
+    slave->tx_len = 0; // the part of the response not read is discarded
+    slave->tx_pos = 0;
+    slave->tx_total = 0;
+    hw_clear_bits(&hw->intr_mask, I2C_IC_INTR_MASK_M_TX_EMPTY_BITS);
+}
+
+static void __not_in_flash_func(i2c_slave_transaction_irq)(i2c_slave_t* slave)
+{
+    i2c_hw_t* hw = i2c_get_hw(slave->i2c);
+
+    uint32_t intr_stat = hw->intr_stat;
+    if (intr_stat == 0)
+    {
+        return;
+    }
+    if (intr_stat & I2C_IC_INTR_STAT_R_TX_ABRT_BITS)
+    {
+        // a new read found bytes left from the previous one, the FIFO was flushed
+        uint32_t flushed = (hw->tx_abrt_source & I2C_IC_TX_ABRT_SOURCE_TX_FLUSH_CNT_BITS) >> I2C_IC_TX_ABRT_SOURCE_TX_FLUSH_CNT_LSB;
+        hw->clr_tx_abrt;
+        transaction_end_read(slave, hw, flushed);
+    }
+    if (intr_stat & I2C_IC_INTR_STAT_R_RX_FULL_BITS)
+    {
+        transaction_drain(slave, hw);
+    }
+    if (intr_stat & I2C_IC_INTR_STAT_R_STOP_DET_BITS)
+    {
+        hw->clr_stop_det;
+        transaction_drain(slave, hw);
+        transaction_end_read(slave, hw, hw->txflr); // a read followed by a Restart and a write ends before the message
+        transaction_deliver(slave, hw);
+    }
+    if (intr_stat & I2C_IC_INTR_STAT_R_RD_REQ_BITS)
+    {
+        hw->clr_rd_req;
+        transaction_drain(slave, hw);
+        if (slave->rx_len > 0)
+        {
+            transaction_end_read(slave, hw, hw->txflr); // read before the write phase, if any
+            transaction_deliver(slave, hw);             // write phase before the Restart, the read starts a new response
+        }
+        if (slave->tx_pos >= slave->tx_len)
+        {
+            slave->tx_pos = 0;
+            slave->tx_len = slave->tx_handler(slave->i2c, slave->tx_total, &slave->tx_buf);
+        }
+        if (slave->tx_len == 0)
+        {
+            hw->data_cmd = I2C_SLAVE_FILL_BYTE; // the master is held until a byte is written
+            slave->tx_total++;
+        }
+        transaction_fill(slave, hw);
+    }
+    else if (intr_stat & I2C_IC_INTR_STAT_R_TX_EMPTY_BITS)
+    {
+        transaction_fill(slave, hw);
     }
 }
 
 static void __not_in_flash_func(i2c0_slave_irq_handler)()
 {
-    i2c_slave_irq_handler(&i2c_slaves[0]);
+    if (i2c_slaves[0].rx_handler != NULL)
+    {
+        i2c_slave_transaction_irq(&i2c_slaves[0]);
+    }
+    else
+    {
+        i2c_slave_irq_handler(&i2c_slaves[0]);
+    }
 }
 
 static void __not_in_flash_func(i2c1_slave_irq_handler)()
 {
-    i2c_slave_irq_handler(&i2c_slaves[1]);
+    if (i2c_slaves[1].rx_handler != NULL)
+    {
+        i2c_slave_transaction_irq(&i2c_slaves[1]);
+    }
+    else
+    {
+        i2c_slave_irq_handler(&i2c_slaves[1]);
+    }
 }
 
-void i2c_slave_init(i2c_inst_t* i2c, uint8_t address, i2c_slave_handler_t handler)
+static void i2c_slave_setup(i2c_inst_t* i2c, uint8_t address, uint32_t intr_mask)
 {
-    assert(i2c == i2c0 || i2c == i2c1);
-    assert(handler != NULL);
-
     uint i2c_index = i2c_hw_index(i2c);
-    i2c_slave_t* slave = &i2c_slaves[i2c_index];
-    slave->i2c = i2c;
-    slave->handler = handler;
 
     // Note: The I2C slave does clock stretching implicitly after a RD_REQ, while the Tx FIFO is empty.
-    // There is also an option to enable clock stretching while the Rx FIFO is full, but we leave it
-    // disabled since the Rx FIFO should never fill up (unless slave->handler() is way too slow).
+    // Clock stretching while the Rx FIFO is full is also enabled: at 1 MHz a burst can fill the FIFO
+    // before the handler runs, the master is then held instead of the next byte being lost.
     i2c_set_slave_mode(i2c, true, address);
 
     i2c_hw_t* hw = i2c_get_hw(i2c);
+    hw->enable = 0; // IC_CON is writable only while the controller is disabled
+    hw_set_bits(&hw->con, I2C_IC_CON_RX_FIFO_FULL_HLD_CTRL_BITS);
+    hw->ack_general_call = 0; // acknowledged at reset, ignored until i2c_slave_set_general_call()
+    hw->enable = I2C_IC_ENABLE_ENABLE_BITS;
+
     // unmask necessary interrupts
-    hw->intr_mask = I2C_IC_INTR_MASK_M_RX_FULL_BITS | I2C_IC_INTR_MASK_M_RD_REQ_BITS | I2C_IC_RAW_INTR_STAT_TX_ABRT_BITS |
-                    I2C_IC_INTR_MASK_M_STOP_DET_BITS | I2C_IC_INTR_MASK_M_START_DET_BITS;
+    hw->intr_mask = intr_mask;
 
     // enable interrupt for current core
     uint num = I2C0_IRQ + i2c_index;
@@ -102,6 +288,54 @@ void i2c_slave_init(i2c_inst_t* i2c, uint8_t address, i2c_slave_handler_t handle
     irq_set_enabled(num, true);
 }
 
+void i2c_slave_init(i2c_inst_t* i2c, uint8_t address, i2c_slave_handler_t handler)
+{
+    assert(i2c == i2c0 || i2c == i2c1);
+    assert(handler != NULL);
+
+    i2c_slave_t* slave = &i2c_slaves[i2c_hw_index(i2c)];
+    slave->i2c = i2c;
+    slave->handler = handler;
+    slave->dropped = false;
+    slave->rx_handler = NULL;
+
+    i2c_get_hw(i2c)->rx_tl = 0; // one interrupt per byte
+    i2c_slave_setup(i2c, address,
+                    I2C_IC_INTR_MASK_M_RX_FULL_BITS | I2C_IC_INTR_MASK_M_RD_REQ_BITS | I2C_IC_RAW_INTR_STAT_TX_ABRT_BITS |
+                        I2C_IC_INTR_MASK_M_STOP_DET_BITS | I2C_IC_INTR_MASK_M_START_DET_BITS);
+}
+
+void i2c_slave_transaction_init(i2c_inst_t* i2c, uint8_t address, uint8_t* rx_buf, size_t rx_size, i2c_slave_rx_handler_t rx_handler,
+                                i2c_slave_tx_handler_t tx_handler, i2c_slave_tx_end_handler_t tx_end_handler)
+{
+    assert(i2c == i2c0 || i2c == i2c1);
+    assert(rx_buf != NULL && rx_size > 0);
+    assert(rx_handler != NULL && tx_handler != NULL && tx_end_handler != NULL);
+
+    i2c_slave_t* slave = &i2c_slaves[i2c_hw_index(i2c)];
+    slave->i2c = i2c;
+    slave->handler = NULL;
+    slave->dropped = false;
+    slave->rx_handler = rx_handler;
+    slave->tx_handler = tx_handler;
+    slave->tx_end_handler = tx_end_handler;
+    slave->rx_buf = rx_buf;
+    slave->rx_size = rx_size;
+    slave->rx_len = 0;
+    slave->tx_len = 0;
+    slave->tx_pos = 0;
+    slave->tx_total = 0;
+
+    // Start is not needed: messages are split at the Stop and at the first data byte of each transfer.
+    // TX_EMPTY is unmasked only while a response is being fed.
+    i2c_hw_t* hw = i2c_get_hw(i2c);
+    hw->rx_tl = I2C_RX_LEVEL - 1;
+    hw->tx_tl = I2C_TX_LEVEL;
+    i2c_slave_setup(i2c, address,
+                    I2C_IC_INTR_MASK_M_RX_FULL_BITS | I2C_IC_INTR_MASK_M_RD_REQ_BITS | I2C_IC_INTR_MASK_M_TX_ABRT_BITS |
+                        I2C_IC_INTR_MASK_M_STOP_DET_BITS);
+}
+
 void i2c_slave_deinit(i2c_inst_t* i2c)
 {
     assert(i2c == i2c0 || i2c == i2c1);
@@ -113,6 +347,11 @@ void i2c_slave_deinit(i2c_inst_t* i2c)
     slave->i2c = NULL;
     slave->handler = NULL;
     slave->transfer_in_progress = false;
+    slave->general_call = false;
+    slave->dropped = false;
+    slave->rx_handler = NULL;
+    slave->tx_handler = NULL;
+    slave->tx_end_handler = NULL;
 
     uint num = I2C0_IRQ + i2c_index;
     irq_set_enabled(num, false);
@@ -120,6 +359,56 @@ void i2c_slave_deinit(i2c_inst_t* i2c)
 
     i2c_hw_t* hw = i2c_get_hw(i2c);
     hw->intr_mask = I2C_IC_INTR_MASK_RESET;
+    hw->rx_tl = 0;
+    hw->tx_tl = 0;
+    hw->ack_general_call = I2C_IC_ACK_GENERAL_CALL_ACK_GEN_CALL_BITS; // reset value
 
     i2c_set_slave_mode(i2c, false, 0);
 }
+
+void __not_in_flash_func(i2c_slave_drop)(i2c_inst_t* i2c)
+{
+    assert(i2c == i2c0 || i2c == i2c1);
+
+    i2c_slave_t* slave = &i2c_slaves[i2c_hw_index(i2c)];
+    i2c_hw_t* hw = i2c_get_hw(i2c);
+    if (slave->dropped)
+    {
+        return;
+    }
+    // masked until the resume: the Rx FIFO is flushed only once the controller is idle
+    slave->intr_mask = hw->intr_mask;
+    hw->intr_mask = 0;
+    hw->enable = 0;
+    slave->dropped = true;
+}
+
+void __not_in_flash_func(i2c_slave_resume)(i2c_inst_t* i2c)
+{
+    assert(i2c == i2c0 || i2c == i2c1);
+
+    i2c_slave_t* slave = &i2c_slaves[i2c_hw_index(i2c)];
+    i2c_hw_t* hw = i2c_get_hw(i2c);
+    if (!slave->dropped)
+    {
+        return;
+    }
+    hw->clr_intr;
+    hw->enable = I2C_IC_ENABLE_ENABLE_BITS;
+    hw->intr_mask = slave->intr_mask;
+    slave->dropped = false;
+}
+
+void __not_in_flash_func(i2c_slave_set_general_call)(i2c_inst_t* i2c, bool enable)
+{
+    assert(i2c == i2c0 || i2c == i2c1);
+
+    i2c_get_hw(i2c)->ack_general_call = enable ? I2C_IC_ACK_GENERAL_CALL_ACK_GEN_CALL_BITS : 0;
+}
+
+bool __not_in_flash_func(i2c_slave_is_general_call)(i2c_inst_t* i2c)
+{
+    assert(i2c == i2c0 || i2c == i2c1);
+
+    return i2c_slaves[i2c_hw_index(i2c)].general_call;
+}
@@ -27,6 +27,8 @@ extern "C"
         I2C_SLAVE_RECEIVE, /**< Data from master is available for reading. Slave must read from Rx FIFO. */
         I2C_SLAVE_REQUEST, /**< Master is requesting data. Slave must write into Tx FIFO. */
         I2C_SLAVE_FINISH,  /**< Master has sent a Stop or Restart signal. Slave may prepare for the next transfer. */
+        I2C_SLAVE_RESTART, /**< Master has sent a Restart, sent after I2C_SLAVE_FINISH. A read usually follows, the slave may
+                                prepare its response before the read request. */
     } i2c_slave_event_t;
 
     /**
@@ -42,6 +44,53 @@ extern "C"
      */
     typedef void (*i2c_slave_handler_t)(i2c_inst_t* i2c, i2c_slave_event_t event);
 
+    /**
+     * \brief I2C slave message handler, transaction mode
+     *
+     * Called from the I2C ISR with a complete message written by the master, at the Stop, at the
+     * first byte of the next write or at the read request after a Restart. The data is in the buffer
+     * given to `i2c_slave_transaction_init()` and is valid until the handler returns. Bytes beyond
+     * the buffer size are dropped.
+     *
+     * \param i2c Slave I2C instance.
+     * \param address 7-bit address the message was sent to, 0 for the general call address.
+     * \param data Received bytes.
+     * \param len Number of bytes received.
+     */
+    typedef void (*i2c_slave_rx_handler_t)(i2c_inst_t* i2c, uint8_t address, const uint8_t* data, size_t len);
+
+    /**
+     * \brief I2C slave response handler, transaction mode
+     *
+     * Called from the I2C ISR when the master starts reading, after the message written before the
+     * Restart was handed to the message handler, and again each time the master reads past the end
+     * of the response. The driver feeds the Tx FIFO from the buffer, which must stay valid until the
+     * end handler is called. The part not read by the master is discarded, so a response longer than
+     * one byte must not have side effects on the bytes after the first one: the end handler tells how
+     * many bytes were read.
+     *
+     * \param i2c Slave I2C instance.
+     * \param offset Response bytes already fed in this read, 0 at the start of the read. They were all
+     *               read by the master. A read after a Restart following an other read without write
+     *               continues the count.
+     * \param data Set to the response buffer.
+     * \return size_t Response length, 0 returns `I2C_SLAVE_FILL_BYTE` for the byte read.
+     */
+    typedef size_t (*i2c_slave_tx_handler_t)(i2c_inst_t* i2c, size_t offset, const uint8_t** data);
+
+    /**
+     * \brief I2C slave end of read handler, transaction mode
+     *
+     * Called from the I2C ISR once per read, at the Stop, at the message written after a Restart or at
+     * the flush of the bytes left when the next read starts. Not called for a read without response.
+     *
+     * \param i2c Slave I2C instance.
+     * \param len Response bytes read by the master, the bytes fed but not read are excluded.
+     */
+    typedef void (*i2c_slave_tx_end_handler_t)(i2c_inst_t* i2c, size_t len);
+
+#define I2C_SLAVE_FILL_BYTE 0xff ///< Byte returned in transaction mode when no response is available.
+
     /**
      * \brief Configure I2C instance for slave mode.
      *
@@ -52,6 +101,69 @@ extern "C"
      */
     void i2c_slave_init(i2c_inst_t* i2c, uint8_t address, i2c_slave_handler_t handler);
 
+    /**
+     * \brief Configure I2C instance for slave mode, transaction mode.
+     *
+     * The driver drains the Rx FIFO into `rx_buf` and calls `rx_handler` once per message, and feeds
+     * the Tx FIFO from the buffer returned by `tx_handler`. A write costs one interrupt per 12 bytes
+     * plus the Stop, a read one interrupt at the start, one per refill of the Tx FIFO and the Stop,
+     * instead of one per byte in event mode.
+     *
+     * \param i2c I2C instance.
+     * \param address 7-bit slave address.
+     * \param rx_buf Buffer receiving the messages written by the master.
+     * \param rx_size Size of rx_buf.
+     * \param rx_handler Called with each message written by the master.
+     * \param tx_handler Called when the master reads, returns the response.
+     * \param tx_end_handler Called at the end of a read with the response bytes read.
+     */
+    void i2c_slave_transaction_init(i2c_inst_t* i2c, uint8_t address, uint8_t* rx_buf, size_t rx_size, i2c_slave_rx_handler_t rx_handler,
+                                    i2c_slave_tx_handler_t tx_handler, i2c_slave_tx_end_handler_t tx_end_handler);
+
+    /**
+     * \brief Acknowledge the general call address (0x00) in addition to the slave address.
+     *
+     * Off after init. Writes to the general call address are delivered like the writes to the slave
+     * address, `i2c_slave_is_general_call()` tells them apart. The controller never answers a read
+     * of the general call address.
+     *
+     * \param i2c I2C instance.
+     * \param enable true to acknowledge the general call address.
+     */
+    void i2c_slave_set_general_call(i2c_inst_t* i2c, bool enable);
+
+    /**
+     * \brief Check if the current transfer was sent to the general call address.
+     *
+     * Valid in the I2C_SLAVE_RECEIVE and I2C_SLAVE_FINISH events, event mode only. In transaction
+     * mode the message handler receives address 0 instead. Runs from RAM like the interrupt handler.
+     *
+     * \param i2c I2C instance.
+     * \return true for a general call write.
+     */
+    bool i2c_slave_is_general_call(i2c_inst_t* i2c);
+
+    /**
+     * \brief Drop the current transfer, event mode.
+     *
+     * The controller is disabled until `i2c_slave_resume()`: the bytes written by the master are
+     * NACKed and a read returns 0xff. Called from the event handler, the I2C_SLAVE_FINISH event
+     * follows when the handler returns, the Stop of the dropped transfer being never detected. Runs
+     * from RAM like the interrupt handler.
+     *
+     * \param i2c I2C instance.
+     */
+    void i2c_slave_drop(i2c_inst_t* i2c);
+
+    /**
+     * \brief Enable the controller again after `i2c_slave_drop()`, the next transfer is served.
+     *
+     * Can be called from an other interrupt of the same priority. Runs from RAM.
+     *
+     * \param i2c I2C instance.
+     */
+    void i2c_slave_resume(i2c_inst_t* i2c);
+
     /**
      * \brief Restore I2C instance to master mode.
      *
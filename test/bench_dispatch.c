@@ -0,0 +1,264 @@
+/**
+ * @file    bench_dispatch.c
+ * @author  Daniel Lockhead
+ * @date    2024
+ *
+ * @brief   Host benchmark of the I2C command dispatch, switch statements against cmd_table
+ *
+ * @details Both dispatchers of i2c_slave_handler() are rebuilt here with the command numbers of the
+ *          firmware: the two switch statements used before the handler table, and the 256-entry
+ *          table indexed by the command byte. Every command does the same work in both versions, one
+ *          call to a stub standing for the SDK call, so only the dispatch differs.
+ *
+ *          The host numbers compare the code paths only. On the RP2040 the table and its handlers
+ *          also run from RAM, while the switch ran from flash through the XIP cache, which this
+ *          benchmark cannot show.
+ *
+ *          Usage: bench_dispatch [rounds], each round sends BENCH_SEQUENCE commands to each dispatcher.
+ *
+ * @copyright Copyright (c) 2024, D.Lockhead. All rights reserved.
+ *
+ * This software is licensed under the BSD 3-Clause License.
+ * See the LICENSE file for more details.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define BENCH_SEQUENCE 4096 ///< Commands in the pseudo random sequence, power of two.
+#define BENCH_ROUNDS 2000   ///< Default number of rounds.
+
+// clang-format off
+/**
+ * @brief Write commands of the firmware (I2C_SLAVE_RECEIVE, second byte).
+ */
+#define WRITE_COMMANDS X(10) X(11) X(20) X(21) X(30) X(31) X(32) X(33) X(41) X(50) X(51) X(60) X(61) X(80) X(81) \
+                       X(93) X(101) X(102) X(103) X(111) X(112) X(113) X(120)
+
+/**
+ * @brief Read commands of the firmware (I2C_SLAVE_REQUEST).
+ */
+#define READ_COMMANDS X(1) X(2) X(15) X(25) X(35) X(45) X(55) X(65) X(75) X(90) X(91) X(92) X(100) X(105) X(115) X(125)
+// clang-format on
+
+/**
+ * @brief Register file, as in cmd_context_t.
+ */
+typedef struct
+{
+    uint8_t reg[256]; ///< Register file.
+} bench_context_t;
+
+typedef void (*cmd_handler_t)(bench_context_t* ctx, uint8_t cmd);
+
+/**
+ * @brief Command table entry, as in the firmware.
+ */
+typedef struct
+{
+    cmd_handler_t write; ///< Called after the data byte is received, NULL if none.
+    cmd_handler_t read;  ///< Called before the register is returned, NULL if none.
+    uint8_t flags;       ///< CMD_xxx flags.
+} cmd_entry_t;
+
+static bench_context_t context;  ///< Register file shared by both dispatchers.
+static volatile uint32_t hw_sink; ///< Stands for the peripheral registers.
+static uint32_t hw_sum;           ///< Checksum of the calls, must match between the dispatchers.
+
+/**
+ * @brief Stub of the SDK call done by a command.
+ *
+ * @param op   Command number
+ * @param arg  Data byte
+ */
+static __attribute__((noinline)) void hw(uint8_t op, uint8_t arg)
+{
+    hw_sink = (uint32_t) op << 8 | arg;
+    hw_sum = hw_sum * 31 + hw_sink;
+}
+
+/**
+ * @brief Dispatch as done before the handler table: one switch for the writes, one for the reads.
+ *
+ * @param read  true for I2C_SLAVE_REQUEST, false for I2C_SLAVE_RECEIVE
+ * @param cmd   Command byte
+ */
+static __attribute__((noinline)) void dispatch_switch(bool read, uint8_t cmd)
+{
+    if (!read)
+    {
+        switch (cmd)
+        {
+#define X(n)                                                                                                                               \
+    case n:                                                                                                                                \
+        hw(n, context.reg[cmd]);                                                                                                           \
+        break;
+            WRITE_COMMANDS
+#undef X
+        }
+    }
+    else
+    {
+        switch (cmd)
+        {
+#define X(n)                                                                                                                               \
+    case n:                                                                                                                                \
+        hw(n, context.reg[cmd]);                                                                                                           \
+        break;
+            READ_COMMANDS
+#undef X
+        }
+    }
+}
+
+#define X(n)                                                                                                                               \
+    static void wr_##n(bench_context_t* ctx, uint8_t cmd)                                                                                  \
+    {                                                                                                                                      \
+        hw(n, ctx->reg[cmd]);                                                                                                              \
+    }
+WRITE_COMMANDS
+#undef X
+
+#define X(n)                                                                                                                               \
+    static void rd_##n(bench_context_t* ctx, uint8_t cmd)                                                                                  \
+    {                                                                                                                                      \
+        hw(n, ctx->reg[cmd]);                                                                                                              \
+    }
+READ_COMMANDS
+#undef X
+
+/**
+ * @brief Handler table, no command has both a write and a read handler in this benchmark.
+ */
+static const cmd_entry_t cmd_table[256] = {
+#define X(n) [n] = {wr_##n, NULL, 0},
+    WRITE_COMMANDS
+#undef X
+#define X(n) [n] = {NULL, rd_##n, 0},
+    READ_COMMANDS
+#undef X
+};
+
+/**
+ * @brief Dispatch through the handler table, as done by i2c_slave_handler().
+ *
+ * @param read  true for I2C_SLAVE_REQUEST, false for I2C_SLAVE_RECEIVE
+ * @param cmd   Command byte
+ */
+static __attribute__((noinline)) void dispatch_table(bool read, uint8_t cmd)
+{
+    const cmd_entry_t* entry = &cmd_table[cmd];
+    cmd_handler_t handler = read ? entry->read : entry->write;
+
+    if (handler != NULL)
+    {
+        handler(&context, cmd);
+    }
+}
+
+static uint8_t seq_cmd[BENCH_SEQUENCE]; ///< Command bytes of the sequence.
+static bool seq_read[BENCH_SEQUENCE];   ///< true for a read, false for a write.
+
+/**
+ * @brief Build a pseudo random sequence of known commands, with one unknown command in 16.
+ */
+static void make_sequence(void)
+{
+    static const uint8_t writes[] = {
+#define X(n) n,
+        WRITE_COMMANDS
+#undef X
+    };
+    static const uint8_t reads[] = {
+#define X(n) n,
+        READ_COMMANDS
+#undef X
+    };
+    uint32_t lcg = 12345;
+
+    for (int i = 0; i < BENCH_SEQUENCE; i++)
+    {
+        lcg = lcg * 1664525u + 1013904223u;
+        seq_read[i] = (lcg >> 31) != 0;
+        if (((lcg >> 8) & 15) == 0)
+        {
+            seq_cmd[i] = (uint8_t) (lcg >> 16); // mostly unknown commands
+        }
+        else if (seq_read[i])
+        {
+            seq_cmd[i] = reads[(lcg >> 16) % sizeof(reads)];
+        }
+        else
+        {
+            seq_cmd[i] = writes[(lcg >> 16) % sizeof(writes)];
+        }
+        context.reg[seq_cmd[i]] = (uint8_t) lcg;
+    }
+}
+
+/**
+ * @brief Return a monotonic time in ns.
+ */
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/**
+ * @brief Run the sequence through one dispatcher.
+ *
+ * @param dispatch  Dispatcher to measure
+ * @param rounds    Number of passes over the sequence
+ * @param sum       Checksum of the stub calls
+ * @return double  Mean time per dispatch in ns
+ */
+static double run(void (*dispatch)(bool, uint8_t), int rounds, uint32_t* sum)
+{
+    uint64_t start;
+
+    hw_sum = 0;
+    start = now_ns();
+    for (int r = 0; r < rounds; r++)
+    {
+        for (int i = 0; i < BENCH_SEQUENCE; i++)
+        {
+            dispatch(seq_read[i], seq_cmd[i]);
+        }
+    }
+    *sum = hw_sum;
+    return (double) (now_ns() - start) / ((double) rounds * BENCH_SEQUENCE);
+}
+
+int main(int argc, char** argv)
+{
+    int rounds = argc > 1 ? atoi(argv[1]) : BENCH_ROUNDS;
+    uint32_t sum_switch;
+    uint32_t sum_table;
+    double ns_switch;
+    double ns_table;
+
+    if (rounds <= 0)
+    {
+        rounds = 1;
+    }
+    make_sequence();
+    run(dispatch_switch, 1, &sum_switch); // warm up the caches
+    ns_switch = run(dispatch_switch, rounds, &sum_switch);
+    ns_table = run(dispatch_table, rounds, &sum_table);
+
+    printf("switch: %.2f ns/command\n", ns_switch);
+    printf("table:  %.2f ns/command\n", ns_table);
+
+    if (sum_switch != sum_table)
+    {
+        printf("dispatchers disagree: %08x != %08x\n", (unsigned) sum_switch, (unsigned) sum_table);
+        return 1;
+    }
+    return 0;
+}
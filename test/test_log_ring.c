@@ -0,0 +1,249 @@
+/**
+ * @file    test_log_ring.c
+ * @author  Daniel Lockhead
+ * @date    2024
+ *
+ * @brief   Host test of the event ring (log_ring.h)
+ *
+ * @details Built with QUEUE_SIZE = 8 so the ring fills and wraps quickly.
+ *
+ * @copyright Copyright (c) 2024, D.Lockhead. All rights reserved.
+ *
+ * This software is licensed under the BSD 3-Clause License.
+ * See the LICENSE file for more details.
+ */
+
+#include "log_ring.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#define STRESS_EVENTS 1000000u ///< Events sent by the producer thread of the stress test.
+
+static int failures = 0; ///< Number of failed checks.
+
+/**
+ * @brief Record a failed check without stopping the test.
+ */
+#define CHECK(cond)                                                                                                                        \
+    do                                                                                                                                     \
+    {                                                                                                                                      \
+        if (!(cond))                                                                                                                       \
+        {                                                                                                                                  \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);                                                                \
+            failures++;                                                                                                                    \
+        }                                                                                                                                  \
+    } while (0)
+
+/**
+ * @brief Reserve, fill and commit one event.
+ *
+ * @param ring   Ring to use
+ * @param value  Value stored in the event
+ * @return true if the event was queued, false if the ring is full.
+ */
+static bool push(log_ring_t* ring, uint32_t value)
+{
+    EVENT* ev = log_reserve(ring);
+
+    if (ev == NULL)
+    {
+        return false;
+    }
+    ev->time = value;
+    ev->value = value;
+    log_commit(ring);
+    return true;
+}
+
+/**
+ * @brief Peek and release the oldest event.
+ *
+ * @param ring   Ring to use
+ * @param value  Value of the event
+ * @return true if an event was read, false if the ring is empty.
+ */
+static bool pop(log_ring_t* ring, uint32_t* value)
+{
+    EVENT* ev = log_peek(ring);
+
+    if (ev == NULL)
+    {
+        return false;
+    }
+    *value = ev->value;
+    log_release(ring);
+    return true;
+}
+
+/**
+ * @brief Fill and drain the ring with the free running indexes crossing 2^32.
+ */
+static void test_wraparound(void)
+{
+    static log_ring_t ring;
+    uint32_t value;
+    uint32_t next = 0;
+
+    memset(&ring, 0, sizeof(ring));
+    ring.head = ring.tail = UINT32_MAX - 2;
+
+    for (uint32_t i = 0; i < QUEUE_SIZE; i++)
+    {
+        CHECK(push(&ring, i));
+    }
+    CHECK(log_count(&ring) == QUEUE_SIZE);
+    CHECK(!push(&ring, 99));
+    CHECK(ring.drop == 1);
+    CHECK(ring.head == UINT32_MAX - 2 + QUEUE_SIZE); // wrapped past zero
+
+    // keep the ring full across the wrap, in order
+    for (uint32_t i = QUEUE_SIZE; i < 4 * QUEUE_SIZE; i++)
+    {
+        CHECK(pop(&ring, &value));
+        CHECK(value == next++);
+        CHECK(push(&ring, i));
+        CHECK(log_count(&ring) == QUEUE_SIZE);
+    }
+    while (pop(&ring, &value))
+    {
+        CHECK(value == next++);
+    }
+    CHECK(next == 4 * QUEUE_SIZE);
+    CHECK(log_count(&ring) == 0);
+    CHECK(log_peek(&ring) == NULL);
+    CHECK(ring.drop == 1);
+}
+
+/**
+ * @brief A full ring drops and counts the events, one release makes room for exactly one event.
+ */
+static void test_full_and_drop(void)
+{
+    static log_ring_t ring;
+    uint32_t value;
+
+    memset(&ring, 0, sizeof(ring));
+    CHECK(log_peek(&ring) == NULL);
+    CHECK(log_count(&ring) == 0);
+
+    for (uint32_t i = 0; i < QUEUE_SIZE; i++)
+    {
+        CHECK(push(&ring, i));
+    }
+    for (uint32_t i = 0; i < 5; i++)
+    {
+        CHECK(!push(&ring, 100 + i));
+    }
+    CHECK(ring.drop == 5);
+    CHECK(log_count(&ring) == QUEUE_SIZE);
+
+    CHECK(pop(&ring, &value));
+    CHECK(value == 0);
+    CHECK(push(&ring, QUEUE_SIZE));
+    CHECK(!push(&ring, 200));
+    CHECK(ring.drop == 6);
+
+    // the dropped events never appear
+    for (uint32_t i = 1; i <= QUEUE_SIZE; i++)
+    {
+        CHECK(pop(&ring, &value));
+        CHECK(value == i);
+    }
+    CHECK(!pop(&ring, &value));
+}
+
+/**
+ * @brief State shared by the two threads of the stress test.
+ */
+typedef struct
+{
+    log_ring_t ring; ///< Ring under test.
+    uint32_t full;   ///< Reserve calls of the producer that found the ring full.
+    uint32_t errors; ///< Events received out of order or with a torn record.
+} stress_t;
+
+/**
+ * @brief Producer thread: sends 0..STRESS_EVENTS-1, retrying while the ring is full.
+ */
+static void* stress_producer(void* arg)
+{
+    stress_t* st = arg;
+
+    for (uint32_t i = 0; i < STRESS_EVENTS; i++)
+    {
+        while (!push(&st->ring, i))
+        {
+            st->full++;
+            sched_yield(); // the host may run both threads on one CPU
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Consumer thread: every event must arrive once, in order, with both fields written.
+ */
+static void* stress_consumer(void* arg)
+{
+    stress_t* st = arg;
+    uint32_t next = 0;
+
+    while (next < STRESS_EVENTS)
+    {
+        EVENT* ev = log_peek(&st->ring);
+
+        if (ev == NULL)
+        {
+            sched_yield();
+            continue;
+        }
+        if (ev->value != next || ev->time != next)
+        {
+            st->errors++;
+        }
+        next++;
+        log_release(&st->ring);
+    }
+    return NULL;
+}
+
+/**
+ * @brief One producer and one consumer thread running concurrently on the same ring.
+ */
+static void test_stress(void)
+{
+    static stress_t st;
+    pthread_t producer;
+    pthread_t consumer;
+
+    memset(&st, 0, sizeof(st));
+    st.ring.head = st.ring.tail = UINT32_MAX - 1000; // wrap during the run
+
+    CHECK(pthread_create(&consumer, NULL, stress_consumer, &st) == 0);
+    CHECK(pthread_create(&producer, NULL, stress_producer, &st) == 0);
+    pthread_join(producer, NULL);
+    pthread_join(consumer, NULL);
+
+    CHECK(st.errors == 0);
+    CHECK(st.ring.drop == st.full);
+    CHECK(log_count(&st.ring) == 0);
+    printf("stress: %u events, ring full %u times\n", STRESS_EVENTS, st.full);
+}
+
+int main(void)
+{
+    test_wraparound();
+    test_full_and_drop();
+    test_stress();
+
+    if (failures != 0)
+    {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}
@@ -0,0 +1,371 @@
+/**
+ * @file    test_script.c
+ * @author  Daniel Lockhead
+ * @date    2024
+ *
+ * @brief   Host test of the bytecode script engine (script.c)
+ *
+ * @details script_task() runs against a fake script_io_t: the writes are recorded, GPIO levels
+ *          follow the set and clear commands, and the time is set by the test.
+ *
+ * @copyright Copyright (c) 2024, D.Lockhead. All rights reserved.
+ *
+ * This software is licensed under the BSD 3-Clause License.
+ * See the LICENSE file for more details.
+ */
+
+#include "script.h"
+#include <stdio.h>
+
+#define CMD_REFUSED 0xee ///< Command refused by the fake, like an unknown command of the firmware.
+#define TASK_CALLS 1000  ///< Calls of script_task() before a script is considered stuck.
+
+static int failures = 0; ///< Number of failed checks.
+
+/**
+ * @brief Record a failed check without stopping the test.
+ */
+#define CHECK(cond)                                                                                                                        \
+    do                                                                                                                                     \
+    {                                                                                                                                      \
+        if (!(cond))                                                                                                                       \
+        {                                                                                                                                  \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);                                                                \
+            failures++;                                                                                                                    \
+        }                                                                                                                                  \
+    } while (0)
+
+/// Commands of the I2C master refused by the firmware in a script (CMD_NOSCRIPT): log stream (92), status (100),
+/// SPI pattern counters (118) and snapshot (181). Reading them would steal bytes or the done bit from the master.
+static const uint8_t master_only[] = {92, 100, 118, 181};
+
+static uint8_t gpio_level[32]; ///< Levels returned by command 15.
+static uint32_t writes;        ///< Write commands executed.
+static uint8_t last_cmd;       ///< Last write command.
+static uint8_t last_data;      ///< Data byte of the last write command.
+static uint32_t now;           ///< Time returned to the script.
+
+/**
+ * @brief Check if the fake refuses a command, like the firmware.
+ */
+static bool refused(uint8_t cmd)
+{
+    for (unsigned i = 0; i < sizeof(master_only); i++)
+    {
+        if (cmd == master_only[i])
+        {
+            return true;
+        }
+    }
+    return cmd == CMD_REFUSED;
+}
+
+/**
+ * @brief Write command: records it, commands 10 and 11 change the GPIO level.
+ */
+static bool fake_write(uint8_t cmd, uint8_t data)
+{
+    if (refused(cmd))
+    {
+        return false;
+    }
+    if (cmd == 10 || cmd == 11)
+    {
+        gpio_level[data & 31] = cmd == 11;
+    }
+    writes++;
+    last_cmd = cmd;
+    last_data = data;
+    return true;
+}
+
+/**
+ * @brief Read command: command 15 returns the GPIO level, the others return param ^ 0x5a.
+ */
+static bool fake_read(uint8_t cmd, uint8_t param, uint8_t* value)
+{
+    if (refused(cmd))
+    {
+        return false;
+    }
+    *value = cmd == 15 ? gpio_level[param & 31] : param ^ 0x5a;
+    return true;
+}
+
+/**
+ * @brief Time set by the test.
+ */
+static uint32_t fake_time_us(void)
+{
+    return now;
+}
+
+static const script_io_t io = {fake_write, fake_read, fake_time_us};
+
+/**
+ * @brief Upload and start a script, with the fake in its initial state.
+ *
+ * @param script  Script bytes
+ * @param len     Number of bytes
+ */
+static void start(const uint8_t* script, uint32_t len)
+{
+    for (int i = 0; i < 32; i++)
+    {
+        gpio_level[i] = 0;
+    }
+    writes = 0;
+    now = 0;
+
+    script_reset();
+    for (uint32_t i = 0; i < len; i++)
+    {
+        CHECK(script_load(script[i]));
+    }
+    CHECK(script_start());
+    CHECK(script_state() == SCRIPT_BUSY);
+}
+
+/**
+ * @brief Call script_task() until the script ends.
+ *
+ * @return uint32_t  Number of calls, TASK_CALLS if the script did not end
+ */
+static uint32_t run(void)
+{
+    uint32_t calls = 0;
+
+    while (calls < TASK_CALLS)
+    {
+        calls++;
+        if (script_task(&io))
+        {
+            break;
+        }
+    }
+    return calls;
+}
+
+/**
+ * @brief Writes and END give PASS, with the pc on the END.
+ */
+static void test_pass(void)
+{
+    const uint8_t script[] = {OP_DIR, 3, 1, OP_SET, 3, OP_CMD, 80, 1, OP_CLR, 3, OP_END};
+
+    start(script, sizeof(script));
+    run();
+    CHECK(script_state() == SCRIPT_PASS);
+    CHECK(script_pc() == 10);
+    CHECK(writes == 4);
+    CHECK(last_cmd == 10 && last_data == 3);
+    CHECK(!script_task(&io)); // nothing more to do
+
+    start((const uint8_t[]) {OP_END}, 1);
+    CHECK(script_task(&io));
+    CHECK(script_state() == SCRIPT_PASS);
+    CHECK(script_pc() == 0);
+}
+
+/**
+ * @brief A failed EXPECT or EXPECT_GET gives FAIL, with the pc on the failed opcode.
+ */
+static void test_expect_fail(void)
+{
+    const uint8_t expect[] = {OP_SET, 3, OP_EXPECT, 3, 1, OP_EXPECT, 4, 1, OP_SET, 5, OP_END};
+    const uint8_t expect_get[] = {OP_EXPECT_GET, 60, 0x10, 0x4a, OP_EXPECT_GET, 60, 0x10, 0x00, OP_END};
+
+    start(expect, sizeof(expect));
+    run();
+    CHECK(script_state() == SCRIPT_FAIL);
+    CHECK(script_pc() == 5);
+    CHECK(writes == 1); // stopped before the second SET
+
+    start(expect_get, sizeof(expect_get));
+    run();
+    CHECK(script_state() == SCRIPT_FAIL);
+    CHECK(script_pc() == 4);
+}
+
+/**
+ * @brief Nested loops, count 0 = 256, and the loop depth limit.
+ */
+static void test_loops(void)
+{
+    const uint8_t nested[] = {OP_LOOP, 3, OP_LOOP, 0, OP_CMD, 50, 1, OP_NEXT, OP_CMD, 51, 2, OP_NEXT, OP_END};
+    uint8_t deep[2 * (SCRIPT_LOOP_DEPTH + 1) + 1];
+    uint32_t len = 0;
+
+    start(nested, sizeof(nested));
+    CHECK(run() < TASK_CALLS);
+    CHECK(script_state() == SCRIPT_PASS);
+    CHECK(writes == 3 * 256 + 3);
+    CHECK(last_cmd == 51);
+
+    for (int i = 0; i <= SCRIPT_LOOP_DEPTH; i++)
+    {
+        deep[len++] = OP_LOOP;
+        deep[len++] = 1;
+    }
+    deep[len++] = OP_END;
+    start(deep, len);
+    run();
+    CHECK(script_state() == SCRIPT_ERROR);
+    CHECK(script_pc() == 2 * SCRIPT_LOOP_DEPTH); // the first LOOP over the limit
+
+    start((const uint8_t[]) {OP_NEXT, OP_END}, 2);
+    run();
+    CHECK(script_state() == SCRIPT_ERROR);
+    CHECK(script_pc() == 0);
+}
+
+/**
+ * @brief Truncated operands, missing END, unknown opcode and refused command give ERROR.
+ */
+static void test_errors(void)
+{
+    start((const uint8_t[]) {OP_SET, 1, OP_CMD, 50}, 4);
+    run();
+    CHECK(script_state() == SCRIPT_ERROR);
+    CHECK(script_pc() == 2);
+    CHECK(writes == 1);
+
+    start((const uint8_t[]) {OP_SET, 1}, 2);
+    run();
+    CHECK(script_state() == SCRIPT_ERROR);
+    CHECK(script_pc() == 2);
+
+    start((const uint8_t[]) {OP_SET, 1, 0x7f, OP_END}, 4);
+    run();
+    CHECK(script_state() == SCRIPT_ERROR);
+    CHECK(script_pc() == 2);
+
+    start((const uint8_t[]) {OP_CMD, CMD_REFUSED, 0, OP_END}, 4);
+    run();
+    CHECK(script_state() == SCRIPT_ERROR);
+    CHECK(script_pc() == 0);
+}
+
+/**
+ * @brief Reading or writing a command of the I2C master stops the script with ERROR, nothing is added to the results.
+ */
+static void test_master_only(void)
+{
+    for (unsigned i = 0; i < sizeof(master_only); i++)
+    {
+        start((const uint8_t[]) {OP_GET, 60, 0x10, OP_GET, master_only[i], 0, OP_END}, 7);
+        run();
+        CHECK(script_state() == SCRIPT_ERROR);
+        CHECK(script_pc() == 3);
+        CHECK(script_result_count() == 1);
+
+        start((const uint8_t[]) {OP_EXPECT_GET, master_only[i], 0, 0, OP_END}, 5);
+        run();
+        CHECK(script_state() == SCRIPT_ERROR);
+        CHECK(script_pc() == 0);
+
+        start((const uint8_t[]) {OP_CMD, master_only[i], 0, OP_END}, 4);
+        run();
+        CHECK(script_state() == SCRIPT_ERROR);
+        CHECK(writes == 0);
+    }
+}
+
+/**
+ * @brief The result buffer keeps SCRIPT_RESULT_SIZE values, one more read gives ERROR.
+ */
+static void test_results(void)
+{
+    const uint8_t script[] = {OP_LOOP, SCRIPT_RESULT_SIZE + 1, OP_GET, 60, 0x10, OP_NEXT, OP_END};
+    uint32_t ok = 0;
+
+    start(script, sizeof(script));
+    run();
+    CHECK(script_state() == SCRIPT_ERROR);
+    CHECK(script_pc() == 2);
+    CHECK(script_result_count() == SCRIPT_RESULT_SIZE);
+
+    for (int i = 0; i < SCRIPT_RESULT_SIZE; i++)
+    {
+        ok += script_result_byte() == (0x10 ^ 0x5a);
+    }
+    CHECK(ok == SCRIPT_RESULT_SIZE);
+    CHECK(script_result_byte() == 0); // after the last value
+    script_result_rewind();
+    CHECK(script_result_byte() == (0x10 ^ 0x5a));
+}
+
+/**
+ * @brief A wait whose deadline wraps past 2^32 us lasts its full time.
+ */
+static void test_wait_wrap(void)
+{
+    const uint8_t script[] = {OP_WAIT_US, 0x00, 0x02, OP_SET, 1, OP_END}; // 512 us
+
+    start(script, sizeof(script));
+    now = UINT32_MAX - 0xff; // deadline = 0x100
+    CHECK(!script_task(&io));
+    CHECK(script_state() == SCRIPT_BUSY);
+
+    now = UINT32_MAX;
+    CHECK(!script_task(&io));
+    now = 0xff;
+    CHECK(!script_task(&io));
+    CHECK(writes == 0);
+    CHECK(script_state() == SCRIPT_BUSY);
+
+    now = 0x100;
+    CHECK(script_task(&io));
+    CHECK(script_state() == SCRIPT_PASS);
+    CHECK(writes == 1);
+
+    // WAIT_MS 2: 2000 us
+    start((const uint8_t[]) {OP_WAIT_MS, 2, 0, OP_END}, 4);
+    now = UINT32_MAX - 999;
+    CHECK(!script_task(&io));
+    now = 999;
+    CHECK(!script_task(&io));
+    now = 1000;
+    CHECK(script_task(&io));
+    CHECK(script_state() == SCRIPT_PASS);
+}
+
+/**
+ * @brief Upload and start are refused while a script runs.
+ */
+static void test_busy(void)
+{
+    start((const uint8_t[]) {OP_WAIT_MS, 1, 0, OP_END}, 4);
+    CHECK(!script_task(&io));
+    CHECK(!script_start());
+    CHECK(!script_load(OP_END));
+    script_reset();
+    CHECK(script_state() == SCRIPT_BUSY);
+    now = 1000;
+    CHECK(script_task(&io));
+    CHECK(script_state() == SCRIPT_PASS);
+
+    script_reset();
+    CHECK(script_state() == SCRIPT_IDLE);
+    CHECK(!script_start()); // nothing loaded
+}
+
+int main(void)
+{
+    test_pass();
+    test_expect_fail();
+    test_loops();
+    test_errors();
+    test_master_only();
+    test_results();
+    test_wait_wrap();
+    test_busy();
+
+    if (failures != 0)
+    {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}